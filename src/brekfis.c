@@ -19,6 +19,7 @@
 #include "ekf.h"
 #include "data_structure.h"
 #include "math_function.h"
+#include "tensor.h"
 #include <stdlib.h>
 #include <string.h>
 #include <gsl/gsl_vector.h>
@@ -30,106 +31,390 @@
 #include "print_function.h"
 
 /**
- * This method implements a one-step brekfis
- * @param y the observations
- * @param total_time the number of total time points
- * @param config the configuration of the model
- * @param init the initial values for some parameters
- * @param param the model and user-defined function parameters
- * @return log-likelihood
+ * Results of model functions that depend on the parameters only, see ParamConfig::regime_switch_dependency.
+ * They are computed once per brekfis() call and only read by the subjects.
  */
-double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, double *y_time, const ParamConfig *config, ParamInit *init, Param *param){
-	int DEBUG_BREKFIS = 0; /*0=false/no; 1=true/yes*/
-	if(DEBUG_BREKFIS){
-		MYPRINT("Called brekfis\n");
+typedef struct ParamOnlyCache{
+	gsl_matrix *regime_switch_mat; /** func_regime_switch() output after the first time point, or NULL if it is not parameter-only **/
+	gsl_matrix **y_noise_cov; /** per regime, func_noise_cov() output after model_constraint_par(), or NULL if it is not parameter-only **/
+	gsl_matrix **eta_noise_cov;
+} ParamOnlyCache;
+
+static void param_only_cache_alloc(ParamOnlyCache *cache, gsl_vector **co_variate, const ParamConfig *config, const Param *param){
+	size_t regime;
+	const gsl_vector *co_variate_0=co_variate != NULL? co_variate[0] : NULL;
+	cache->regime_switch_mat=NULL;
+	cache->y_noise_cov=NULL;
+	cache->eta_noise_cov=NULL;
+	
+	if(config->regime_switch_dependency == DEPEND_PARAM){
+		cache->regime_switch_mat=gsl_matrix_alloc(config->num_regime, config->num_regime);
+		gsl_matrix_memcpy(cache->regime_switch_mat, param->regime_switch_mat);
+		config->func_regime_switch(0, 1, param->func_param, co_variate_0, cache->regime_switch_mat);
 	}
-    size_t t, regime_j, regime_k, sbj;
-    double neg_log_p, p, log_like=0;
-
-    size_t col_index;
-    double sum_overj;
-    size_t type;
+	
+	if(config->noise_cov_dependency == DEPEND_PARAM){
+		Param par;
+		par.func_param=param->func_param;
+		cache->y_noise_cov=tensor_matrix_alloc(config->num_regime, config->dim_obs_var, config->dim_obs_var);
+		cache->eta_noise_cov=tensor_matrix_alloc(config->num_regime, config->dim_latent_var, config->dim_latent_var);
+		for(regime=0; regime<config->num_regime; regime++){
+			par.y_noise_cov=cache->y_noise_cov[regime];
+			par.eta_noise_cov=cache->eta_noise_cov[regime];
+			gsl_matrix_memcpy(par.y_noise_cov, param->y_noise_cov);
+			gsl_matrix_memcpy(par.eta_noise_cov, param->eta_noise_cov);
+			config->func_noise_cov(0, regime, par.func_param, par.y_noise_cov, par.eta_noise_cov);
+			model_constraint_par(config, &par);
+		}
+	}
+}
 
-    /**************initialization*****************************************************************/
-     /** Input for EKF **/
-    gsl_vector **eta_j_t=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        eta_j_t[regime_j]=gsl_vector_alloc(config->dim_latent_var);
-    }
+static void param_only_cache_free(ParamOnlyCache *cache){
+	if(cache->regime_switch_mat != NULL){
+		gsl_matrix_free(cache->regime_switch_mat);
+	}
+	if(cache->y_noise_cov != NULL){
+		tensor_free(cache->y_noise_cov);
+		tensor_free(cache->eta_noise_cov);
+	}
+}
 
-    gsl_matrix **error_cov_j_t=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        error_cov_j_t[regime_j]=gsl_matrix_alloc(config->dim_latent_var, config->dim_latent_var);
+/**
+ * Scratch state used by brekfis() for one subject at a time.
+ * Each thread owns one of these, together with its own copies of the regime switch matrix
+ * and the noise covariance matrices, which are overwritten at every time point.
+ * The function parameters are shared and only read.
+ */
+typedef struct BrekfisWorkspace{
+	/** Input for EKF **/
+	gsl_vector **eta_j_t;
+	gsl_matrix **error_cov_j_t;
+	/** output for EKF **/
+	gsl_vector ***eta_jk_t_plus_1;
+	gsl_matrix ***error_cov_jk_t_plus_1;
+	gsl_vector ***innov_v;
+	gsl_matrix ***residual_cov;/*may be the inverse of the residual/innov cov*/
+	/** input for hamilton filter **/
+	gsl_vector *pr_t;
+	/** output for hamilton filter **/
+	gsl_matrix *like_jk;
+	double *neg_log_p_k; /** of the steps from the current regime j, for the regimes that share them **/
+	/** regime pairs not stepped, see ParamConfig::prune_threshold; NULL without pruning **/
+	bool *pruned_jk; /** row-major, per pair **/
+	size_t *prune_dominant; /** per regime k, the regime j of the pair into k with the largest prior mass, which is always stepped **/
+	double *prune_p; /** per regime k, the likelihood of the dominant pair **/
+	size_t num_pruned; /** pairs pruned and pairs in all, over the time points filtered so far **/
+	size_t num_pairs;
+	double prune_estimate; /** estimate of the change of the log-likelihood, over the time points filtered so far **/
+	double prune_mass; /** largest prior mass of the pruned pairs at a time point filtered so far **/
+	/** input for collapse_process**/
+	gsl_vector **collapse_vec; /** the steps from every regime j into the regime being collapsed **/
+	gsl_matrix **collapse_mat;
+	gsl_vector *diff_eta_vec;
+	/** scratch space of the EKF step **/
+	EKFWorkspace *ekf;
+	/** thread-local parameters **/
+	Param param;
+	/** parameter-only model function results shared by all threads, or NULL **/
+	const ParamOnlyCache *cache;
+} BrekfisWorkspace;
+
+static void brekfis_workspace_alloc(BrekfisWorkspace *ws, const ParamConfig *config, const Param *param){
+	ws->eta_j_t=tensor_vector_alloc(config->num_regime, config->dim_latent_var);
+	ws->error_cov_j_t=tensor_matrix_alloc(config->num_regime, config->dim_latent_var, config->dim_latent_var);
+	ws->eta_jk_t_plus_1=tensor_vector2_alloc(config->num_regime, config->num_regime, config->dim_latent_var);
+	ws->error_cov_jk_t_plus_1=tensor_matrix2_alloc(config->num_regime, config->num_regime, config->dim_latent_var, config->dim_latent_var);
+	ws->innov_v=tensor_vector2_alloc(config->num_regime, config->num_regime, config->dim_obs_var);
+	ws->residual_cov=tensor_matrix2_alloc(config->num_regime, config->num_regime, config->dim_obs_var, config->dim_obs_var);
+	
+	ws->pr_t=gsl_vector_alloc(config->num_regime);
+	ws->like_jk=gsl_matrix_alloc(config->num_regime, config->num_regime);
+	ws->neg_log_p_k=(double *)malloc(config->num_regime*sizeof(double));
+	if(config->prune_threshold > 0 && config->num_regime > 1){
+		ws->pruned_jk=(bool *)malloc(config->num_regime*config->num_regime*sizeof(bool));
+		ws->prune_dominant=(size_t *)malloc(config->num_regime*sizeof(size_t));
+		ws->prune_p=(double *)malloc(config->num_regime*sizeof(double));
+	}else{
+		ws->pruned_jk=NULL;
+		ws->prune_dominant=NULL;
+		ws->prune_p=NULL;
+	}
+	ws->num_pruned=0;
+	ws->num_pairs=0;
+	ws->prune_estimate=0;
+	ws->prune_mass=0;
+	ws->collapse_vec=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
+	ws->collapse_mat=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
+	ws->diff_eta_vec=gsl_vector_alloc(config->dim_latent_var);
+	ws->ekf=ekf_workspace_alloc(config);
+	/* brekfis_subject() passes the square-root factors along, see ekf_sqrt_collapse() */
+	ws->ekf->sqrt_carry=true;
+	
+	ws->param.func_param=param->func_param;
+	ws->param.regime_switch_mat=gsl_matrix_alloc(config->num_regime, config->num_regime);
+	ws->param.eta_noise_cov=gsl_matrix_alloc(config->dim_latent_var, config->dim_latent_var);
+	ws->param.y_noise_cov=gsl_matrix_alloc(config->dim_obs_var, config->dim_obs_var);
+	gsl_matrix_memcpy(ws->param.regime_switch_mat, param->regime_switch_mat);
+	gsl_matrix_memcpy(ws->param.eta_noise_cov, param->eta_noise_cov);
+	gsl_matrix_memcpy(ws->param.y_noise_cov, param->y_noise_cov);
+	ws->cache=NULL;
+}
 
-    }
+static void brekfis_workspace_free(BrekfisWorkspace *ws){
+	tensor_free(ws->eta_j_t);
+	tensor_free(ws->error_cov_j_t);
+	tensor_free(ws->eta_jk_t_plus_1);
+	tensor_free(ws->error_cov_jk_t_plus_1);
+	tensor_free(ws->innov_v);
+	tensor_free(ws->residual_cov);
+	
+	gsl_vector_free(ws->pr_t);
+	gsl_matrix_free(ws->like_jk);
+	free(ws->neg_log_p_k);
+	if(ws->pruned_jk!=NULL){
+		free(ws->pruned_jk);
+		free(ws->prune_dominant);
+		free(ws->prune_p);
+	}
+	free(ws->collapse_vec);
+	free(ws->collapse_mat);
+	gsl_vector_free(ws->diff_eta_vec);
+	ekf_workspace_free(ws->ekf);
+	
+	gsl_matrix_free(ws->param.regime_switch_mat);
+	gsl_matrix_free(ws->param.eta_noise_cov);
+	gsl_matrix_free(ws->param.y_noise_cov);
+}
 
-    /** output for EKF **/
-    gsl_vector ***eta_jk_t_plus_1=(gsl_vector ***)malloc(config->num_regime*sizeof(gsl_vector **));
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        eta_jk_t_plus_1[regime_j]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        for(regime_k=0; regime_k<config->num_regime; regime_k++)
-            eta_jk_t_plus_1[regime_j][regime_k]=gsl_vector_calloc(config->dim_latent_var);
-    }
-    gsl_matrix ***error_cov_jk_t_plus_1=(gsl_matrix ***)malloc(config->num_regime*sizeof(gsl_matrix **));
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        error_cov_jk_t_plus_1[regime_j]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-    }
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        for(regime_k=0; regime_k<config->num_regime; regime_k++)
-            error_cov_jk_t_plus_1[regime_j][regime_k]=gsl_matrix_calloc(config->dim_latent_var, config->dim_latent_var);
-    }
-    gsl_vector ***innov_v=(gsl_vector ***)malloc(config->num_regime*sizeof(gsl_vector **));
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        innov_v[regime_j]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        for(regime_k=0; regime_k<config->num_regime; regime_k++)
-            innov_v[regime_j][regime_k]=gsl_vector_calloc(config->dim_obs_var);
-    }
-    gsl_matrix ***residual_cov=(gsl_matrix ***)malloc(config->num_regime*sizeof(gsl_matrix **));
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        residual_cov[regime_j]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-    }
-    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-        for(regime_k=0; regime_k<config->num_regime; regime_k++)
-            residual_cov[regime_j][regime_k]=gsl_matrix_calloc(config->dim_obs_var, config->dim_obs_var);/*may be the inverse of the residual/innov cov*/
-    }
+KimRetained *kim_retained_alloc(const ParamConfig *config){
+	size_t nx=config->dim_latent_var, num_regime=config->num_regime;
+	size_t num_pair=config->total_obs*num_regime*num_regime;
+	KimRetained *retain=(KimRetained *)malloc(sizeof(KimRetained));
+	/*a continuous-time model integrated by the ODE solver has no transition matrix to keep*/
+	retain->jacob_dynam=NULL;
+	if(!config->isContinuousTime || config->exact_discretization){
+		retain->jacob_dynam=tensor_matrix3_alloc(config->total_obs, num_regime, num_regime, nx, nx);
+	}
+	retain->chol_error_cov_pred=tensor_matrix3_alloc(config->total_obs, num_regime, num_regime, nx, nx);
+	retain->has_jacob=(bool *)calloc(num_pair, sizeof(bool));
+	retain->has_chol=(bool *)calloc(num_pair, sizeof(bool));
+	return retain;
+}
 
-    /** input for hamilton filter **/
-	
-    gsl_vector *pr_t=gsl_vector_alloc(config->num_regime);
+void kim_retained_free(KimRetained *retain){
+	tensor_free(retain->jacob_dynam);
+	tensor_free(retain->chol_error_cov_pred);
+	free(retain->has_jacob);
+	free(retain->has_chol);
+	free(retain);
+}
 
-    double tran_prob_jk;
+/**
+ * Buffer of filtered moments used by EKimFilterStream().
+ * It holds at most chunk_size consecutive time points, starting at t_start.
+ */
+typedef struct FilterChunk{
+	size_t chunk_size;
+	size_t t_start;
+	size_t num_t;
+	gsl_vector **eta_t;
+	gsl_matrix **error_cov_t;
+	gsl_vector **pr_t;
+	void (*emit)(size_t, size_t, gsl_vector **, gsl_matrix **, gsl_vector **, void *);
+	void *sink;
+	bool perturb;
+	gsl_rng *seed;
+} FilterChunk;
+
+static void filter_chunk_flush(FilterChunk *chunk){
+	if(chunk->num_t > 0){
+		chunk->emit(chunk->t_start, chunk->num_t, chunk->eta_t, chunk->error_cov_t, chunk->pr_t, chunk->sink);
+	}
+	chunk->t_start+=chunk->num_t;
+	chunk->num_t=0;
+}
 
-    /** output for hamilton filter **/
-    gsl_matrix *like_jk=gsl_matrix_alloc(config->num_regime, config->num_regime);
-    /*gsl_vector *pr_t_plus_1=gsl_vector_alloc(config->num_regime);*/
+/**
+ * Collapse the regime-specific filtered estimates at time t over the regimes and append them to the chunk.
+ * Same computation as eta_t and error_cov_t in EKimFilter().
+ */
+static void filter_chunk_push(FilterChunk *chunk, size_t t, const ParamConfig *config, BrekfisWorkspace *ws){
+	if(chunk->num_t==0){
+		chunk->t_start=t;
+	}
+	gsl_vector_memcpy(chunk->pr_t[chunk->num_t], ws->pr_t);
+	mathfunction_collapse_moments(config->num_regime, ws->eta_j_t, ws->error_cov_j_t, ws->pr_t, 1.0,
+		chunk->eta_t[chunk->num_t], chunk->error_cov_t[chunk->num_t], ws->diff_eta_vec);
+	chunk->num_t++;
+	if(chunk->num_t==chunk->chunk_size){
+		filter_chunk_flush(chunk);
+	}
+}
 
-    /** input for collapse_process**/
-    gsl_vector *diff_eta_vec=gsl_vector_alloc(config->dim_latent_var);
-    gsl_matrix *diff_eta=gsl_matrix_alloc(config->dim_latent_var, 1);
-    gsl_matrix *modif_p=gsl_matrix_alloc(config->dim_latent_var, config->dim_latent_var);
+/**
+ * Adds the counters of one filter run to config->diagnostics, if any.
+ * Runs of the gradient and of the Hessian may add to it concurrently.
+ */
+static void brekfis_diagnostics_add(const ParamConfig *config, size_t num_alloc, size_t num_pinv, size_t num_pruned, size_t num_pairs,
+	double prune_estimate, double prune_mass){
+	FilterDiagnostics *diag=config->diagnostics;
+	if(diag==NULL){
+		return;
+	}
+	#ifdef _OPENMP
+	#pragma omp critical(brekfis_diagnostics)
+	#endif
+	{
+		diag->num_eval++;
+		diag->num_alloc+=num_alloc;
+		diag->num_pinv+=num_pinv;
+		diag->num_pruned+=num_pruned;
+		diag->num_pairs+=num_pairs;
+		if(prune_estimate > diag->prune_estimate){
+			diag->prune_estimate=prune_estimate;
+		}
+		if(prune_mass > diag->prune_mass){
+			diag->prune_mass=prune_mass;
+		}
+	}
+}
 
-	if(DEBUG_BREKFIS){
-		MYPRINT("Finished initializing brekfis\nStarting subject brekfis loop\n");
+void brekfis_diagnostics_print(const ParamConfig *config){
+	const FilterDiagnostics *diag=config->diagnostics;
+	if(diag==NULL || !config->verbose_flag){
+		return;
+	}
+	MYPRINT("Filter runs: %lu\n", (unsigned long) diag->num_eval);
+	MYPRINT("Heap allocations in the filter loop: %lu\n", (unsigned long) diag->num_alloc);
+	MYPRINT("Pseudo-inverse fallbacks of the innovation covariance: %lu\n", (unsigned long) diag->num_pinv);
+	if(config->prune_threshold > 0){
+		MYPRINT("Pruned regime pairs: %lu of %lu, largest prior probability of the pruned pairs at a time point: %g\n",
+			(unsigned long) diag->num_pruned, (unsigned long) diag->num_pairs, diag->prune_mass);
+		MYPRINT("Largest estimate of the change of the log-likelihood of a run by pruning: %g\n", diag->prune_estimate);
 	}
+}
 
+/**
+ * The first regime whose EKF step from the same regime j the step into regime_k can share.
+ * The steps into two regimes from the same j have the same prediction when the model compiler reports the same dynamics
+ * for them, see ParamConfig::dynam_regime_class, and at the first time point of a subject, where there is no prediction;
+ * they are the same altogether when the measurement is the same too.
+ * @param same_measure whether the whole step is shared, or only the prediction
+ * @param pruned the pruned pairs from regime j, which are not stepped, or NULL
+ * @return regime_k when no earlier regime shares the step
+ */
+static size_t brekfis_shared_regime(const ParamConfig *config, size_t regime_k, bool isFirstTime, bool same_measure, const bool *pruned){
+	size_t regime;
+	bool same_dynam, same_measurement;
+	for(regime=0; regime<regime_k; regime++){
+		if(pruned!=NULL && pruned[regime]){
+			continue;
+		}
+		same_dynam=isFirstTime || (config->dynam_regime_class!=NULL
+			&& config->dynam_regime_class[regime]==config->dynam_regime_class[regime_k]);
+		same_measurement=!same_measure || (config->measure_regime_class!=NULL
+			&& config->measure_regime_class[regime]==config->measure_regime_class[regime_k]);
+		if(same_dynam && same_measurement){
+			return regime;
+		}
+	}
+	return regime_k;
+}
 
-    /********************************************************************************/
+/**
+ * Marks the regime pairs whose prior mass Pr(S_{t-1}=j, S_t=k|Y_{t-1}) is below ParamConfig::prune_threshold.
+ * The pair with the largest mass into each regime k is never pruned, so that every regime has a step to collapse.
+ */
+static void brekfis_prune_pairs(const ParamConfig *config, const gsl_vector *pr_t, const gsl_matrix *regime_switch_mat, BrekfisWorkspace *ws){
+	size_t num_regime=config->num_regime, regime_j, regime_k, dominant;
+	double mass, max_mass;
+	for(regime_k=0; regime_k<num_regime; regime_k++){
+		dominant=0;
+		max_mass=-1;
+		for(regime_j=0; regime_j<num_regime; regime_j++){
+			mass=gsl_vector_get(pr_t, regime_j)*gsl_matrix_get(regime_switch_mat, regime_j, regime_k);
+			ws->pruned_jk[regime_j*num_regime+regime_k]=mass < config->prune_threshold;
+			if(mass > max_mass){
+				max_mass=mass;
+				dominant=regime_j;
+			}
+		}
+		ws->pruned_jk[dominant*num_regime+regime_k]=false;
+		ws->prune_dominant[regime_k]=dominant;
+	}
+}
 
+/**
+ * The pruned regime pairs take the step of the dominant pair into the same regime, with their own prior mass,
+ * which the collapse then folds into that regime.
+ * The likelihood of a pruned pair is not computed, so the change of the log-likelihood is only estimated: if it is no larger
+ * than the largest likelihood p_max of the stepped pairs, the true and the substituted contributions both lie in [0, m p_max]
+ * for the pruned mass m, and the log-likelihood of the time point changes by at most log(1 + m p_max / L) for the sum L of
+ * the stepped contributions. The pruned mass m itself is exact; the largest one is kept in ws->prune_mass.
+ * @return that estimate
+ */
+static double brekfis_fill_pruned(const ParamConfig *config, const gsl_vector *pr_t, const gsl_matrix *regime_switch_mat, double p_max, BrekfisWorkspace *ws){
+	size_t num_regime=config->num_regime, regime_j, regime_k, dominant;
+	double mass, mass_pruned=0, like_kept=0;
+	for(regime_j=0; regime_j<num_regime; regime_j++){
+		for(regime_k=0; regime_k<num_regime; regime_k++){
+			if(!ws->pruned_jk[regime_j*num_regime+regime_k]){
+				like_kept+=gsl_matrix_get(ws->like_jk, regime_j, regime_k);
+				continue;
+			}
+			dominant=ws->prune_dominant[regime_k];
+			mass=gsl_vector_get(pr_t, regime_j)*gsl_matrix_get(regime_switch_mat, regime_j, regime_k);
+			gsl_vector_memcpy(ws->eta_jk_t_plus_1[regime_j][regime_k], ws->eta_jk_t_plus_1[dominant][regime_k]);
+			gsl_matrix_memcpy(ws->error_cov_jk_t_plus_1[regime_j][regime_k], ws->error_cov_jk_t_plus_1[dominant][regime_k]);
+			ekf_sqrt_share(ws->ekf, regime_j, regime_k, dominant, regime_k);
+			gsl_matrix_set(ws->like_jk, regime_j, regime_k, mass*ws->prune_p[regime_k]);
+			mass_pruned+=mass;
+			ws->num_pruned++;
+		}
+	}
+	ws->num_pairs+=num_regime*num_regime;
+	if(mass_pruned > ws->prune_mass){
+		ws->prune_mass=mass_pruned;
+	}
+	return mass_pruned > 0? log1p(mass_pruned*p_max/like_kept) : 0.0;
+}
 
-        /*for(index=0; index<config->dim_latent_var; index++){
-            fprintf(h_file, " %lf", gsl_vector_get(eta_j_t[0], index));
-        }
-        fprintf(h_file,"\n");*/
-        /*FILE *eta_file=fopen("results/eta_t_ada.txt","w");*/
-        /*FILE *pr_file=fopen("regimeprob.txt","w");*/
+/**
+ * This method runs the brekfis over the time points of a single subject
+ * @param sbj the index of the subject
+ * @param ws the scratch state of the calling thread
+ * @param chunk if not NULL, receives the filtered moments of every time point
+ * @param score if not NULL, carries the derivatives of the filter along and adds those of the log-likelihood to score->d_log_like
+ * @return the log-likelihood contribution of subject sbj
+ */
+static double brekfis_subject(size_t sbj, gsl_vector ** y, gsl_vector **co_variate, double *y_time, const ParamConfig *config, ParamInit *init, BrekfisWorkspace *ws, FilterChunk *chunk, ScoreWorkspace *score){
+	int DEBUG_BREKFIS = 0; /*0=false/no; 1=true/yes*/
+	size_t t, regime_j, regime_k;
+	double neg_log_p, p, log_like=0;
 	
+	size_t col_index;
+	double sum_overj;
+	size_t type;
+	double tran_prob_jk;
+	
+	gsl_vector **eta_j_t=ws->eta_j_t;
+	gsl_matrix **error_cov_j_t=ws->error_cov_j_t;
+	gsl_vector ***eta_jk_t_plus_1=ws->eta_jk_t_plus_1;
+	gsl_matrix ***error_cov_jk_t_plus_1=ws->error_cov_jk_t_plus_1;
+	gsl_vector ***innov_v=ws->innov_v;
+	gsl_matrix ***residual_cov=ws->residual_cov;
+	gsl_vector *pr_t=ws->pr_t;
+	gsl_matrix *like_jk=ws->like_jk;
+	Param *param=&ws->param;
+	bool perturb=(chunk!=NULL)? chunk->perturb : false;
+	gsl_rng *seed=(chunk!=NULL)? chunk->seed : NULL;
+	/* the score and the random perturbation need every regime pair stepped on its own */
+	bool share_regime=config->num_regime>1 && score==NULL && !perturb;
+	size_t regime_s, regime_p;
+	bool prune=ws->pruned_jk!=NULL && score==NULL && !perturb;
+	const bool *pruned_j=NULL;
+	double p_max=0, prune_estimate;
 	
-	/********************************************************************************/
-	for(sbj=0; sbj < config->num_sbj; sbj++){
 		for(t=(config->index_sbj)[sbj]; t < (config->index_sbj)[sbj+1]; t++){
 			
 			
@@ -140,6 +425,9 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 				if (t==(config->index_sbj)[sbj]){
 					gsl_matrix_set_identity(param->regime_switch_mat);
 					gsl_vector_memcpy(pr_t, init->pr_0[sbj]);
+					if(score!=NULL){
+						score_first_time(score, sbj);
+					}
 					if(DEBUG_BREKFIS){
 						MYPRINT("initial regime probabilities:\n");
 						print_vector(pr_t);
@@ -147,7 +435,14 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 					}
 				}else{
 					type=1;
-					config->func_regime_switch(t, type, param->func_param, co_variate[t], param->regime_switch_mat);
+					if(ws->cache!=NULL && ws->cache->regime_switch_mat!=NULL){
+						gsl_matrix_memcpy(param->regime_switch_mat, ws->cache->regime_switch_mat);
+					}else{
+						config->func_regime_switch(t, type, param->func_param, co_variate[t], param->regime_switch_mat);
+					}
+					if(score!=NULL && regime_j==0){
+						score_regime_switch(score, t, type, co_variate[t], config, param->regime_switch_mat);
+					}
 				}
 				
 				if(DEBUG_BREKFIS){
@@ -170,8 +465,24 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 				if(DEBUG_BREKFIS){
 					MYPRINT("About to call func_noise_cov\n");
 				}
-				config->func_noise_cov(t, regime_j, param->func_param, param->y_noise_cov, param->eta_noise_cov);
-				model_constraint_par(config, param);
+				if(ws->cache!=NULL && ws->cache->eta_noise_cov!=NULL){
+					gsl_matrix_memcpy(param->y_noise_cov, ws->cache->y_noise_cov[regime_j]);
+					gsl_matrix_memcpy(param->eta_noise_cov, ws->cache->eta_noise_cov[regime_j]);
+				}else{
+					config->func_noise_cov(t, regime_j, param->func_param, param->y_noise_cov, param->eta_noise_cov);
+					model_constraint_par(config, param);
+				}
+				ws->ekf->noise_regime=regime_j;
+				if(score!=NULL){
+					score_noise_cov(score, t, regime_j, config, param);
+				}
+				if(prune){
+					if(regime_j==0){
+						brekfis_prune_pairs(config, pr_t, param->regime_switch_mat, ws);
+						p_max=0;
+					}
+					pruned_j=ws->pruned_jk+regime_j*config->num_regime;
+				}
 				
 				if(DEBUG_BREKFIS){
 					MYPRINT("Done with func_noise_cov\n");
@@ -186,6 +497,9 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 							gsl_vector_set(eta_j_t[regime_j], col_index, gsl_vector_get((init->eta_0)[regime_j], config->dim_latent_var*sbj+col_index));
 						}
 						gsl_matrix_memcpy(error_cov_j_t[regime_j], (init->error_cov_0)[regime_j]);
+						if(score!=NULL){
+							score_initial_state(score, sbj, regime_j, config);
+						}
 					}
 					
 					/*MYPRINT("eta_S_at_a_previous_time_point:\n");
@@ -195,32 +509,52 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 					print_matrix(error_cov_j_t[regime_j]);
 					MYPRINT("\n");*/
 					
-					gsl_vector *eta_garbage = gsl_vector_alloc(config->dim_latent_var);
-					gsl_matrix *error_garbage = gsl_matrix_calloc(config->dim_latent_var, config->dim_latent_var);
-					gsl_matrix *innov_garbage = gsl_matrix_calloc(config->dim_obs_var, config->dim_obs_var);
-					neg_log_p = ext_kalmanfilter(t, regime_k,
-						eta_j_t[regime_j], error_cov_j_t[regime_j],
-						y[t],co_variate[t],y_time,
-						param->eta_noise_cov, param->y_noise_cov,
-						param->func_param,config->num_func_param,
-						config->isContinuousTime,
-						config->func_measure,
-						config->func_dx_dt,
-						config->func_dP_dt,
-						config->func_dF_dx,
-						config->func_dynam,
-						config->func_jacob_dynam,
-						eta_garbage, //eta_pred,
-						error_garbage, //error_cov_pred,
-						eta_jk_t_plus_1[regime_j][regime_k],
-						error_cov_jk_t_plus_1[regime_j][regime_k],
-						innov_v[regime_j][regime_k],
-						residual_cov[regime_j][regime_k], /*inverse*/
-						innov_garbage, // innov_cov
-						isFirstTime, false, false, 0);
-					gsl_vector_free(eta_garbage);
-					gsl_matrix_free(error_garbage);
-					gsl_matrix_free(innov_garbage);
+					if(pruned_j!=NULL && pruned_j[regime_k]){
+						/* stepped after the other pairs, see brekfis_fill_pruned() */
+						continue;
+					}
+					
+					regime_s=share_regime? brekfis_shared_regime(config, regime_k, isFirstTime, true, pruned_j) : regime_k;
+					if(regime_s!=regime_k){
+						/* the same step as into regime_s */
+						gsl_vector_memcpy(eta_jk_t_plus_1[regime_j][regime_k], eta_jk_t_plus_1[regime_j][regime_s]);
+						gsl_matrix_memcpy(error_cov_jk_t_plus_1[regime_j][regime_k], error_cov_jk_t_plus_1[regime_j][regime_s]);
+						gsl_vector_memcpy(innov_v[regime_j][regime_k], innov_v[regime_j][regime_s]);
+						ekf_sqrt_share(ws->ekf, regime_j, regime_k, regime_j, regime_s);
+						neg_log_p=ws->neg_log_p_k[regime_s];
+					}else{
+						regime_p=share_regime? brekfis_shared_regime(config, regime_k, isFirstTime, false, pruned_j) : regime_k;
+						ws->ekf->pred_share=share_regime;
+						ws->ekf->pred_slot=regime_p;
+						ws->ekf->pred_replay=regime_p!=regime_k;
+						ws->ekf->track_step=t-(config->index_sbj)[sbj];
+						ws->ekf->sqrt_from=regime_j;
+						neg_log_p = ext_kalmanfilter(t, regime_k,
+							eta_j_t[regime_j], error_cov_j_t[regime_j],
+							y[t],co_variate[t],y_time,
+							param->eta_noise_cov, param->y_noise_cov,
+							param->func_param,config->num_func_param,
+							config->isContinuousTime,
+							config->func_measure,
+							config->func_dx_dt,
+							config->func_dP_dt,
+							config->func_dF_dx,
+							config->func_dynam,
+							config->func_jacob_dynam,
+							score!=NULL? score->eta_pred : NULL, //eta_pred, only used for return and the score
+							score!=NULL? score->error_cov_pred : NULL, //error_cov_pred, only used for return and the score
+							eta_jk_t_plus_1[regime_j][regime_k],
+							error_cov_jk_t_plus_1[regime_j][regime_k],
+							innov_v[regime_j][regime_k],
+							residual_cov[regime_j][regime_k], /*inverse*/
+							score!=NULL? score->innov_cov : NULL, // innov_cov, only used for return and the score
+							isFirstTime, score!=NULL, perturb, seed, config->miss_pattern, ws->ekf);
+						ws->neg_log_p_k[regime_k]=neg_log_p;
+					}
+					if(score!=NULL){
+						score_ekf(score, t, regime_j, regime_k, eta_j_t[regime_j], error_cov_j_t[regime_j],
+							y[t], co_variate[t], y_time, param->eta_noise_cov, param->func_param, isFirstTime, config, ws->ekf);
+					}
 					
 					/*MYPRINT("From regime %lu to regime %lu:\n",regime_j,regime_k);
 					MYPRINT("\n");
@@ -273,17 +607,37 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 					
 					/*p=exp(-neg_log_p)*tran_prob_jk;*/
 					gsl_matrix_set(like_jk, regime_j, regime_k, p*tran_prob_jk);
+					if(prune){
+						p_max=p > p_max? p : p_max;
+						if(ws->prune_dominant[regime_k]==regime_j){
+							ws->prune_p[regime_k]=p;
+						}
+					}
+					if(score!=NULL){
+						score_like(score, regime_j, regime_k, gsl_vector_get(pr_t, regime_j), gsl_matrix_get(param->regime_switch_mat, regime_j, regime_k), p, p!=tryP);
+					}
 					
 				}/*end of from regime j*/
 			}/*end of to regime k*/
 			/*Still inside the subject and time loops*/
 			
+			if(prune){
+				prune_estimate=brekfis_fill_pruned(config, pr_t, param->regime_switch_mat, p_max, ws);
+				ws->prune_estimate+=config->isnegloglikeweightedbyT?
+					prune_estimate/((config->index_sbj)[sbj+1]-(config->index_sbj)[sbj]) : prune_estimate;
+			}
+			
 			/** Step 2.3: update transit probability Pr(S_{t-1} = j,S_{t} = k|Y_t) given Pr(S_{t-1} = j,S_{t} = k|Y_{t-1})**/
+			double like_sum=mathfunction_matrix_normalize(like_jk);
 			if (config->isnegloglikeweightedbyT){
-                log_like+=log(mathfunction_matrix_normalize(like_jk))/((config->index_sbj)[sbj+1]-(config->index_sbj)[sbj]);
+                log_like+=log(like_sum)/((config->index_sbj)[sbj+1]-(config->index_sbj)[sbj]);
             }else{
-                log_like+=log(mathfunction_matrix_normalize(like_jk));
+                log_like+=log(like_sum);
             }
+			if(score!=NULL){
+				score_normalize(score, like_jk, like_sum,
+					config->isnegloglikeweightedbyT? (double) ((config->index_sbj)[sbj+1]-(config->index_sbj)[sbj]) : 1.0);
+			}
             /*like_jk scaled, Pr(S_{t-1} = j,S_{t} = k|Y_{t}, like=sum*/
             /*individual ÐLL is now divided by each individualÕs number of occasions. This helps speed convergence and ensure that each individualÕs data get weighted equally regardless of T_i.*/
 
@@ -317,7 +671,10 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 			double tooSmallRegimeNumber = 1e-322;
 			if(gsl_vector_min(pr_t) < tooSmallRegimeNumber){
 				gsl_vector_add_constant(pr_t, tooSmallRegimeNumber);
-				mathfunction_vector_normalize(pr_t);
+				double pr_sum=mathfunction_vector_normalize(pr_t);
+				if(score!=NULL){
+					score_scale_pr(score, pr_sum);
+				}
 			}
 			
 
@@ -325,45 +682,28 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
 	    print_vector(pr_t);
 	    MYPRINT("\n");*/
 			
-            for(regime_k=0; regime_k<config->num_regime; regime_k++){
-                    gsl_vector_set_zero(eta_j_t[regime_k]);/*here, corresponds to eta_k_t in the paper*/
-                    gsl_matrix_set_zero(error_cov_j_t[regime_k]);/*here, corresponds to error_cov_k_t in the paper*/
-
-            	    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            	    	    /** step 3: call collapse process **/
-            	    	    /** step 3.1: collapse the latent variable to get eta_k **/
-
-
-            	    	    gsl_blas_daxpy(gsl_matrix_get(like_jk, regime_j, regime_k), eta_jk_t_plus_1[regime_j][regime_k], eta_j_t[regime_k]); /*sum over j through loop*/
-
-            	    	    /*if(regime_k==1){
-            	    	    MYPRINT("Here!");
-            	    	    print_vector(eta_j_t[regime_k]);}*/
-            	    }
-            	}/*end of k*/
-				
-            for(regime_k=0; regime_k<config->num_regime; regime_k++){
-            	    gsl_vector_scale(eta_j_t[regime_k], 1.0/gsl_vector_get(pr_t,regime_k));
-
-            	    /*MYPRINT("eta collapsed estimate in regime %lu:\n",regime_k);
-            	    print_vector(eta_j_t[regime_k]);
-            	    MYPRINT("\n");*/
-
-            	    /** step 3.2: collapse the covariance matrix to get error_cov_k **/
-            	    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-						
-						mathfunction_collapse(eta_j_t[regime_k], eta_jk_t_plus_1[regime_j][regime_k], 
-						error_cov_jk_t_plus_1[regime_j][regime_k], gsl_matrix_get(like_jk,regime_j, regime_k), error_cov_j_t[regime_k],
-						diff_eta_vec, diff_eta, modif_p);
-
-                    }/*end of j*/
-                    gsl_matrix_scale(error_cov_j_t[regime_k], 1.0/gsl_vector_get(pr_t,regime_k));
-
-                    /*MYPRINT("error_cov collapsed estimate in regime %lu:\n",regime_k);
-            	    print_matrix(error_cov_j_t[regime_k]);
-            	    MYPRINT("\n");*/
-            }/*end of k*/
-
+			if(config->num_regime==1){
+				/*with one regime the collapse is the identity; copying keeps the filtered P free of the rounding of the
+				 *regime weights, so that it depends on the design of the subject only, see brekfis()*/
+				gsl_vector_memcpy(eta_j_t[0], eta_jk_t_plus_1[0][0]);
+				gsl_matrix_memcpy(error_cov_j_t[0], error_cov_jk_t_plus_1[0][0]);
+				ekf_sqrt_collapse(ws->ekf, 0, eta_jk_t_plus_1[0], NULL, 1.0, eta_j_t[0]);
+			}else{
+				/** step 3: call collapse process to get eta_k and error_cov_k, here eta_j_t and error_cov_j_t **/
+				for(regime_k=0; regime_k<config->num_regime; regime_k++){
+					for(regime_j=0; regime_j<config->num_regime; regime_j++){
+						ws->collapse_vec[regime_j]=eta_jk_t_plus_1[regime_j][regime_k];
+						ws->collapse_mat[regime_j]=error_cov_jk_t_plus_1[regime_j][regime_k];
+					}
+					gsl_vector_const_view like_k=gsl_matrix_const_column(like_jk, regime_k);
+					mathfunction_collapse_moments(config->num_regime, ws->collapse_vec, ws->collapse_mat, &like_k.vector,
+						1.0/gsl_vector_get(pr_t, regime_k), eta_j_t[regime_k], error_cov_j_t[regime_k], ws->diff_eta_vec);
+					ekf_sqrt_collapse(ws->ekf, regime_k, ws->collapse_vec, &like_k.vector, 1.0/gsl_vector_get(pr_t, regime_k), eta_j_t[regime_k]);
+				}
+			}
+			if(score!=NULL){
+				score_collapse(score, config, eta_j_t, error_cov_j_t, eta_jk_t_plus_1, error_cov_jk_t_plus_1, like_jk, pr_t);
+			}
 
 
 	   /*fprintf(pr_file,"%lu %lu %lf %lf\n",sbj,t,gsl_vector_get(pr_t,0),gsl_vector_get(pr_t,1));*/
@@ -371,59 +711,221 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
            print_vector(pr_t);
            MYPRINT("\n");*/
 
+			if(chunk!=NULL){
+				filter_chunk_push(chunk, t, config, ws);
+			}
         }/*end of t*/
+	
+	return log_like;
+}
 
-       /*if (sbj==2){exit(0);}*/
-         /*fprintf(h_file, "%d", t+1);*/
-    }/*end of sbj*/
+/*whether the covariance side of the filter depends on the design of a subject only, and some designs are shared:
+ *one regime, parameter-only noise, and linear matrices for the measurement and for the dynamics or their discretization*/
+static bool brekfis_shares_covariance(const ParamConfig *config, const ExactDiscretization *disc, const LinearModel *lin){
+	return config->design_groups!=NULL && config->design_groups->num_group < config->num_sbj
+		&& config->num_regime==1 && config->noise_cov_dependency==DEPEND_PARAM
+		&& lin!=NULL && lin->loading!=NULL
+		&& (config->isContinuousTime? disc!=NULL : lin->transition!=NULL);
+}
+
+/**
+ * This method implements a one-step brekfis
+ * Subjects are filtered independently, in parallel when OpenMP is available.
+ * The per-subject log-likelihoods are summed in subject order afterwards,
+ * so the result does not depend on the number of threads.
+ * Model functions that depend on the parameters only are evaluated once, before the subjects.
+ * When the covariance side of the filter does not depend on the data, it is run once per design,
+ * by the first subject of each group of ParamConfig::design_groups, and replayed for the others.
+ * Regime pairs whose prior mass is below ParamConfig::prune_threshold are not stepped, see brekfis_fill_pruned().
+ * @param y the observations
+ * @param total_time the number of total time points
+ * @param config the configuration of the model
+ * @param init the initial values for some parameters
+ * @param param the model and user-defined function parameters
+ * @return log-likelihood
+ */
+double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, double *y_time, const ParamConfig *config, ParamInit *init, Param *param){
+	int DEBUG_BREKFIS = 0; /*0=false/no; 1=true/yes*/
+	if(DEBUG_BREKFIS){
+		MYPRINT("Called brekfis\n");
+	}
+	size_t sbj;
+	double log_like=0;
+	size_t num_alloc=0, num_pinv=0, num_pruned=0, num_pairs=0;
+	double prune_estimate=0, prune_mass=0;
+	double *log_like_sbj=(double *)malloc(config->num_sbj*sizeof(double));
+	ParamOnlyCache cache;
+	param_only_cache_alloc(&cache, co_variate, config, param);
+	ExactDiscretization *disc=config->exact_discretization? exact_discretization_alloc(y_time, co_variate, config, param) : NULL;
+	LinearModel *lin=linear_model_alloc(config, param);
 	
-	/*fclose(h_file);*/
-	/*fclose(eta_file);*/
-	/*fclose(pr_file);*/
-	/****************************** free allocated space ***************************/
-	for(regime_j=0; regime_j<config->num_regime; regime_j++)
-		gsl_vector_free(eta_j_t[regime_j]);
-	free(eta_j_t);
-	for(regime_j=0; regime_j<config->num_regime; regime_j++)
-		gsl_matrix_free(error_cov_j_t[regime_j]);
-	free(error_cov_j_t);
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		for(regime_k=0; regime_k<config->num_regime; regime_k++)
-		gsl_vector_free(eta_jk_t_plus_1[regime_j][regime_k]);
+	/*one track per design shared by several subjects*/
+	const DesignGroups *groups=config->design_groups;
+	size_t group;
+	EKFTrack **track=NULL;
+	if(brekfis_shares_covariance(config, disc, lin)){
+		track=(EKFTrack **)malloc(groups->num_group*sizeof(EKFTrack *));
+		for(group=0; group < groups->num_group; group++){
+			sbj=groups->sbj_of_group[groups->group_offset[group]];
+			track[group]=groups->group_offset[group+1]-groups->group_offset[group] > 1?
+				ekf_track_alloc((config->index_sbj)[sbj+1]-(config->index_sbj)[sbj], config) : NULL;
+		}
 	}
-	for(regime_j=0; regime_j<config->num_regime; regime_j++)
-		free(eta_jk_t_plus_1[regime_j]);
-	free(eta_jk_t_plus_1);
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		for(regime_k=0; regime_k<config->num_regime; regime_k++)
-			gsl_matrix_free(error_cov_jk_t_plus_1[regime_j][regime_k]);
+	
+	#ifdef _OPENMP
+	#pragma omp parallel if(config->num_sbj > 1 && !DEBUG_BREKFIS)
+	#endif
+	{
+		BrekfisWorkspace ws;
+		brekfis_workspace_alloc(&ws, config, param);
+		ws.cache=&cache;
+		ws.ekf->disc=disc;
+		ws.ekf->linear=lin;
+		ekf_workspace_allow_steady_state(ws.ekf, config);
+		
+		/*the first subject of each shared design records the covariance side*/
+		if(track!=NULL){
+			#ifdef _OPENMP
+			#pragma omp for schedule(dynamic)
+			#endif
+			for(group=0; group < groups->num_group; group++){
+				if(track[group]!=NULL){
+					size_t first=groups->sbj_of_group[groups->group_offset[group]];
+					ws.ekf->track=track[group];
+					ws.ekf->track_replay=false;
+					log_like_sbj[first]=brekfis_subject(first, y, co_variate, y_time, config, init, &ws, NULL, NULL);
+				}
+			}
+		}
+		
+		#ifdef _OPENMP
+		#pragma omp for schedule(dynamic)
+		#endif
+		for(sbj=0; sbj < config->num_sbj; sbj++){
+			ws.ekf->track=NULL;
+			if(track!=NULL && track[groups->group_of_sbj[sbj]]!=NULL){
+				if(groups->sbj_of_group[groups->group_offset[groups->group_of_sbj[sbj]]]==sbj){
+					continue;
+				}
+				ws.ekf->track=track[groups->group_of_sbj[sbj]];
+				ws.ekf->track_replay=true;
+			}
+			log_like_sbj[sbj]=brekfis_subject(sbj, y, co_variate, y_time, config, init, &ws, NULL, NULL);
+		}/*end of sbj*/
+		ws.ekf->track=NULL;
+		
+		#ifdef _OPENMP
+		#pragma omp atomic
+		#endif
+		num_alloc+=ws.ekf->num_alloc;
+		#ifdef _OPENMP
+		#pragma omp atomic
+		#endif
+		num_pinv+=ws.ekf->num_pinv;
+		#ifdef _OPENMP
+		#pragma omp atomic
+		#endif
+		num_pruned+=ws.num_pruned;
+		#ifdef _OPENMP
+		#pragma omp atomic
+		#endif
+		num_pairs+=ws.num_pairs;
+		#ifdef _OPENMP
+		#pragma omp atomic
+		#endif
+		prune_estimate+=ws.prune_estimate;
+		#ifdef _OPENMP
+		#pragma omp critical(brekfis_prune_mass)
+		#endif
+		{
+			if(ws.prune_mass > prune_mass){
+				prune_mass=ws.prune_mass;
+			}
+		}
+		brekfis_workspace_free(&ws);
 	}
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		free(error_cov_jk_t_plus_1[regime_j]);
+	
+	for(sbj=0; sbj < config->num_sbj; sbj++){
+		log_like+=log_like_sbj[sbj];
 	}
-	free(error_cov_jk_t_plus_1);
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		for(regime_k=0; regime_k<config->num_regime; regime_k++)
-			gsl_vector_free(innov_v[regime_j][regime_k]);
+	free(log_like_sbj);
+	param_only_cache_free(&cache);
+	if(disc!=NULL){
+		exact_discretization_free(disc);
 	}
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		free(innov_v[regime_j]);
+	if(lin!=NULL){
+		linear_model_free(lin);
 	}
-	free(innov_v);
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		for(regime_k=0; regime_k<config->num_regime; regime_k++)
-			gsl_matrix_free(residual_cov[regime_j][regime_k]);
+	if(track!=NULL){
+		for(group=0; group < groups->num_group; group++){
+			if(track[group]!=NULL){
+				ekf_track_free(track[group]);
+			}
+		}
+		free(track);
 	}
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-		free(residual_cov[regime_j]);
+	brekfis_diagnostics_add(config, num_alloc, num_pinv, num_pruned, num_pairs, prune_estimate, prune_mass);
+	
+	return(-log_like);
+}
+
+/**
+ * The brekfis together with its analytic gradient.
+ * The tangent-linear filter of sensitivity.h is run along with the brekfis of every subject,
+ * so one pass gives the negative log-likelihood and its derivatives with respect to the free parameters.
+ * @param tangent the parameter side of the tangents, from param_tangent_alloc()
+ * @param grad receives the gradient of the negative log-likelihood, of length tangent->num_param
+ * @return negative log-likelihood, the same as brekfis()
+ */
+double brekfis_score(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, double *y_time, const ParamConfig *config, ParamInit *init, Param *param, const ParamTangent *tangent, double *grad){
+	size_t sbj, i;
+	size_t num_param=tangent->num_param;
+	double log_like=0;
+	double *log_like_sbj=(double *)malloc(config->num_sbj*sizeof(double));
+	double *d_log_like_sbj=(double *)malloc(config->num_sbj*num_param*sizeof(double));
+	/*the tangents of linear recipes differentiate the same matrices, see sensitivity.h*/
+	LinearModel *lin=linear_model_alloc(config, param);
+	
+	#ifdef _OPENMP
+	#pragma omp parallel if(config->num_sbj > 1) private(i)
+	#endif
+	{
+		BrekfisWorkspace ws;
+		brekfis_workspace_alloc(&ws, config, param);
+		ws.ekf->linear=lin;
+		ScoreWorkspace *score=score_workspace_alloc(config, tangent, &ws.param);
+		
+		#ifdef _OPENMP
+		#pragma omp for schedule(dynamic)
+		#endif
+		for(sbj=0; sbj < config->num_sbj; sbj++){
+			for(i=0; i < num_param; i++){
+				score->d_log_like[i]=0;
+			}
+			log_like_sbj[sbj]=brekfis_subject(sbj, y, co_variate, y_time, config, init, &ws, NULL, score);
+			for(i=0; i < num_param; i++){
+				d_log_like_sbj[sbj*num_param+i]=score->d_log_like[i];
+			}
+		}/*end of sbj*/
+		
+		score_workspace_free(score);
+		brekfis_workspace_free(&ws);
 	}
-	free(residual_cov);
 	
-	gsl_vector_free(pr_t);
-	gsl_matrix_free(like_jk);
-	gsl_vector_free(diff_eta_vec);
-	gsl_matrix_free(diff_eta);
-	gsl_matrix_free(modif_p);
+	for(i=0; i < num_param; i++){
+		grad[i]=0;
+	}
+	for(sbj=0; sbj < config->num_sbj; sbj++){
+		log_like+=log_like_sbj[sbj];
+		for(i=0; i < num_param; i++){
+			grad[i]-=d_log_like_sbj[sbj*num_param+i];
+		}
+	}
+	free(log_like_sbj);
+	free(d_log_like_sbj);
+	if(lin!=NULL){
+		linear_model_free(lin);
+	}
 	
 	return(-log_like);
 }
@@ -607,12 +1109,13 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 	gsl_vector **eta_t, gsl_matrix **error_cov_t, 
 	gsl_vector **eta_pred_t, gsl_matrix **error_cov_pred_t,
 	gsl_vector **innov_v_t, gsl_matrix **residual_cov_t,
+	KimRetained *retain,
 	bool perturb, gsl_rng *seed){
 
 	/*MYPRINT("Called EKimFilter()");*/
 
     /************** initialization *****************************************************************/
-    size_t t, index_sbj_t, regime_j, regime_k, sbj, tprev;
+    size_t t, regime_j, regime_k, sbj, tprev;
     double neg_log_p, p, log_like=0;
 
     size_t col_index;
@@ -622,130 +1125,24 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 	
 	/** output of extended Kalman filter **/
     /*eta^regime_jk_it|t -- eta_regime_jk_t_plus_1 -- filtered regime specific state estimate */
-    gsl_vector ****eta_regime_jk_t_plus_1=(gsl_vector ****)malloc(config->total_obs*sizeof(gsl_vector ***));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	eta_regime_jk_t_plus_1[index_sbj_t]=(gsl_vector ***)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    eta_regime_jk_t_plus_1[index_sbj_t][regime_j]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-	}
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    for(regime_k=0; regime_k<config->num_regime; regime_k++)
-	    eta_regime_jk_t_plus_1[index_sbj_t][regime_j][regime_k]=gsl_vector_calloc(config->dim_latent_var);
-	}
-    }
+    gsl_vector ****eta_regime_jk_t_plus_1=tensor_vector3_alloc(config->total_obs, config->num_regime, config->num_regime, config->dim_latent_var);
     
 	/*error_cov^regime_jk_it|t -- error_cov_regime_jk_t_plus_1 -- filtered regime specific error covariance estimate */
-    gsl_matrix ****error_cov_regime_jk_t_plus_1=(gsl_matrix ****)malloc(config->total_obs*sizeof(gsl_matrix ***));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	error_cov_regime_jk_t_plus_1[index_sbj_t]=(gsl_matrix ***)malloc(config->num_regime*sizeof(gsl_matrix **));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    error_cov_regime_jk_t_plus_1[index_sbj_t][regime_j]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-	}
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    for(regime_k=0; regime_k<config->num_regime; regime_k++)
-		error_cov_regime_jk_t_plus_1[index_sbj_t][regime_j][regime_k]=gsl_matrix_calloc(config->dim_latent_var, config->dim_latent_var);
-	}
-    }
+    gsl_matrix ****error_cov_regime_jk_t_plus_1=tensor_matrix3_alloc(config->total_obs, config->num_regime, config->num_regime, config->dim_latent_var, config->dim_latent_var);
 	
     /*output of filter: innovation vector*/
-    gsl_vector ****innov_v=(gsl_vector ****)malloc(config->total_obs*sizeof(gsl_vector ***));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	innov_v[index_sbj_t]=(gsl_vector ***)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    innov_v[index_sbj_t][regime_j]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-	}
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    for(regime_k=0; regime_k<config->num_regime; regime_k++)
-	    innov_v[index_sbj_t][regime_j][regime_k]=gsl_vector_calloc(config->dim_obs_var);
-	}
-    }
+    gsl_vector ****innov_v=tensor_vector3_alloc(config->total_obs, config->num_regime, config->num_regime, config->dim_obs_var);
 	
     /*output of filter: inverse_residual_cov*/
-    gsl_matrix ****inv_residual_cov=(gsl_matrix ****)malloc(config->total_obs*sizeof(gsl_matrix ***));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	inv_residual_cov[index_sbj_t]=(gsl_matrix ***)malloc(config->num_regime*sizeof(gsl_matrix **));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    inv_residual_cov[index_sbj_t][regime_j]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-	}
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    for(regime_k=0; regime_k<config->num_regime; regime_k++)
-		inv_residual_cov[index_sbj_t][regime_j][regime_k]=gsl_matrix_calloc(config->dim_obs_var, config->dim_obs_var);
-	}
-    }
+    gsl_matrix ****inv_residual_cov=tensor_matrix3_alloc(config->total_obs, config->num_regime, config->num_regime, config->dim_obs_var, config->dim_obs_var);
 	
     /*output of filter: residual_cov*/
-    gsl_matrix ****residual_cov=(gsl_matrix ****)malloc(config->total_obs*sizeof(gsl_matrix ***));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-		residual_cov[index_sbj_t]=(gsl_matrix ***)malloc(config->num_regime*sizeof(gsl_matrix **));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    residual_cov[index_sbj_t][regime_j]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-	}
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    for(regime_k=0; regime_k<config->num_regime; regime_k++)
-		residual_cov[index_sbj_t][regime_j][regime_k]=gsl_matrix_calloc(config->dim_obs_var, config->dim_obs_var);
-	}
-    }
+    gsl_matrix ****residual_cov=tensor_matrix3_alloc(config->total_obs, config->num_regime, config->num_regime, config->dim_obs_var, config->dim_obs_var);
 	
-
-    gsl_vector ***eta_pred_regime_t=(gsl_vector ***)malloc(config->total_obs*sizeof(gsl_vector **));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	eta_pred_regime_t[index_sbj_t]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    eta_pred_regime_t[index_sbj_t][regime_j]=gsl_vector_calloc(config->dim_latent_var);
-	}
-    }
-
-    gsl_matrix ***error_cov_pred_regime_t=(gsl_matrix ***)malloc(config->total_obs*sizeof(gsl_matrix **));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	error_cov_pred_regime_t[index_sbj_t]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    error_cov_pred_regime_t[index_sbj_t][regime_j]=gsl_matrix_calloc(config->dim_latent_var, config->dim_latent_var);
-	}
-    }
-
-    gsl_vector ***innov_v_regime_t=(gsl_vector ***)malloc(config->total_obs*sizeof(gsl_vector **));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	innov_v_regime_t[index_sbj_t]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    innov_v_regime_t[index_sbj_t][regime_j]=gsl_vector_calloc(config->dim_obs_var);
-	}
-    }
-
-    gsl_matrix ***residual_cov_regime_t=(gsl_matrix ***)malloc(config->total_obs*sizeof(gsl_matrix **));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	residual_cov_regime_t[index_sbj_t]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    residual_cov_regime_t[index_sbj_t][regime_j]=gsl_matrix_calloc(config->dim_obs_var, config->dim_obs_var);
-	}
-    }	
+    gsl_vector ***eta_pred_regime_t=tensor_vector2_alloc(config->total_obs, config->num_regime, config->dim_latent_var);
+    gsl_matrix ***error_cov_pred_regime_t=tensor_matrix2_alloc(config->total_obs, config->num_regime, config->dim_latent_var, config->dim_latent_var);
+    gsl_vector ***innov_v_regime_t=tensor_vector2_alloc(config->total_obs, config->num_regime, config->dim_obs_var);
+    gsl_matrix ***residual_cov_regime_t=tensor_matrix2_alloc(config->total_obs, config->num_regime, config->dim_obs_var, config->dim_obs_var);
 	
     /** output for hamilton filter **/
 	gsl_matrix *tran_prob_jk = gsl_matrix_alloc(config->num_regime, config->num_regime);/*given t-1*/
@@ -753,12 +1150,10 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 
 
     /** input for collapse_process**/
+    gsl_vector **collapse_vec=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
+    gsl_matrix **collapse_mat=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
     gsl_vector *diff_eta_vec=gsl_vector_alloc(config->dim_latent_var);
-    gsl_matrix *diff_eta=gsl_matrix_alloc(config->dim_latent_var, 1);
-    gsl_matrix *modif_p=gsl_matrix_alloc(config->dim_latent_var, config->dim_latent_var);
     gsl_vector *diff_obs_vec=gsl_vector_alloc(config->dim_obs_var);
-    gsl_matrix *diff_obs=gsl_matrix_alloc(config->dim_obs_var, 1);
-    gsl_matrix *modif_obs_p=gsl_matrix_alloc(config->dim_obs_var, config->dim_obs_var);
 
 
     /********************************************************************************/
@@ -771,6 +1166,19 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
         /*FILE *eta_file=fopen("eta_t.txt","w");*/
         /*FILE *pr_file=fopen("regimeprob.txt","w");*/
 
+    /** scratch space of the EKF step **/
+    EKFWorkspace *ekf_ws=ekf_workspace_alloc(config);
+    ExactDiscretization *disc=config->exact_discretization? exact_discretization_alloc(y_time, co_variate, config, param) : NULL;
+    ekf_ws->disc=disc;
+    LinearModel *lin=linear_model_alloc(config, param);
+    ekf_ws->linear=lin;
+    ekf_workspace_allow_steady_state(ekf_ws, config);
+    ekf_ws->sqrt_carry=true; /* see ekf_sqrt_collapse() */
+    /* the steps from the same regime j into regimes with the same model, see brekfis_shared_regime() */
+    bool share_regime=config->num_regime>1 && !perturb;
+    size_t regime_s, regime_p;
+    double *neg_log_p_k=(double *)malloc(config->num_regime*sizeof(double));
+    size_t pair, pair_s;
 
     for(sbj=0; sbj<config->num_sbj; sbj++){
 
@@ -793,6 +1201,7 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 
                 config->func_noise_cov(t, regime_j, param->func_param, param->y_noise_cov, param->eta_noise_cov);
                 model_constraint_par(config, param);
+                ekf_ws->noise_regime=regime_j;
 
                 /*MYPRINT("sbj %lu at time %lu in regime %lu:\n",sbj,t,regime_j);
                 MYPRINT("\n");
@@ -832,22 +1241,63 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 					}else{
 						tprev = t-1;
 					}
-                    // formerly called smoother
-                    neg_log_p = ext_kalmanfilter(t, regime_k,
-                        eta_regime_j_t[tprev][regime_j], error_cov_regime_j_t[tprev][regime_j],
-                        y[t],co_variate[t],y_time,
-                        param->eta_noise_cov, param->y_noise_cov,
-                        param->func_param,config->num_func_param,
-						config->isContinuousTime,
-                        config->func_measure,
-                        config->func_dx_dt,
-                        config->func_dP_dt,
-						config->func_dF_dx,
-                        config->func_dynam,
-						config->func_jacob_dynam,
-                        eta_regime_jk_pred[t][regime_j][regime_k], error_cov_regime_jk_pred[t][regime_j][regime_k],
-                        eta_regime_jk_t_plus_1[t][regime_j][regime_k], error_cov_regime_jk_t_plus_1[t][regime_j][regime_k], 
-						innov_v[t][regime_j][regime_k], inv_residual_cov[t][regime_j][regime_k], residual_cov[t][regime_j][regime_k], isFirstTime, true, perturb, seed); /*inverse*/
+                    regime_s=share_regime? brekfis_shared_regime(config, regime_k, isFirstTime, true, NULL) : regime_k;
+                    if(regime_s!=regime_k){
+                        /* the same step as into regime_s */
+                        gsl_vector_memcpy(eta_regime_jk_pred[t][regime_j][regime_k], eta_regime_jk_pred[t][regime_j][regime_s]);
+                        gsl_matrix_memcpy(error_cov_regime_jk_pred[t][regime_j][regime_k], error_cov_regime_jk_pred[t][regime_j][regime_s]);
+                        gsl_vector_memcpy(eta_regime_jk_t_plus_1[t][regime_j][regime_k], eta_regime_jk_t_plus_1[t][regime_j][regime_s]);
+                        gsl_matrix_memcpy(error_cov_regime_jk_t_plus_1[t][regime_j][regime_k], error_cov_regime_jk_t_plus_1[t][regime_j][regime_s]);
+                        gsl_vector_memcpy(innov_v[t][regime_j][regime_k], innov_v[t][regime_j][regime_s]);
+                        gsl_matrix_memcpy(inv_residual_cov[t][regime_j][regime_k], inv_residual_cov[t][regime_j][regime_s]);
+                        gsl_matrix_memcpy(residual_cov[t][regime_j][regime_k], residual_cov[t][regime_j][regime_s]);
+                        ekf_sqrt_share(ekf_ws, regime_j, regime_k, regime_j, regime_s);
+                        neg_log_p=neg_log_p_k[regime_s];
+                        regime_p=regime_s;
+                    }else{
+                        regime_p=share_regime? brekfis_shared_regime(config, regime_k, isFirstTime, false, NULL) : regime_k;
+                        ekf_ws->pred_share=share_regime;
+                        ekf_ws->pred_slot=regime_p;
+                        ekf_ws->pred_replay=regime_p!=regime_k;
+                        ekf_ws->sqrt_from=regime_j;
+                        if(retain!=NULL){
+                            ekf_ws->retain_jacob=retain->jacob_dynam!=NULL? retain->jacob_dynam[t][regime_j][regime_k] : NULL;
+                            ekf_ws->retain_chol=retain->chol_error_cov_pred[t][regime_j][regime_k];
+                        }
+                        // formerly called smoother
+                        neg_log_p = ext_kalmanfilter(t, regime_k,
+                            eta_regime_j_t[tprev][regime_j], error_cov_regime_j_t[tprev][regime_j],
+                            y[t],co_variate[t],y_time,
+                            param->eta_noise_cov, param->y_noise_cov,
+                            param->func_param,config->num_func_param,
+    						config->isContinuousTime,
+                            config->func_measure,
+                            config->func_dx_dt,
+                            config->func_dP_dt,
+    						config->func_dF_dx,
+                            config->func_dynam,
+    						config->func_jacob_dynam,
+                            eta_regime_jk_pred[t][regime_j][regime_k], error_cov_regime_jk_pred[t][regime_j][regime_k],
+                            eta_regime_jk_t_plus_1[t][regime_j][regime_k], error_cov_regime_jk_t_plus_1[t][regime_j][regime_k], 
+    						innov_v[t][regime_j][regime_k], inv_residual_cov[t][regime_j][regime_k], residual_cov[t][regime_j][regime_k], isFirstTime, true, perturb, seed, config->miss_pattern, ekf_ws); /*inverse*/
+                        neg_log_p_k[regime_k]=neg_log_p;
+                    }
+                    if(retain!=NULL){
+                        /* a pair that shares the prediction of regime_p shares its transition and factor too */
+                        pair=(t*config->num_regime+regime_j)*config->num_regime+regime_k;
+                        if(regime_p!=regime_k){
+                            pair_s=(t*config->num_regime+regime_j)*config->num_regime+regime_p;
+                            if(retain->has_jacob[pair_s]){
+                                gsl_matrix_memcpy(retain->jacob_dynam[t][regime_j][regime_k], retain->jacob_dynam[t][regime_j][regime_p]);
+                            }
+                            gsl_matrix_memcpy(retain->chol_error_cov_pred[t][regime_j][regime_k], retain->chol_error_cov_pred[t][regime_j][regime_p]);
+                            retain->has_jacob[pair]=retain->has_jacob[pair_s];
+                            retain->has_chol[pair]=retain->has_chol[pair_s];
+                        }else{
+                            retain->has_jacob[pair]=ekf_ws->retain_has_jacob;
+                            retain->has_chol[pair]=ekf_ws->retain_has_chol;
+                        }
+                    }
 
                         /*MYPRINT("From regime %lu to regime %lu:\n",regime_j,regime_k);
                         MYPRINT("\n");
@@ -978,109 +1428,44 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 			/** Other optional outputs of the Kalman Filter **/
 			
 	        for(regime_k=0; regime_k<config->num_regime; regime_k++){
+				/* the filtered moments are weighted by Pr(S_{t-1}=j,S_t=k|Y_t), the predicted and the innovation moments by Pr(S_{t-1}=j,S_t=k|Y_{t-1}) */
+				gsl_vector_const_view like_k=gsl_matrix_const_column(like_jk, regime_k);
+				gsl_vector_const_view tran_prob_k=gsl_matrix_const_column(tran_prob_jk, regime_k);
 				
-                if (t==(config->index_sbj)[sbj]){
-        	        
-					gsl_vector_set_zero(eta_regime_j_t[t][regime_k]);
-					gsl_matrix_set_zero(error_cov_regime_j_t[t][regime_k]);
-                
+				for(regime_j=0; regime_j<config->num_regime; regime_j++){
+					collapse_vec[regime_j]=eta_regime_jk_t_plus_1[t][regime_j][regime_k];
+					collapse_mat[regime_j]=error_cov_regime_jk_t_plus_1[t][regime_j][regime_k];
 				}
-
-	            	    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-
-							gsl_blas_daxpy(gsl_matrix_get(like_jk, regime_j, regime_k), 
-								eta_regime_jk_t_plus_1[t][regime_j][regime_k], 
-								eta_regime_j_t[t][regime_k]); /*sum over j through loop*/
-					   		   
-							gsl_blas_daxpy(gsl_matrix_get(tran_prob_jk, regime_j, regime_k), 
-								eta_regime_jk_pred[t][regime_j][regime_k], 
-								eta_pred_regime_t[t][regime_k]); 
-					   		
-							gsl_blas_daxpy(gsl_matrix_get(tran_prob_jk, regime_j, regime_k), 
-								innov_v[t][regime_j][regime_k], 
-								innov_v_regime_t[t][regime_k]); 
-
-	            	    	    /*if(regime_k==1){
-	            	    	    MYPRINT("Here!");
-	            	    	    print_vector(eta_regime_j_t[t][regime_k]);}*/
-	            	    }
-	        
-			}/*end of k*/
-			
-            for(regime_k=0; regime_k<config->num_regime; regime_k++){
+				mathfunction_collapse_moments(config->num_regime, collapse_vec, collapse_mat, &like_k.vector, 1.0/gsl_vector_get(pr_t[t],regime_k),
+					eta_regime_j_t[t][regime_k], error_cov_regime_j_t[t][regime_k], diff_eta_vec);
+				ekf_sqrt_collapse(ekf_ws, regime_k, collapse_vec, &like_k.vector, 1.0/gsl_vector_get(pr_t[t],regime_k), eta_regime_j_t[t][regime_k]);
+				
+				for(regime_j=0; regime_j<config->num_regime; regime_j++){
+					collapse_vec[regime_j]=eta_regime_jk_pred[t][regime_j][regime_k];
+					collapse_mat[regime_j]=error_cov_regime_jk_pred[t][regime_j][regime_k];
+				}
+				mathfunction_collapse_moments(config->num_regime, collapse_vec, collapse_mat, &tran_prob_k.vector, 1.0/gsl_vector_get(pr_t_given_t_minus_1[t],regime_k),
+					eta_pred_regime_t[t][regime_k], error_cov_pred_regime_t[t][regime_k], diff_eta_vec);
+				
+				for(regime_j=0; regime_j<config->num_regime; regime_j++){
+					collapse_vec[regime_j]=innov_v[t][regime_j][regime_k];
+					collapse_mat[regime_j]=residual_cov[t][regime_j][regime_k];
+				}
+				mathfunction_collapse_moments(config->num_regime, collapse_vec, collapse_mat, &tran_prob_k.vector, 1.0/gsl_vector_get(pr_t_given_t_minus_1[t],regime_k),
+					innov_v_regime_t[t][regime_k], residual_cov_regime_t[t][regime_k], diff_obs_vec);
 				
-            	    gsl_vector_scale(eta_regime_j_t[t][regime_k], 1.0/gsl_vector_get(pr_t[t],regime_k));
-					
-					gsl_vector_scale(eta_pred_regime_t[t][regime_k], 1.0/gsl_vector_get(pr_t_given_t_minus_1[t],regime_k));
-					
-					gsl_vector_scale(innov_v_regime_t[t][regime_k], 1.0/gsl_vector_get(pr_t_given_t_minus_1[t],regime_k));
-
             	    /*MYPRINT("eta collapsed estimate in regime %lu:\n",regime_k);
             	    print_vector(eta_regime_j_t[t][regime_k]);
             	    MYPRINT("\n");*/
-
-            	    /** step 3.2: collapse the covariance matrix to get error_cov_k **/
-            	    for(regime_j=0; regime_j<config->num_regime; regime_j++){
-						
-						mathfunction_collapse(eta_regime_j_t[t][regime_k], eta_regime_jk_t_plus_1[t][regime_j][regime_k], 
-						error_cov_regime_jk_t_plus_1[t][regime_j][regime_k], gsl_matrix_get(like_jk,regime_j, regime_k), 
-						error_cov_regime_j_t[t][regime_k],
-						diff_eta_vec, diff_eta, modif_p);
-						
-						mathfunction_collapse(eta_pred_regime_t[t][regime_k], eta_regime_jk_pred[t][regime_j][regime_k], 
-						error_cov_regime_jk_pred[t][regime_j][regime_k], gsl_matrix_get(like_jk,regime_j, regime_k), 
-						error_cov_pred_regime_t[t][regime_k],
-						diff_eta_vec, diff_eta, modif_p);
-						
-						mathfunction_collapse(innov_v_regime_t[t][regime_k], innov_v[t][regime_j][regime_k], 
-						residual_cov[t][regime_j][regime_k], gsl_matrix_get(like_jk,regime_j, regime_k), 
-						residual_cov_regime_t[t][regime_k],
-						diff_obs_vec, diff_obs, modif_obs_p);
-
-                    }/*end of j*/
-                    
-					gsl_matrix_scale(error_cov_regime_j_t[t][regime_k], 1.0/gsl_vector_get(pr_t[t],regime_k));
-					
-					gsl_matrix_scale(error_cov_pred_regime_t[t][regime_k], 1.0/gsl_vector_get(pr_t_given_t_minus_1[t],regime_k));
-					
-					gsl_matrix_scale(residual_cov_regime_t[t][regime_k], 1.0/gsl_vector_get(pr_t_given_t_minus_1[t],regime_k));
-
-                    /*MYPRINT("error_cov collapsed estimate in regime %lu:\n",regime_k);
-            	    print_matrix(error_cov_regime_j_t[t][regime_k]);
-            	    MYPRINT("\n");*/
-            }/*end of k*/
+			}/*end of k*/
 			
-			/*gsl_vector_set_zero(eta_t[t]);*/
-			/*gsl_matrix_set_zero(error_cov_t[t]);*/
-    	    
-			for(regime_k=0; regime_k<config->num_regime; regime_k++){
- 
-    	    	    gsl_blas_daxpy(gsl_vector_get(pr_t[t], regime_k), eta_regime_j_t[t][regime_k], eta_t[t]); /*sum over k through loop*/
-					
-    	    	    gsl_blas_daxpy(gsl_vector_get(pr_t_given_t_minus_1[t], regime_k), eta_pred_regime_t[t][regime_k], eta_pred_t[t]); /*sum over k through loop*/
-					
-    	    	    gsl_blas_daxpy(gsl_vector_get(pr_t_given_t_minus_1[t], regime_k), innov_v_regime_t[t][regime_k], innov_v_t[t]); /*sum over k through loop*/
-					
-					/*if(regime_k==1){
-    	    	    MYPRINT("Here!");
-    	    	    print_vector(eta_t[t]);}*/
-    	    }
-    	    
-			for(regime_k=0; regime_k<config->num_regime; regime_k++){
-					
-					mathfunction_collapse(eta_t[t], eta_regime_j_t[t][regime_k], 
-					error_cov_regime_j_t[t][regime_k], gsl_vector_get(pr_t[t], regime_k), error_cov_t[t],
-					diff_eta_vec, diff_eta, modif_p);
-					
-					mathfunction_collapse(eta_pred_t[t], eta_pred_regime_t[t][regime_k], 
-					error_cov_pred_regime_t[t][regime_k], gsl_vector_get(pr_t_given_t_minus_1[t], regime_k), error_cov_pred_t[t],
-					diff_eta_vec, diff_eta, modif_p);
-					
-					mathfunction_collapse(innov_v_t[t], innov_v_regime_t[t][regime_k], 
-					residual_cov_regime_t[t][regime_k], gsl_vector_get(pr_t_given_t_minus_1[t], regime_k), residual_cov_t[t],
-					diff_obs_vec, diff_obs, modif_obs_p);
-
-			}
+			/* collapse over k */
+			mathfunction_collapse_moments(config->num_regime, eta_regime_j_t[t], error_cov_regime_j_t[t], pr_t[t], 1.0,
+				eta_t[t], error_cov_t[t], diff_eta_vec);
+			mathfunction_collapse_moments(config->num_regime, eta_pred_regime_t[t], error_cov_pred_regime_t[t], pr_t_given_t_minus_1[t], 1.0,
+				eta_pred_t[t], error_cov_pred_t[t], diff_eta_vec);
+			mathfunction_collapse_moments(config->num_regime, innov_v_regime_t[t], residual_cov_regime_t[t], pr_t_given_t_minus_1[t], 1.0,
+				innov_v_t[t], residual_cov_t[t], diff_obs_vec);
 	
 
 	   /*fprintf(pr_file,"%lu %lu %lf %lf\n",sbj,t,gsl_vector_get(pr_t[t],0),gsl_vector_get(pr_t[t],1));*/
@@ -1105,141 +1490,85 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 
 
 
+    free(collapse_vec);
+    free(collapse_mat);
     gsl_vector_free(diff_eta_vec);
-    gsl_matrix_free(diff_eta);
-    gsl_matrix_free(modif_p);
 	
     gsl_vector_free(diff_obs_vec);
-    gsl_matrix_free(diff_obs);
-    gsl_matrix_free(modif_obs_p);
 
 	/** output of extended Kalman filter **/
-    /*eta^regime_jk_it|t*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            for(regime_k=0; regime_k<config->num_regime; regime_k++)
-            gsl_vector_free(eta_regime_jk_t_plus_1[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            free(eta_regime_jk_t_plus_1[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(eta_regime_jk_t_plus_1[index_sbj_t]);
-    }
-    free(eta_regime_jk_t_plus_1);
-
-    /*error_cov^regime_jk_it|t*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            for(regime_k=0; regime_k<config->num_regime; regime_k++)
-                gsl_matrix_free(error_cov_regime_jk_t_plus_1[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            free(error_cov_regime_jk_t_plus_1[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(error_cov_regime_jk_t_plus_1[index_sbj_t]);
-    }
-    free(error_cov_regime_jk_t_plus_1);
+    tensor_free(eta_regime_jk_t_plus_1);
+    tensor_free(error_cov_regime_jk_t_plus_1);
+    tensor_free(innov_v);
+    tensor_free(inv_residual_cov);
+    tensor_free(residual_cov);
+    tensor_free(eta_pred_regime_t);
+    tensor_free(error_cov_pred_regime_t);
+    tensor_free(innov_v_regime_t);
+    tensor_free(residual_cov_regime_t);
 	
-    /*output of filter: innovation vector*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            for(regime_k=0; regime_k<config->num_regime; regime_k++)
-            gsl_vector_free(innov_v[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            free(innov_v[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(innov_v[index_sbj_t]);
-    }
-    free(innov_v);
+	brekfis_diagnostics_add(config, ekf_ws->num_alloc, ekf_ws->num_pinv, 0, 0, 0, 0);
+	ekf_workspace_free(ekf_ws);
+	free(neg_log_p_k);
+	if(disc!=NULL){
+		exact_discretization_free(disc);
+	}
+	if(lin!=NULL){
+		linear_model_free(lin);
+	}
+	/*MYPRINT("Finishing EKimFilter()");*/
+    return(-log_like);
+}
 
-    /*output of filter: inverse_residual_cov*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            for(regime_k=0; regime_k<config->num_regime; regime_k++)
-                gsl_matrix_free(inv_residual_cov[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            free(inv_residual_cov[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(inv_residual_cov[index_sbj_t]);
-    }
-    free(inv_residual_cov);
+double EKimFilterStream(gsl_vector ** y, gsl_vector **co_variate, double *y_time, const ParamConfig *config, ParamInit *init, Param *param,
+	size_t chunk_size,
+	void (*emit)(size_t, size_t, gsl_vector **, gsl_matrix **, gsl_vector **, void *), void *sink,
+	bool perturb, gsl_rng *seed){
+	size_t sbj;
+	double log_like=0;
 	
-    /*output of filter: residual_cov*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            for(regime_k=0; regime_k<config->num_regime; regime_k++)
-                gsl_matrix_free(residual_cov[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            free(residual_cov[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(residual_cov[index_sbj_t]);
-    }
-    free(residual_cov);
+	/*EKimFilter() does not weight the log-likelihood by the number of time points, and steps every regime pair*/
+	ParamConfig stream_config=*config;
+	stream_config.isnegloglikeweightedbyT=false;
+	stream_config.prune_threshold=0;
 	
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            gsl_vector_free(eta_pred_regime_t[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(eta_pred_regime_t[index_sbj_t]);
-    }
-    free(eta_pred_regime_t);
-
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            gsl_matrix_free(error_cov_pred_regime_t[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(error_cov_pred_regime_t[index_sbj_t]);
-    }
-    free(error_cov_pred_regime_t);
+	BrekfisWorkspace ws;
+	brekfis_workspace_alloc(&ws, &stream_config, param);
+	ExactDiscretization *disc=config->exact_discretization? exact_discretization_alloc(y_time, co_variate, config, param) : NULL;
+	ws.ekf->disc=disc;
+	LinearModel *lin=linear_model_alloc(config, param);
+	ws.ekf->linear=lin;
+	ekf_workspace_allow_steady_state(ws.ekf, &stream_config);
 	
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            gsl_vector_free(innov_v_regime_t[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(innov_v_regime_t[index_sbj_t]);
-    }
-    free(innov_v_regime_t);
-
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            gsl_matrix_free(residual_cov_regime_t[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(residual_cov_regime_t[index_sbj_t]);
-    }
-    free(residual_cov_regime_t);
-	/*MYPRINT("Finishing EKimFilter()");*/
-    return(-log_like);
+	FilterChunk chunk;
+	chunk.chunk_size=chunk_size;
+	chunk.t_start=0;
+	chunk.num_t=0;
+	chunk.eta_t=tensor_vector_alloc(chunk_size, config->dim_latent_var);
+	chunk.error_cov_t=tensor_matrix_alloc(chunk_size, config->dim_latent_var, config->dim_latent_var);
+	chunk.pr_t=tensor_vector_alloc(chunk_size, config->num_regime);
+	chunk.emit=emit;
+	chunk.sink=sink;
+	chunk.perturb=perturb;
+	chunk.seed=seed;
+	
+	for(sbj=0; sbj<config->num_sbj; sbj++){
+		log_like+=brekfis_subject(sbj, y, co_variate, y_time, &stream_config, init, &ws, &chunk, NULL);
+	}
+	filter_chunk_flush(&chunk);
+	
+	brekfis_diagnostics_add(config, ws.ekf->num_alloc, ws.ekf->num_pinv, 0, 0, 0, 0);
+	tensor_free(chunk.eta_t);
+	tensor_free(chunk.error_cov_t);
+	tensor_free(chunk.pr_t);
+	brekfis_workspace_free(&ws);
+	if(disc!=NULL){
+		exact_discretization_free(disc);
+	}
+	if(lin!=NULL){
+		linear_model_free(lin);
+	}
+	return(-log_like);
 }
 
 
@@ -1277,6 +1606,7 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
 	gsl_vector ***eta_regime_j_t, gsl_matrix ***error_cov_regime_j_t,
 	gsl_vector **eta_smooth, gsl_matrix **error_cov_smooth,
 	gsl_vector **pr_T, gsl_vector ***transprob_T,
+	const KimRetained *retain,
 	bool perturb, gsl_rng *seed){
 
     /**initialization**/
@@ -1285,8 +1615,11 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
     gsl_matrix *temp_modif_p=gsl_matrix_alloc(config->dim_latent_var, config->dim_latent_var);
     /*Pr[S_i,t+1=regime_k|Y_iT]*/
     gsl_vector *p_next_regime_T=gsl_vector_alloc(config->num_regime);
-    gsl_matrix *Jacob_dyn_x=gsl_matrix_calloc(config->dim_latent_var, config->dim_latent_var);
-    size_t sbj, t, index_sbj_t, regime_j,regime_k;
+    /*Jacobian matrix of the dynamic function into each regime k, for the pairs the filter did not retain a transition for*/
+    gsl_matrix **Jacob_dyn_x_k=tensor_matrix_alloc(config->num_regime, config->dim_latent_var, config->dim_latent_var);
+    const gsl_matrix *Jacob_dyn_x, *chol_P_jk_pred;
+    size_t sbj, t, regime_j,regime_k, pair;
+    bool need_jacob;
     /*size_t i;
       double params_aug[config->num_func_param+config->dim_latent_var];
         for (i=0;i<config->num_func_param;i++)
@@ -1297,30 +1630,15 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
     double sum_overk;
 
     gsl_matrix *eta_regime_jk_T=gsl_matrix_alloc(config->dim_latent_var,1);
-    gsl_vector *eta_regime_jk_T_vec=gsl_vector_alloc(config->dim_latent_var);
-    gsl_matrix *error_cov_regime_jk_T=gsl_matrix_alloc(config->dim_latent_var,config->dim_latent_var);
+    /*eta^jk_it|T and error_cov^jk_it|T for every k, collapsed over k for each j*/
+    gsl_vector **eta_regime_k_T=tensor_vector_alloc(config->num_regime, config->dim_latent_var);
+    gsl_matrix **error_cov_regime_k_T=tensor_matrix_alloc(config->num_regime, config->dim_latent_var, config->dim_latent_var);
     gsl_matrix *temp_diff_P=gsl_matrix_alloc(config->dim_latent_var,config->dim_latent_var);
 
     /*eta^k_it|T*/
-    gsl_vector ***eta_regime_j_smooth=(gsl_vector ***)malloc(config->total_obs*sizeof(gsl_vector **));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	eta_regime_j_smooth[index_sbj_t]=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    eta_regime_j_smooth[index_sbj_t][regime_j]=gsl_vector_calloc(config->dim_latent_var);
-	}
-    }
+    gsl_vector ***eta_regime_j_smooth=tensor_vector2_alloc(config->total_obs, config->num_regime, config->dim_latent_var);
     /*error_cov^k_it|T*/
-    gsl_matrix ***error_cov_regime_j_smooth=(gsl_matrix ***)malloc(config->total_obs*sizeof(gsl_matrix **));
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	error_cov_regime_j_smooth[index_sbj_t]=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-	for(regime_j=0; regime_j<config->num_regime; regime_j++){
-	    error_cov_regime_j_smooth[index_sbj_t][regime_j]=gsl_matrix_calloc(config->dim_latent_var,config->dim_latent_var);
-	}
-    }
+    gsl_matrix ***error_cov_regime_j_smooth=tensor_matrix2_alloc(config->total_obs, config->num_regime, config->dim_latent_var, config->dim_latent_var);
 
     for(sbj=0; sbj<config->num_sbj; sbj++){/*start of the sbj loop*/
 
@@ -1331,16 +1649,11 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
 
         for(regime_j=0; regime_j<config->num_regime; regime_j++){
             gsl_vector_memcpy(eta_regime_j_smooth[t][regime_j],eta_regime_j_t[t][regime_j]);
-            gsl_blas_daxpy(gsl_vector_get(pr_T[t],regime_j), eta_regime_j_smooth[t][regime_j], eta_smooth[t]);/*eta_smooth[t]=eta_smooth[t]+gsl_vector_get(pr_T[t],regime_j)*eta_regime_j_smooth[t][regime_j]*/
-
-
             gsl_matrix_memcpy(error_cov_regime_j_smooth[t][regime_j], error_cov_regime_j_t[t][regime_j]);
-			
-			mathfunction_collapse(eta_smooth[t], eta_regime_j_smooth[t][regime_j], 
-			error_cov_regime_j_smooth[t][regime_j], gsl_vector_get(pr_T[t],regime_j), error_cov_smooth[t],
-			temp_diff_eta_vec, temp_diff_eta, temp_modif_p);
-
         }
+        /*eta_smooth[t]=sum_j gsl_vector_get(pr_T[t],regime_j)*eta_regime_j_smooth[t][regime_j], and error_cov_smooth[t] around it*/
+        mathfunction_collapse_moments(config->num_regime, eta_regime_j_smooth[t], error_cov_regime_j_smooth[t], pr_T[t], 1.0,
+            eta_smooth[t], error_cov_smooth[t], temp_diff_eta_vec);
 
         /**start iteration**/
 
@@ -1350,6 +1663,18 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
             /**set the regime switch matrix**/
             config->func_regime_switch(t+1, 1, param->func_param, co_variate[t+1], param->regime_switch_mat);/*type=1*/
 
+            /*Jacobian matrix of the dynamic function, which does not depend on regime_j*/
+            /*Notice that the parameters input into function_dF_dx and function_dP_dt*/
+            for(regime_k=0; regime_k<config->num_regime; regime_k++){
+                need_jacob=retain==NULL;
+                for(regime_j=0; regime_j<config->num_regime && !need_jacob; regime_j++){
+                    need_jacob=!retain->has_jacob[((t+1)*config->num_regime+regime_j)*config->num_regime+regime_k];
+                }
+                if(need_jacob){
+                    config->func_jacob_dynam(y_time[t],y_time[t+1],regime_k,eta_regime_j_t[t][regime_k],param->func_param,config->num_func_param, co_variate[t],config->func_dF_dx, Jacob_dyn_x_k[regime_k]);
+                }
+            }
+
             for(regime_j=0; regime_j<config->num_regime; regime_j++){/*from regime regime_j*/
                 sum_overk=0;
 		 	   	
@@ -1358,6 +1683,8 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
 		        MYPRINT("\n");*/
 				
                 for(regime_k=0; regime_k<config->num_regime; regime_k++){/*to regime k*/
+                    gsl_vector *eta_regime_jk_T_vec=eta_regime_k_T[regime_k];
+                    gsl_matrix *error_cov_regime_jk_T=error_cov_regime_k_T[regime_k];
 
                     /*MYPRINT("sbj %lu t %lu from regime %lu to regime %lu\n",sbj,t,regime_j,regime_k);
                     MYPRINT("\n");*/
@@ -1375,29 +1702,45 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
 					/*print this sum_overk , i.e. check denominator not to near zero*/
 
 
-                    /*Jacobian matrix of the dynamic function*/
-                    /*Notice that the parameters input into function_dF_dx and function_dP_dt*/
+                    /*the transition the filter predicted the pair with, or the Jacobian matrix of the dynamic function*/
                     /*for (i=0;i<config->dim_latent_var;i++)
                         params_aug[config->num_func_param+i]=gsl_vector_get(eta_regime_j_t[t][regime_k],i);*/
-                    config->func_jacob_dynam(y_time[t],y_time[t+1],regime_k,eta_regime_j_t[t][regime_k],param->func_param,config->num_func_param, co_variate[t],config->func_dF_dx, Jacob_dyn_x);
+                    pair=((t+1)*config->num_regime+regime_j)*config->num_regime+regime_k;
+                    if(retain!=NULL && retain->has_jacob[pair]){
+                        Jacob_dyn_x=retain->jacob_dynam[t+1][regime_j][regime_k];
+                    }else{
+                        Jacob_dyn_x=Jacob_dyn_x_k[regime_k];
+                    }
 
                     /*P_tilde_regime_jk=error_cov_regime_j_t[t][regime_j] %*% Jacob_dyn_x %*% inv(error_cov_regime_jk_pred[t+1][regime_j][regime_k])*/
 
                     gsl_matrix_set_zero(P_tilde_regime_jk);
                     gsl_matrix_set_zero(pb);
-                    gsl_matrix_set_zero(inv_P_jk_pred);
                     gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, error_cov_regime_j_t[t][regime_j], Jacob_dyn_x, 0.0, pb); /* compute P*B'*/
 
                     /*MYPRINT("sbj %lu t-1 %lu \n",sbj,t);
                     print_matrix(error_cov_regime_jk_pred[t+1][regime_j][regime_k]);
                     MYPRINT("\n");*/
 					
-                    mathfunction_inv_matrix(error_cov_regime_jk_pred[t+1][regime_j][regime_k], inv_P_jk_pred);/*obtain the inverse matrix*/
+                    chol_P_jk_pred=NULL;
+                    if(retain!=NULL && retain->has_chol[pair]){
+                        chol_P_jk_pred=retain->chol_error_cov_pred[t+1][regime_j][regime_k];
+                    }else if(config->square_root && mathfunction_cholesky_psd(error_cov_regime_jk_pred[t+1][regime_j][regime_k], inv_P_jk_pred) == config->dim_latent_var){
+                        chol_P_jk_pred=inv_P_jk_pred;
+                    }
+                    if(chol_P_jk_pred!=NULL){
+                        /* compute P*B*Pjk^{-1} = P*B*L'^{-1}*L^{-1} with the Cholesky factor L of Pjk */
+                        gsl_matrix_memcpy(P_tilde_regime_jk, pb);
+                        gsl_blas_dtrsm(CblasRight, CblasLower, CblasTrans, CblasNonUnit, 1.0, chol_P_jk_pred, P_tilde_regime_jk);
+                        gsl_blas_dtrsm(CblasRight, CblasLower, CblasNoTrans, CblasNonUnit, 1.0, chol_P_jk_pred, P_tilde_regime_jk);
+                    }else{
+                        mathfunction_inv_matrix(error_cov_regime_jk_pred[t+1][regime_j][regime_k], inv_P_jk_pred);/*obtain the inverse matrix*/
 					
-					/*print_matrix(inv_P_jk_pred);
-                    MYPRINT("\n");*/
+					    /*print_matrix(inv_P_jk_pred);
+                        MYPRINT("\n");*/
 					
-                    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, pb, inv_P_jk_pred, 0.0, P_tilde_regime_jk); /* compute P*B*Pjk^{-1}*/
+                        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, pb, inv_P_jk_pred, 0.0, P_tilde_regime_jk); /* compute P*B*Pjk^{-1}*/
+                    }
                     
 					/*print_matrix(P_tilde_regime_jk);
                     MYPRINT("\n");*/
@@ -1425,14 +1768,6 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
 
 
 
-                    /*eta_regime_j_smooth[t][regime_j] = eta_regime_j_smooth[t][regime_j] + gsl_vector_get(transprob_T[t][regime_j],regime_k)*eta_regime_jk_T*/
-                    gsl_blas_daxpy(gsl_vector_get(transprob_T[t][regime_j],regime_k), eta_regime_jk_T_vec, eta_regime_j_smooth[t][regime_j]);;
-
-                    /*error_cov_regime_j_smooth[t][regime_j]*/
-					mathfunction_collapse(eta_regime_j_smooth[t][regime_j], eta_regime_jk_T_vec, 
-					error_cov_regime_jk_T, gsl_vector_get(transprob_T[t][regime_j],regime_k), error_cov_regime_j_smooth[t][regime_j],
-					temp_diff_eta_vec, temp_diff_eta, temp_modif_p);
-
                     /*if(t==998){
                     print_matrix(Jacob_dyn_x);
                     MYPRINT("\n");
@@ -1446,6 +1781,10 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
 
                }/*end of to regime k*/
 
+               /*eta_regime_j_smooth[t][regime_j] = sum_k gsl_vector_get(transprob_T[t][regime_j],regime_k)*eta_regime_jk_T/sum_overk,
+                *and error_cov_regime_j_smooth[t][regime_j] around it*/
+               mathfunction_collapse_moments(config->num_regime, eta_regime_k_T, error_cov_regime_k_T, transprob_T[t][regime_j], 1/sum_overk,
+                   eta_regime_j_smooth[t][regime_j], error_cov_regime_j_smooth[t][regime_j], temp_diff_eta_vec);
 
                if (sum_overk>1){
                    gsl_vector_scale(transprob_T[t][regime_j],1/sum_overk);
@@ -1453,9 +1792,6 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
                }else{
                    gsl_vector_set(pr_T[t], regime_j, sum_overk);
                }
-
-               gsl_vector_scale(eta_regime_j_smooth[t][regime_j],1/sum_overk);
-               gsl_matrix_scale(error_cov_regime_j_smooth[t][regime_j],1/sum_overk);
    			
 			/*MYPRINT("\n");
    			MYPRINT("sum_overk: %f\n",sum_overk);*/
@@ -1473,15 +1809,9 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
    			MYPRINT("\n");*/
 
             /*Final collapse over j*/
-            for(regime_j=0; regime_j<config->num_regime; regime_j++){
-
-                gsl_blas_daxpy(gsl_vector_get(pr_T[t],regime_j), eta_regime_j_smooth[t][regime_j], eta_smooth[t]);/*eta_smooth[t]=eta_smooth[t]+gsl_vector_get(pr_T[t],regime_j)*eta_regime_j_smooth[t][regime_j]*/
-
-				mathfunction_collapse(eta_smooth[t], eta_regime_j_smooth[t][regime_j], 
-				error_cov_regime_j_smooth[t][regime_j], gsl_vector_get(pr_T[t],regime_j), error_cov_smooth[t],
-				temp_diff_eta_vec, temp_diff_eta, temp_modif_p);
-
-            }
+            /*eta_smooth[t]=sum_j gsl_vector_get(pr_T[t],regime_j)*eta_regime_j_smooth[t][regime_j], and error_cov_smooth[t] around it*/
+            mathfunction_collapse_moments(config->num_regime, eta_regime_j_smooth[t], error_cov_regime_j_smooth[t], pr_T[t], 1.0,
+                eta_smooth[t], error_cov_smooth[t], temp_diff_eta_vec);
 			
 			/*MYPRINT("eta_smooth[t]:\n");
    			print_vector(eta_smooth[t]);
@@ -1500,39 +1830,20 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
     gsl_matrix_free(temp_modif_p);
     /*Pr[S_i,t+1=regime_k|Y_iT]*/
     gsl_vector_free(p_next_regime_T);
-    gsl_matrix_free(Jacob_dyn_x);
+    tensor_free(Jacob_dyn_x_k);
 
     gsl_matrix_free(P_tilde_regime_jk);
     gsl_matrix_free(pb);
     gsl_matrix_free(inv_P_jk_pred);
 
     gsl_matrix_free(eta_regime_jk_T);
-    gsl_vector_free(eta_regime_jk_T_vec);
-    gsl_matrix_free(error_cov_regime_jk_T);
+    tensor_free(eta_regime_k_T);
+    tensor_free(error_cov_regime_k_T);
     gsl_matrix_free(temp_diff_P);
 	
-    /*output of smooth: eta^k_it|T*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            gsl_vector_free(eta_regime_j_smooth[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(eta_regime_j_smooth[index_sbj_t]);
-    }
-    free(eta_regime_j_smooth);
-
-
-    /*output of smooth: error_cov^k_it|T*/
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<config->num_regime; regime_j++){
-            gsl_matrix_free(error_cov_regime_j_smooth[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<config->total_obs;index_sbj_t++){
-        free(error_cov_regime_j_smooth[index_sbj_t]);
-    }
-    free(error_cov_regime_j_smooth);
+    /*output of smooth: eta^k_it|T and error_cov^k_it|T*/
+    tensor_free(eta_regime_j_smooth);
+    tensor_free(error_cov_regime_j_smooth);
 	
 
 }/*end of function EKimSmoother*/
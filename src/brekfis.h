@@ -5,11 +5,14 @@
 #include <gsl/gsl_vector.h>
 #include <stdlib.h>
 #include "data_structure.h"
+#include "sensitivity.h"
 #include <gsl/gsl_rng.h>
 
 
 double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, double *y_time, const ParamConfig *config,  ParamInit *init, Param *param);
 
+double brekfis_score(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, double *y_time, const ParamConfig *config, ParamInit *init, Param *param, const ParamTangent *tangent, double *grad);
+
 /**
  * run brekfis. It will call gsl_multimin_fminimizer to minize the brekfis_obj() function with nmsimplex2 algorithm.
  * More details about the algorithm is available at: http://www.gnu.org/software/gsl/manual/html_node/Multimin-Algorithms-without-Derivatives.html#Multimin-Algorithms-without-Derivatives
@@ -26,10 +29,36 @@ double brekfis(gsl_vector ** y, gsl_vector **co_variate, size_t total_time, doub
  */
 
 
+/**
+ * Prints the counters accumulated in config->diagnostics over the filter runs of a fit, when config->verbose_flag is set.
+ */
+void brekfis_diagnostics_print(const ParamConfig *config);
+
 void model_constraint_par(const ParamConfig *pc, Param *par);
 void model_constraint_init(const ParamConfig *pc, ParamInit *pi);
 
 
+/**
+* The prediction of every regime pair retained by EKimFilter() for EKimSmoother(), indexed [t][j][k] like
+* error_cov_regime_jk_pred: the transition matrix the filter propagated error_cov^j_i,t-1|t-1 with, and the lower
+* triangular factor L of error_cov^regime_jk_it|t-1 = LL'. With them the smoother gain is two triangular solves
+* instead of a Jacobian call and an inversion per pair.
+* has_jacob and has_chol, indexed (t*num_regime+j)*num_regime+k, are false where the filter had no transition
+* matrix (the first time point of a subject and continuous-time models integrated by the ODE solver) or
+* where the predicted covariance is not positive definite; the smoother computes those pairs itself.
+* jacob_dynam is NULL for continuous-time models without exact_discretization, which never have a transition.
+**/
+typedef struct KimRetained{
+	gsl_matrix ****jacob_dynam;
+	gsl_matrix ****chol_error_cov_pred;
+	bool *has_jacob;
+	bool *has_chol;
+} KimRetained;
+
+KimRetained *kim_retained_alloc(const ParamConfig *config);
+
+void kim_retained_free(KimRetained *retain);
+
 /****************************Extended Kim Filter************************/
 /**
 * This function implements the extended Kim Filter
@@ -59,6 +88,7 @@ void model_constraint_init(const ParamConfig *pc, ParamInit *pi);
 * inv_residual_cov -- inverse of the residual covariance
 * eta_t -- filtered state estimate
 * error_cov_t -- filtered state estimate
+* retain -- filled with the transitions and factors of the predictions for EKimSmoother(), or NULL
 **/
 
 double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, const ParamConfig *config, ParamInit *init, Param *param,
@@ -68,6 +98,29 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 	gsl_vector **eta_t, gsl_matrix **error_cov_t, 
 	gsl_vector **eta_pred_t, gsl_matrix **error_cov_pred_t, 
 	gsl_vector **innov_v_t, gsl_matrix **residual_cov_t,
+	KimRetained *retain,
+	bool perturb, gsl_rng *seed);
+
+/**
+* This function runs the extended Kim Filter without retaining any per-time output.
+* Only O(num_regime^2) filter state is carried from one time point to the next; the filtered
+* moments are buffered for chunk_size consecutive time points and handed to emit() one chunk at a time.
+* Subjects are filtered in order, so the chunks arrive in increasing t.
+* The returned negative log-likelihood is the same as that of EKimFilter(); like it, every regime pair is stepped,
+* whatever ParamConfig::prune_threshold.
+* *
+* **>>Output via emit(t_start, num_t, eta_t, error_cov_t, pr_t, sink)<<**
+* eta_t[i] -- filtered state estimate at time t_start+i
+* error_cov_t[i] -- filtered error covariance at time t_start+i
+* pr_t[i] -- Pr(S_it=k|Y_it) at time t_start+i
+* The arrays are reused for the next chunk once emit() returns.
+**/
+
+#define EKIMFILTER_STREAM_CHUNK 256
+
+double EKimFilterStream(gsl_vector ** y, gsl_vector **co_variate, double *y_time, const ParamConfig *config, ParamInit *init, Param *param,
+	size_t chunk_size,
+	void (*emit)(size_t, size_t, gsl_vector **, gsl_matrix **, gsl_vector **, void *), void *sink,
 	bool perturb, gsl_rng *seed);
 
 /****************************Extended Kim Smoother************************/
@@ -86,6 +139,7 @@ double EKimFilter(gsl_vector ** y, gsl_vector **co_variate, double *y_time, cons
 * error_cov_regime_jk_pred -- error_cov^regime_jk_it|t-1 *
 * eta_regime_j_t -- eta^k_it|t*
 * error_cov_regime_j_t -- error_cov^k_it|t*
+* retain -- the transitions and factors retained by EKimFilter(), or NULL *
 * *
 * Output*
 * *
@@ -101,6 +155,7 @@ void EKimSmoother(double *y_time, gsl_vector **co_variate, const ParamConfig *co
     gsl_vector **pr_t_given_t_minus_1, gsl_vector **pr_t, 
 	gsl_vector ****eta_regime_jk_pred,gsl_matrix ****error_cov_regime_jk_pred,gsl_vector ***eta_regime_j_t,gsl_matrix ***error_cov_regime_j_t,
     gsl_vector **eta_smooth,gsl_matrix **error_cov_smooth,gsl_vector **pr_T,gsl_vector ***transprob_T,
+	const KimRetained *retain,
 	bool perturb, gsl_rng *seed);
 
 #endif
@@ -10,6 +10,49 @@
 #include <gsl/gsl_vector.h>
 #include <stdbool.h>
 
+/**
+ * what a model function depends on besides the parameters, as reported by the generated *_dependency() functions
+ */
+#define DEPEND_PARAM 0 /** the parameters only **/
+#define DEPEND_COVARIATE 1 /** also the covariates **/
+#define DEPEND_TIME 2 /** also the time, or unknown **/
+
+/**
+ * missing-data patterns of the observations, found once when the data are read in
+ * The observed entries of pattern p are obs_index[obs_offset[p]] to obs_index[obs_offset[p+1]-1].
+ */
+typedef struct MissPattern{
+    size_t num_pattern; /** number of distinct patterns **/
+    size_t *pattern_of_row; /** pattern ID of each row of y **/
+    size_t *obs_offset; /** start of each pattern in obs_index; num_pattern+1 entries **/
+    size_t *obs_index; /** indices of the observed entries, pattern by pattern **/
+} MissPattern;
+
+/**
+ * subjects with the same design: the same number of time points, the same intervals between them
+ * and the same missing-data pattern at each of them, found once when the data are read in
+ * The subjects of group g are sbj_of_group[group_offset[g]] to sbj_of_group[group_offset[g+1]-1], in increasing order.
+ */
+typedef struct DesignGroups{
+    size_t num_group; /** number of distinct designs **/
+    size_t *group_of_sbj; /** group of each subject **/
+    size_t *group_offset; /** start of each group in sbj_of_group; num_group+1 entries **/
+    size_t *sbj_of_group; /** subjects, group by group **/
+} DesignGroups;
+
+/**
+ * counters of the filter, accumulated over all the likelihood evaluations of one call of main_R() and reported once at its end
+ */
+typedef struct FilterDiagnostics{
+    size_t num_eval; /** number of filter runs **/
+    size_t num_alloc; /** heap allocations in the filter loop **/
+    size_t num_pinv; /** measurement updates whose innovation covariance fell back to the pseudo-inverse **/
+    size_t num_pruned; /** regime pairs not stepped by the pruned Kim filter **/
+    size_t num_pairs; /** regime pairs of the pruned Kim filter **/
+    double prune_estimate; /** largest estimate of the change of the log-likelihood of one run, see brekfis_fill_pruned() **/
+    double prune_mass; /** largest prior mass of the pruned pairs at one time point **/
+} FilterDiagnostics;
+
 /**
  * configuration of the model
  */
@@ -20,13 +63,30 @@ typedef struct ParamConfig{
     size_t num_func_param; /** the number parameters for user-defined functions **/
     bool second_order; /** whether second-order ekf is used **/
     bool adaodesolver; /** whether adaptive ode solver is used **/
+    bool fused_ode; /** whether the RK4 step of a continuous-time model advances eta and P together **/
     bool isnegloglikeweightedbyT;/** whether the negative loglikelihood is weighted by individual T**/
+    bool central_diff_grad; /** whether the gradient uses central instead of forward differences **/
+    bool analytic_grad; /** whether the gradient comes from the tangent-linear filter of sensitivity.h **/
     size_t dim_co_variate;
     size_t num_sbj; /** number of subjects **/
     size_t *index_sbj;
     size_t total_obs;
+    const MissPattern *miss_pattern; /** missing-data patterns of y, or NULL to scan each row for NA **/
+    const DesignGroups *design_groups; /** subjects grouped by design, or NULL **/
     bool isContinuousTime; /** Flag for continuous-time model: 1 = yes; 0 = no**/
     bool verbose_flag; /** Flag for printing verbose output, including every function evaluation; 1 = yes; 0 = no**/
+    size_t regime_switch_dependency; /** DEPEND_PARAM, DEPEND_COVARIATE or DEPEND_TIME, for func_regime_switch **/
+    size_t noise_cov_dependency; /** DEPEND_PARAM, DEPEND_COVARIATE or DEPEND_TIME, for func_noise_cov **/
+    size_t dF_dx_dependency; /** DEPEND_PARAM, DEPEND_COVARIATE or DEPEND_TIME, for func_dF_dx; DEPEND_PARAM means linear dynamics with a constant drift matrix **/
+    const size_t *dynam_regime_class; /** per regime, the first regime with the same dynamics as reported by the model compiler, or NULL when every regime may differ **/
+    const size_t *measure_regime_class; /** the same for the measurement **/
+    bool exact_discretization; /** whether linear continuous-time dynamics are discretized exactly, see discretization.h **/
+    bool steady_state; /** whether the filter keeps the gain of a converged time-invariant covariance recursion, see ekf_workspace_allow_steady_state() **/
+    bool square_root; /** whether ext_kalmanfilter() updates Cholesky factors of the covariance matrices by QR decompositions, carried across time points, see EKFWorkspace::sqrt_carry **/
+    bool sequential_update; /** whether ext_kalmanfilter() processes the observed entries one at a time when the measurement noise covariance is diagonal **/
+    bool collapsed_update; /** whether ext_kalmanfilter() updates in the latent dimension when there are more than EKF_COLLAPSE_RATIO observed entries per latent variable **/
+    double prune_threshold; /** the prior mass of a regime pair below which the Kim filter does not step it, see brekfis(); 0 steps every pair **/
+    FilterDiagnostics *diagnostics; /** accumulated by every filter run, or NULL **/
 
     /** time, regime, parameter, eta_t, co_variate, Hk, y_t **/
     void (*func_measure)(size_t, size_t, double *, const gsl_vector *, const gsl_vector *, gsl_matrix *, gsl_vector *);
@@ -55,6 +115,14 @@ typedef struct ParamConfig{
     /** tstart, tend, regime, xstart,gparameters, n_gparam,co_variate, (*g)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),x_tend **/
     void (*func_dynam)(const double, const double, size_t, const gsl_vector *,
         double *, size_t, const gsl_vector *, void (*g)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *), gsl_vector *);
+    /** size_t regime, double *param, gsl_matrix *A, gsl_matrix *B, gsl_vector *c of x[t] = A x[t-1] + B u[t] + c; NULL unless the dynamics are known to be linear, see linearmodel.h **/
+    void (*func_linear_dynam)(size_t, double *, gsl_matrix *, gsl_matrix *, gsl_vector *);
+    /** size_t regime, double *param, gsl_matrix *H, gsl_matrix *D, gsl_vector *d of y[t] = H x[t] + D u[t] + d; NULL unless the measurement is known to be linear **/
+    void (*func_linear_measure)(size_t, double *, gsl_matrix *, gsl_matrix *, gsl_vector *);
+    /** the derivatives of A, B and c of func_linear_dynam along a direction of the parameters, passed in place of param; NULL unless written by the recipe, see linear_model_dparam_alloc() **/
+    void (*func_linear_dynam_dparam)(size_t, double *, gsl_matrix *, gsl_matrix *, gsl_vector *);
+    /** the derivatives of H, D and d of func_linear_measure along a direction of the parameters; NULL unless written by the recipe **/
+    void (*func_linear_measure_dparam)(size_t, double *, gsl_matrix *, gsl_matrix *, gsl_vector *);
  } ParamConfig;
 
 /**
@@ -62,9 +130,11 @@ typedef struct ParamConfig{
  */
 typedef struct Data_and_Model{
     ParamConfig pc; /** model configuraiton */
-    gsl_vector **y; /** observed variables */
-    gsl_vector **co_variate; /** covariates */
+    gsl_vector **y; /** observed variables: y[t] is a view of row t of the data */
+    gsl_vector **co_variate; /** covariates: co_variate[t] is a view of row t of the data, or NULL without covariates */
     double *y_time; /** observed real times**/
+    gsl_matrix *y_mat; /** storage of the observed variables, one row per time point */
+    gsl_matrix *co_variate_mat; /** storage of the covariates, one row per time point, or NULL without covariates */
 
  } Data_and_Model;
 
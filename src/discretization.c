@@ -0,0 +1,151 @@
+/**
+ * This file implements the exact discretization of linear continuous-time dynamics used by
+ * ext_kalmanfilter() in place of the ODE solver, see discretization.h.
+ */
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_linalg.h>
+#include "discretization.h"
+#include "brekfis.h"
+#include "tensor.h"
+
+static int compare_double(const void *a, const void *b){
+	double x=*(const double *)a, y=*(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*Phi and Gamma of one interval from exp([A I; 0 0] dt)*/
+static void discretize_dynamics(const gsl_matrix *drift, double dt, gsl_matrix *block, gsl_matrix *block_exp, gsl_matrix *transition, gsl_matrix *input){
+	size_t nx=drift->size1;
+	gsl_matrix_view sub;
+
+	gsl_matrix_set_zero(block);
+	sub=gsl_matrix_submatrix(block, 0, 0, nx, nx);
+	gsl_matrix_memcpy(&sub.matrix, drift);
+	sub=gsl_matrix_submatrix(block, 0, nx, nx, nx);
+	gsl_matrix_set_identity(&sub.matrix);
+	gsl_matrix_scale(block, dt);
+	gsl_linalg_exponential_ss(block, block_exp, GSL_PREC_DOUBLE);
+
+	sub=gsl_matrix_submatrix(block_exp, 0, 0, nx, nx);
+	gsl_matrix_memcpy(transition, &sub.matrix);
+	sub=gsl_matrix_submatrix(block_exp, 0, nx, nx, nx);
+	gsl_matrix_memcpy(input, &sub.matrix);
+}
+
+/*Q(dt) from exp([-A Q; 0 A'] dt) = [. G; 0 Phi'], as Phi G*/
+static void discretize_noise(const gsl_matrix *drift, const gsl_matrix *noise_cov, const gsl_matrix *transition, double dt, gsl_matrix *block, gsl_matrix *block_exp, gsl_matrix *noise){
+	size_t nx=drift->size1, i, j;
+	double v;
+	gsl_matrix_view sub;
+
+	gsl_matrix_set_zero(block);
+	sub=gsl_matrix_submatrix(block, 0, 0, nx, nx);
+	gsl_matrix_memcpy(&sub.matrix, drift);
+	gsl_matrix_scale(&sub.matrix, -1.0);
+	sub=gsl_matrix_submatrix(block, 0, nx, nx, nx);
+	gsl_matrix_memcpy(&sub.matrix, noise_cov);
+	sub=gsl_matrix_submatrix(block, nx, nx, nx, nx);
+	gsl_matrix_transpose_memcpy(&sub.matrix, drift);
+	gsl_matrix_scale(block, dt);
+	gsl_linalg_exponential_ss(block, block_exp, GSL_PREC_DOUBLE);
+
+	sub=gsl_matrix_submatrix(block_exp, 0, nx, nx, nx);
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, transition, &sub.matrix, 0.0, noise);
+	/*symmetric up to rounding*/
+	for(i=0; i<nx; i++){
+		for(j=i+1; j<nx; j++){
+			v=0.5*(gsl_matrix_get(noise, i, j)+gsl_matrix_get(noise, j, i));
+			gsl_matrix_set(noise, i, j, v);
+			gsl_matrix_set(noise, j, i, v);
+		}
+	}
+}
+
+ExactDiscretization *exact_discretization_alloc(const double *y_time, gsl_vector **co_variate, const ParamConfig *config, const Param *param){
+	size_t nx=config->dim_latent_var, num_regime=config->num_regime;
+	size_t sbj, t, i, n=0, regime_j, regime_k;
+	const gsl_vector *co_variate_0=co_variate != NULL? co_variate[0] : NULL;
+	ExactDiscretization *disc=(ExactDiscretization *)malloc(sizeof(ExactDiscretization));
+
+	/*distinct intervals between consecutive time points of a subject*/
+	disc->dt=(double *)malloc((config->total_obs+1)*sizeof(double));
+	for(sbj=0; sbj<config->num_sbj; sbj++){
+		for(t=config->index_sbj[sbj]+1; t<config->index_sbj[sbj+1]; t++){
+			disc->dt[n++]=y_time[t]-y_time[t-1];
+		}
+	}
+	qsort(disc->dt, n, sizeof(double), compare_double);
+	disc->num_dt=0;
+	for(i=0; i<n; i++){
+		if(disc->num_dt == 0 || disc->dt[i]-disc->dt[disc->num_dt-1] > DISC_DT_TOL*fabs(disc->dt[i])){
+			disc->dt[disc->num_dt++]=disc->dt[i];
+		}
+	}
+
+	disc->transition=tensor_matrix2_alloc(disc->num_dt, num_regime, nx, nx);
+	disc->input=tensor_matrix2_alloc(disc->num_dt, num_regime, nx, nx);
+	disc->noise=tensor_matrix3_alloc(disc->num_dt, num_regime, num_regime, nx, nx);
+
+	/*the drift matrices and the constrained process noise covariance matrices of all regimes*/
+	gsl_matrix **drift=tensor_matrix_alloc(num_regime, nx, nx);
+	gsl_matrix **eta_noise_cov=tensor_matrix_alloc(num_regime, nx, nx);
+	Param par;
+	par.func_param=param->func_param;
+	par.y_noise_cov=gsl_matrix_alloc(config->dim_obs_var, config->dim_obs_var);
+	for(regime_k=0; regime_k<num_regime; regime_k++){
+		config->func_dF_dx(0, regime_k, param->func_param, co_variate_0, drift[regime_k]);
+		par.eta_noise_cov=eta_noise_cov[regime_k];
+		gsl_matrix_memcpy(par.y_noise_cov, param->y_noise_cov);
+		gsl_matrix_memcpy(par.eta_noise_cov, param->eta_noise_cov);
+		config->func_noise_cov(0, regime_k, par.func_param, par.y_noise_cov, par.eta_noise_cov);
+		model_constraint_par(config, &par);
+	}
+
+	gsl_matrix *block=gsl_matrix_alloc(2*nx, 2*nx);
+	gsl_matrix *block_exp=gsl_matrix_alloc(2*nx, 2*nx);
+	for(i=0; i<disc->num_dt; i++){
+		for(regime_k=0; regime_k<num_regime; regime_k++){
+			discretize_dynamics(drift[regime_k], disc->dt[i], block, block_exp, disc->transition[i][regime_k], disc->input[i][regime_k]);
+			for(regime_j=0; regime_j<num_regime; regime_j++){
+				discretize_noise(drift[regime_k], eta_noise_cov[regime_j], disc->transition[i][regime_k], disc->dt[i], block, block_exp, disc->noise[i][regime_j][regime_k]);
+			}
+		}
+	}
+
+	gsl_matrix_free(block);
+	gsl_matrix_free(block_exp);
+	gsl_matrix_free(par.y_noise_cov);
+	tensor_free(drift);
+	tensor_free(eta_noise_cov);
+	return disc;
+}
+
+void exact_discretization_free(ExactDiscretization *disc){
+	free(disc->dt);
+	tensor_free(disc->transition);
+	tensor_free(disc->input);
+	tensor_free(disc->noise);
+	free(disc);
+}
+
+size_t exact_discretization_find(const ExactDiscretization *disc, double dt){
+	size_t lo=0, hi=disc->num_dt, mid;
+	double tol=DISC_DT_TOL*fabs(dt);
+	/*first interval not below dt-tol*/
+	while(lo < hi){
+		mid=lo+(hi-lo)/2;
+		if(disc->dt[mid] < dt-tol){
+			lo=mid+1;
+		}else{
+			hi=mid;
+		}
+	}
+	if(lo < disc->num_dt && fabs(disc->dt[lo]-dt) <= tol){
+		return lo;
+	}
+	return disc->num_dt;
+}
@@ -0,0 +1,43 @@
+#ifndef DISCRETIZATION_H_INCLUDED
+#define DISCRETIZATION_H_INCLUDED
+
+#include <stdlib.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "data_structure.h"
+
+/**
+ * Exact discretization of linear continuous-time dynamics dx/dt = A x + b, where the drift matrix A
+ * from func_dF_dx and the process noise covariance Q from func_noise_cov depend on the parameters only.
+ * Over an interval dt the prediction of the EKF becomes
+ *   x(t+dt) = Phi x(t) + Gamma b,   P(t+dt) = Phi P(t) Phi' + Q(dt),
+ * with Phi = exp(A dt), Gamma = int_0^dt exp(A s) ds and Q(dt) = int_0^dt exp(A s) Q exp(A' s) ds.
+ * These are computed with the block matrix exponentials of Van Loan (1978), once per distinct
+ * interval of the data and per regime, so a likelihood evaluation integrates no ODEs.
+ * The intercept b may depend on the covariates and is evaluated at every step.
+ */
+
+#define DISC_DT_TOL 1e-12 /*relative difference below which two intervals share their discretization*/
+
+typedef struct ExactDiscretization{
+	size_t num_dt; /** number of distinct intervals **/
+	double *dt; /** distinct intervals between consecutive time points of a subject, ascending **/
+	gsl_matrix ***transition; /** [dt][regime_k]: Phi with the dynamics of regime_k **/
+	gsl_matrix ***input; /** [dt][regime_k]: Gamma with the dynamics of regime_k **/
+	gsl_matrix ****noise; /** [dt][regime_j][regime_k]: Q(dt) with the process noise of regime_j and the dynamics of regime_k **/
+} ExactDiscretization;
+
+/**
+ * @param param the parameters; its noise covariance matrices are used as templates for func_noise_cov
+ * @return the discretization of every interval in y_time, to be shared read-only by all threads
+ */
+ExactDiscretization *exact_discretization_alloc(const double *y_time, gsl_vector **co_variate, const ParamConfig *config, const Param *param);
+
+void exact_discretization_free(ExactDiscretization *disc);
+
+/**
+ * @return the index of dt in disc->dt, or disc->num_dt if it is not there
+ */
+size_t exact_discretization_find(const ExactDiscretization *disc, double dt);
+
+#endif
@@ -0,0 +1,133 @@
+/********************************************************
+* The embedded Runge-Kutta ODE solver
+* Purpose: adaptive alternative to rk4_odesolver() that allocates nothing per call
+* References: Dormand, J. R. & Prince, P. J. (1980). A family of embedded Runge-Kutta formulae.
+*   Journal of Computational and Applied Mathematics, 6, 19-26.
+********************************************************/
+
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_blas.h>
+#include "dopriodesolver.h"
+
+/*nodes, coefficients and weights of the Dormand-Prince 5(4) pair; the last row of ode_a holds the fifth-order weights*/
+static const double ode_c[7]={0.0, 1.0/5, 3.0/10, 4.0/5, 8.0/9, 1.0, 1.0};
+static const double ode_a[7][6]={
+	{0.0},
+	{1.0/5},
+	{3.0/40, 9.0/40},
+	{44.0/45, -56.0/15, 32.0/9},
+	{19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729},
+	{9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, -5103.0/18656},
+	{35.0/384, 0.0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84}
+};
+/*fifth-order minus fourth-order weights, for the local error estimate*/
+static const double ode_e[7]={71.0/57600, 0.0, -71.0/16695, 71.0/1920, -17253.0/339200, 22.0/525, -1.0/40};
+
+OdeWorkspace *ode_workspace_alloc(size_t np){
+	size_t s;
+	OdeWorkspace *ws=(OdeWorkspace *)malloc(sizeof(OdeWorkspace));
+	ws->np=np;
+	for(s=0; s<7; s++){
+		ws->k[s]=gsl_vector_alloc(np);
+	}
+	ws->x=gsl_vector_alloc(np);
+	ws->x_stage=gsl_vector_alloc(np);
+	ws->step=0;
+	return ws;
+}
+
+void ode_workspace_free(OdeWorkspace *ws){
+	size_t s;
+	for(s=0; s<7; s++){
+		gsl_vector_free(ws->k[s]);
+	}
+	gsl_vector_free(ws->x);
+	gsl_vector_free(ws->x_stage);
+	free(ws);
+}
+
+void ode_workspace_reset(OdeWorkspace *ws){
+	ws->step=0;
+}
+
+void ode_dopri_solve(OdeWorkspace *ws, const double tstart, const double tend, size_t regime, const gsl_vector *xstart,
+	double *gparameters, size_t n_gparam, const gsl_vector *co_variate,
+	void (*g)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),
+	gsl_vector *x_tend){
+	
+	size_t np=ws->np, i, s, j, n_step=0;
+	double t=tstart, h, h_try, h_min, err, err_norm, scale, factor;
+	gsl_vector *swap;
+	
+	gsl_vector_memcpy(ws->x, xstart);
+	if(tend <= tstart){
+		gsl_vector_memcpy(x_tend, ws->x);
+		return;
+	}
+	/*the first guess is the step size the last call ended with, or the whole interval*/
+	h=ws->step > 0 ? ws->step : tend-tstart;
+	h_min=ODE_MIN_STEP*(tend-tstart);
+	(*g)(t, regime, ws->x, gparameters, n_gparam, co_variate, ws->k[0]);
+	
+	while(t < tend){
+		int clipped=t+h >= tend || n_step+1 >= ODE_MAX_STEPS;
+		h_try=clipped ? tend-t : h;
+		
+		/*stages; the last one is evaluated at the fifth-order solution*/
+		for(s=1; s<7; s++){
+			gsl_vector_memcpy(ws->x_stage, ws->x);
+			for(j=0; j<s; j++){
+				if(ode_a[s][j] != 0){
+					gsl_blas_daxpy(h_try*ode_a[s][j], ws->k[j], ws->x_stage);
+				}
+			}
+			(*g)(t+ode_c[s]*h_try, regime, ws->x_stage, gparameters, n_gparam, co_variate, ws->k[s]);
+		}
+		
+		/*root mean square of the local error relative to the tolerance*/
+		err_norm=0;
+		for(i=0; i<np; i++){
+			err=0;
+			for(s=0; s<7; s++){
+				err+=ode_e[s]*gsl_vector_get(ws->k[s], i);
+			}
+			scale=ODE_ATOL+ODE_RTOL*fmax(fabs(gsl_vector_get(ws->x, i)), fabs(gsl_vector_get(ws->x_stage, i)));
+			err_norm+=(h_try*err/scale)*(h_try*err/scale);
+		}
+		err_norm=sqrt(err_norm/np);
+		n_step++;
+		
+		if(!isfinite(err_norm) && h_try <= h_min){
+			/*the solution has blown up, and no step size will bring it back*/
+			gsl_vector_set_all(x_tend, NAN);
+			ws->step=0;
+			return;
+		}
+		if(err_norm <= 1.0 || (clipped && n_step >= ODE_MAX_STEPS) || h_try <= h_min){
+			t=clipped ? tend : t+h_try;
+			swap=ws->x; ws->x=ws->x_stage; ws->x_stage=swap;
+			swap=ws->k[0]; ws->k[0]=ws->k[6]; ws->k[6]=swap;
+			factor=err_norm > 0 ? fmin(5.0, fmax(0.2, 0.9*pow(err_norm, -0.2))) : 5.0;
+			/*a step shortened to hit tend says little about the step size the solution allows*/
+			h=clipped ? fmax(h, h_try*factor) : h_try*factor;
+		}else{
+			factor=isfinite(err_norm) ? fmax(0.2, 0.9*pow(err_norm, -0.2)) : 0.2;
+			h=h_try*factor;
+		}
+		h=fmax(h, h_min);
+	}
+	
+	ws->step=h;
+	gsl_vector_memcpy(x_tend, ws->x);
+}
+
+void dopri_odesolver(const double tstart, const double tend, size_t regime, const gsl_vector *xstart,
+	double *gparameters, size_t n_gparam, const gsl_vector *co_variate,
+	void (*g)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),
+	gsl_vector *x_tend){
+	OdeWorkspace *ws=ode_workspace_alloc(xstart->size);
+	ode_dopri_solve(ws, tstart, tend, regime, xstart, gparameters, n_gparam, co_variate, g, x_tend);
+	ode_workspace_free(ws);
+}
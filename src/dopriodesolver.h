@@ -0,0 +1,54 @@
+#ifndef DOPRIODESOLVER_H_INCLUDED
+#define DOPRIODESOLVER_H_INCLUDED
+
+#include <stdlib.h>
+#include <gsl/gsl_vector.h>
+
+/**
+ * Adaptive ODE solver with the embedded Runge-Kutta pair of Dormand and Prince, orders 5(4).
+ * The step size is chosen from the local error estimate of the pair.
+ * All scratch space lives in an OdeWorkspace of O(np) memory, so a call allocates nothing,
+ * and the workspace keeps the last accepted step size as the first guess of the next call.
+ */
+
+#define ODE_RTOL 1e-6 /*relative tolerance of the local error*/
+#define ODE_ATOL 1e-8 /*absolute tolerance of the local error*/
+#define ODE_MAX_STEPS 10000 /*number of steps after which the rest of the interval is taken in one step whatever its error*/
+#define ODE_MIN_STEP 1e-12 /*steps this fraction of the interval or shorter are accepted whatever their error*/
+
+typedef struct OdeWorkspace{
+	size_t np; /** dimension of the system **/
+	gsl_vector *k[7]; /** stage derivatives; k[6] at the end of a step is k[0] of the next one **/
+	gsl_vector *x; /** state at the current time **/
+	gsl_vector *x_stage; /** argument of the stage derivatives; after the last stage, the state at the end of the step **/
+	double step; /** last accepted step size, or 0 before the first step **/
+} OdeWorkspace;
+
+OdeWorkspace *ode_workspace_alloc(size_t np);
+
+void ode_workspace_free(OdeWorkspace *ws);
+
+/**
+ * Forget the step size carried over from previous calls
+ */
+void ode_workspace_reset(OdeWorkspace *ws);
+
+/**
+ * Integrate dx/dt = g(t, x) from tstart to tend.
+ * @param ws workspace of dimension xstart->size
+ * @param x_tend receives x(tend); may not alias xstart
+ */
+void ode_dopri_solve(OdeWorkspace *ws, const double tstart, const double tend, size_t regime, const gsl_vector *xstart,
+	double *gparameters, size_t n_gparam, const gsl_vector *co_variate,
+	void (*g)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),
+	gsl_vector *x_tend);
+
+/**
+ * ode_dopri_solve() with the signature of ParamConfig::func_dynam, using a workspace of its own for the call
+ */
+void dopri_odesolver(const double tstart, const double tend, size_t regime, const gsl_vector *xstart,
+	double *gparameters, size_t n_gparam, const gsl_vector *co_variate,
+	void (*g)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),
+	gsl_vector *x_tend);
+
+#endif
@@ -15,15 +15,356 @@
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_blas.h>
+#include <gsl/gsl_linalg.h>
 #include "math_function.h"
 #include "ekf.h"
+#include "tensor.h"
 #include "adaodesolver.h"
 #include <R.h>
 #include <Rinternals.h>
 #include "print_function.h"
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
 
+/*y=alpha*x+y*/
+static void ekf_matrix_axpy(double alpha, const gsl_matrix *x, gsl_matrix *y){
+	size_t i, j;
+	for(i=0; i<y->size1; i++){
+		for(j=0; j<y->size2; j++){
+			gsl_matrix_set(y, i, j, gsl_matrix_get(y, i, j)+alpha*gsl_matrix_get(x, i, j));
+		}
+	}
+}
+
+/*whether a and b differ by at most EKF_STEADY_TOL times the largest entry of b*/
+static bool ekf_steady_close(const gsl_matrix *a, const gsl_matrix *b){
+	size_t i, j;
+	double diff = 0, scale = 0;
+	for(i=0; i<b->size1; i++){
+		for(j=0; j<b->size2; j++){
+			diff = fmax(diff, fabs(gsl_matrix_get(a, i, j)-gsl_matrix_get(b, i, j)));
+			scale = fmax(scale, fabs(gsl_matrix_get(b, i, j)));
+		}
+	}
+	return diff <= EKF_STEADY_TOL*scale;
+}
+
+/*whether a covariance matrix is diagonal*/
+static bool ekf_is_diagonal(const gsl_matrix *mat){
+	size_t i, j;
+	for(i=0; i<mat->size1; i++){
+		for(j=0; j<mat->size2; j++){
+			if(j != i && gsl_matrix_get(mat, i, j) != 0.0){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*the measurement update for a diagonal measurement noise covariance R, which processes the observed entries one at a time:
+ *entry i has the scalar innovation variance f=hPh'+r and the innovation v=e-h delta, with e=y-y_hat and
+ *delta the change of eta over the entries before it, and updates delta+=Ph'v/f and P-=Ph'hP/f.
+ *The f are the pivots of the LDL' factorization of the innovation covariance, so the likelihood is that of the joint update,
+ *and their product is its determinant, which takes the test of mathfunction_cholesky_det_pinv().
+ *innov_v_small holds y_hat on entry and y-y_hat on success; the columns of ph_small are used as scratch.
+ *returns false, with P restored from ws->sequential_error_cov and eta untouched, when an f is not positive or the
+ *determinant is below that of the test, so that the joint update falls back to the pseudo-inverse*/
+static bool ekf_sequential_update(const gsl_vector *y_small, const gsl_matrix *H_small, const gsl_matrix *y_noise_cov_small,
+		gsl_vector *innov_v_small, gsl_matrix *ph_small, gsl_vector *eta, gsl_matrix *error_cov, EKFWorkspace *ws, double *neg_log_p){
+	size_t nx = eta->size, m = y_small->size, i, a, b;
+	double f, v, h_delta, x, log_det = 0;
+	gsl_vector *delta = ws->eta_delta;
+	
+	gsl_matrix_memcpy(ws->sequential_error_cov, error_cov);
+	gsl_vector_set_zero(delta);
+	*neg_log_p = 0;
+	for(i=0; i<m; i++){
+		gsl_vector_const_view h = gsl_matrix_const_row(H_small, i);
+		gsl_vector_view p = gsl_matrix_column(ph_small, i);
+		gsl_blas_dgemv(CblasNoTrans, 1.0, error_cov, &h.vector, 0.0, &p.vector);
+		gsl_blas_ddot(&h.vector, &p.vector, &f);
+		f += gsl_matrix_get(y_noise_cov_small, i, i);
+		if(!(f > 0)){
+			gsl_matrix_memcpy(error_cov, ws->sequential_error_cov);
+			return false;
+		}
+		log_det += log(f);
+		gsl_blas_ddot(&h.vector, delta, &h_delta);
+		v = gsl_vector_get(y_small, i) - gsl_vector_get(innov_v_small, i) - h_delta;
+		*neg_log_p += 0.5*(log(M_PI*2*f) + v*v/f);
+		gsl_blas_daxpy(v/f, &p.vector, delta);
+		for(a=0; a<nx; a++){
+			for(b=0; b<=a; b++){
+				x = gsl_matrix_get(error_cov, a, b) - gsl_vector_get(&p.vector, a)*gsl_vector_get(&p.vector, b)/f;
+				gsl_matrix_set(error_cov, a, b, x);
+				gsl_matrix_set(error_cov, b, a, x);
+			}
+		}
+	}
+	if(log_det < m*log(1e-6)){
+		gsl_matrix_memcpy(error_cov, ws->sequential_error_cov);
+		return false;
+	}
+	gsl_vector_sub(innov_v_small, y_small);
+	gsl_vector_scale(innov_v_small, -1);
+	gsl_vector_add(eta, delta);
+	return true;
+}
+
+/*whether the leading block of cache equals mat*/
+static bool ekf_same_block(const gsl_matrix *mat, const gsl_matrix *cache){
+	size_t i, j;
+	for(i=0; i<mat->size1; i++){
+		for(j=0; j<mat->size2; j++){
+			if(gsl_matrix_get(mat, i, j) != gsl_matrix_get(cache, i, j)){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*the measurement update in the latent dimension for m observed entries with m much larger than nx.
+ *With R=CC', W=C^{-1}H, P=LL' and M=I+L'W'WL, the Woodbury identity gives
+ *det(S)=det(R)det(M), v'S^{-1}v=|C^{-1}v|^2-|N^{-1}L'W'C^{-1}v|^2 with M=NN', and the filtered P=LM^{-1}L',
+ *whose product with W'C^{-1}v is the change of eta. C, W and W'W are kept in the workspace per regime of the noise
+ *covariance while R and H stay the same, so a step costs O(nx^3+m^2) instead of the O(m^3) of the innovation covariance.
+ *innov_v_small holds y_hat on entry and y-y_hat on success.
+ *returns false, with eta and P untouched, when R is not positive definite or S fails the test of mathfunction_cholesky_det_pinv()*/
+static bool ekf_collapsed_update(const gsl_vector *y_small, const gsl_matrix *H_small, const gsl_matrix *y_noise_cov_small,
+		gsl_vector *innov_v_small, gsl_vector *eta, gsl_matrix *error_cov, EKFWorkspace *ws, double *neg_log_p){
+	size_t nx = eta->size, m = y_small->size, i;
+	size_t slot = ws->noise_regime;
+	double log_det, zz, bb;
+	gsl_matrix_view noise = gsl_matrix_submatrix(ws->collapse_noise[slot], 0, 0, m, m);
+	gsl_matrix_view chol = gsl_matrix_submatrix(ws->collapse_chol[slot], 0, 0, m, m);
+	gsl_matrix_view loading = gsl_matrix_submatrix(ws->collapse_loading[slot], 0, 0, m, nx);
+	gsl_matrix_view w = gsl_matrix_submatrix(ws->collapse_w[slot], 0, 0, m, nx);
+	gsl_vector_view z = gsl_vector_subvector(ws->collapse_z, 0, m);
+	
+	if(ws->collapse_m[slot] != m || !ekf_same_block(y_noise_cov_small, &noise.matrix)){
+		ws->collapse_m[slot] = m;
+		ws->collapse_has_w[slot] = false;
+		gsl_matrix_memcpy(&noise.matrix, y_noise_cov_small);
+		ws->collapse_noise_pd[slot] = mathfunction_cholesky_psd(y_noise_cov_small, &chol.matrix) == m;
+		ws->collapse_log_det[slot] = 0;
+		for(i=0; i<m; i++){
+			ws->collapse_log_det[slot] += 2*log(gsl_matrix_get(&chol.matrix, i, i));
+		}
+	}
+	if(!ws->collapse_noise_pd[slot]){
+		return false;
+	}
+	if(!ws->collapse_has_w[slot] || !ekf_same_block(H_small, &loading.matrix)){
+		ws->collapse_has_w[slot] = true;
+		gsl_matrix_memcpy(&loading.matrix, H_small);
+		gsl_matrix_memcpy(&w.matrix, H_small);
+		gsl_blas_dtrsm(CblasLeft, CblasLower, CblasNoTrans, CblasNonUnit, 1.0, &chol.matrix, &w.matrix);
+		gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &w.matrix, &w.matrix, 0.0, ws->collapse_gram[slot]);
+	}
+	
+	/* M=I+L'W'WL and its factor N, in collapse_temp */
+	mathfunction_cholesky_psd(error_cov, ws->collapse_factor);
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, ws->collapse_gram[slot], ws->collapse_factor, 0.0, ws->collapse_temp);
+	gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, ws->collapse_factor, ws->collapse_temp, 0.0, ws->collapse_inner);
+	for(i=0; i<nx; i++){
+		gsl_matrix_set(ws->collapse_inner, i, i, gsl_matrix_get(ws->collapse_inner, i, i)+1.0);
+	}
+	mathfunction_cholesky_psd(ws->collapse_inner, ws->collapse_temp);
+	log_det = ws->collapse_log_det[slot];
+	for(i=0; i<nx; i++){
+		log_det += 2*log(gsl_matrix_get(ws->collapse_temp, i, i));
+	}
+	if(log_det < m*log(1e-6)){
+		return false;
+	}
+	
+	/* z=C^{-1}v, g=W'z and b=N^{-1}L'g */
+	gsl_vector_sub(innov_v_small, y_small);
+	gsl_vector_scale(innov_v_small, -1);
+	gsl_vector_memcpy(&z.vector, innov_v_small);
+	gsl_blas_dtrsv(CblasLower, CblasNoTrans, CblasNonUnit, &chol.matrix, &z.vector);
+	gsl_blas_ddot(&z.vector, &z.vector, &zz);
+	gsl_blas_dgemv(CblasTrans, 1.0, &w.matrix, &z.vector, 0.0, ws->collapse_g);
+	gsl_blas_dgemv(CblasTrans, 1.0, ws->collapse_factor, ws->collapse_g, 0.0, ws->collapse_b);
+	gsl_blas_dtrsv(CblasLower, CblasNoTrans, CblasNonUnit, ws->collapse_temp, ws->collapse_b);
+	gsl_blas_ddot(ws->collapse_b, ws->collapse_b, &bb);
+	*neg_log_p = (m/2.0)*log(M_PI*2) + log_det/2.0 + (zz-bb)/2.0;
+	
+	/* P=LN'^{-1}(LN'^{-1})' and eta+=Pg */
+	gsl_blas_dtrsm(CblasRight, CblasLower, CblasTrans, CblasNonUnit, 1.0, ws->collapse_temp, ws->collapse_factor);
+	gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, ws->collapse_factor, ws->collapse_factor, 0.0, error_cov);
+	gsl_blas_dgemv(CblasNoTrans, 1.0, error_cov, ws->collapse_g, 1.0, eta);
+	return true;
+}
+
+/*the upper triangle of src, with zeros below the diagonal*/
+static void ekf_upper_triangle(const gsl_matrix *src, gsl_matrix *dst){
+	size_t i, j;
+	for(i=0; i<dst->size1; i++){
+		for(j=0; j<dst->size2; j++){
+			gsl_matrix_set(dst, i, j, j >= i? gsl_matrix_get(src, i, j) : 0.0);
+		}
+	}
+}
+
+/*the predicted P=FPF'+Q as R'R, from the QR decomposition of [UF'; C'] with P=U'U and Q=CC';
+ *U is the factor carried from the previous step, or else taken from P; R is left in ws->sqrt_factor*/
+static void ekf_sqrt_predict(const gsl_matrix *transition, const gsl_matrix *error_cov, const gsl_matrix *factor, const gsl_matrix *noise_cov, EKFWorkspace *ws){
+	size_t nx = error_cov->size1;
+	gsl_matrix_view top = gsl_matrix_submatrix(ws->sqrt_time_array, 0, 0, nx, nx);
+	gsl_matrix_view bottom = gsl_matrix_submatrix(ws->sqrt_time_array, nx, 0, nx, nx);
+	if(factor != NULL){
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, factor, transition, 0.0, &top.matrix);
+	}else{
+		mathfunction_cholesky_psd(error_cov, ws->sqrt_factor);
+		gsl_blas_dgemm(CblasTrans, CblasTrans, 1.0, ws->sqrt_factor, transition, 0.0, &top.matrix);
+	}
+	mathfunction_cholesky_psd(noise_cov, ws->sqrt_eta_noise);
+	gsl_matrix_transpose_memcpy(&bottom.matrix, ws->sqrt_eta_noise);
+	gsl_linalg_QR_decomp(ws->sqrt_time_array, ws->sqrt_time_tau);
+	ekf_upper_triangle(&top.matrix, ws->sqrt_factor);
+}
+
+/*P=R'R from the factor in ws->sqrt_factor*/
+static void ekf_sqrt_form(gsl_matrix *error_cov, EKFWorkspace *ws){
+	gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, ws->sqrt_factor, ws->sqrt_factor, 0.0, error_cov);
+}
+
+/*the lower triangular factor of the predicted P kept for the smoother in ws->retain_chol, taken from ws->sqrt_factor
+ *after a square-root prediction; returns whether P is positive definite, to the tolerance of mathfunction_cholesky_psd()*/
+static bool ekf_retain_factor(const gsl_matrix *error_cov_pred, bool isSqrtPredict, EKFWorkspace *ws){
+	size_t nx = error_cov_pred->size1, i;
+	double d, tol = 0;
+	if(!isSqrtPredict){
+		return mathfunction_cholesky_psd(error_cov_pred, ws->retain_chol) == nx;
+	}
+	for(i=0; i<nx; i++){
+		tol = fmax(tol, fabs(gsl_matrix_get(error_cov_pred, i, i)));
+	}
+	tol *= nx*DBL_EPSILON;
+	gsl_matrix_transpose_memcpy(ws->retain_chol, ws->sqrt_factor);
+	for(i=0; i<nx; i++){
+		d = gsl_matrix_get(ws->retain_chol, i, i);
+		if(!(d*d > tol)){
+			return false;
+		}
+	}
+	return true;
+}
+
+/*the measurement update from the QR decomposition of [D' 0; RH' R], with the predicted P=R'R in ws->sqrt_factor
+ *and the measurement noise covariance of the observed entries DD'. The array becomes [L' G'; 0 U] with
+ *the innovation covariance LL', PH'=GL' and the filtered P=U'U, see ekf_sqrt_filtered(); the gain is GL^{-1}.
+ *returns the determinant of the innovation covariance, or 0 when it fails the test of mathfunction_cholesky_det_pinv()*/
+static double ekf_sqrt_update(const gsl_matrix *H_small, const gsl_matrix *y_noise_cov_small, gsl_matrix *chol_innov_cov, gsl_matrix *kalman_gain, EKFWorkspace *ws){
+	size_t nx = ws->sqrt_factor->size1, m = H_small->size1, i, j;
+	double det = 1;
+	gsl_matrix_view array = gsl_matrix_submatrix(ws->sqrt_meas_array, 0, 0, m+nx, m+nx);
+	gsl_vector_view tau = gsl_vector_subvector(ws->sqrt_meas_tau, 0, m+nx);
+	gsl_matrix_view sqrt_y_noise = gsl_matrix_submatrix(ws->sqrt_y_noise, 0, 0, m, m);
+	gsl_matrix_view block;
+	
+	gsl_matrix_set_zero(&array.matrix);
+	mathfunction_cholesky_psd(y_noise_cov_small, &sqrt_y_noise.matrix);
+	block = gsl_matrix_submatrix(&array.matrix, 0, 0, m, m);
+	gsl_matrix_transpose_memcpy(&block.matrix, &sqrt_y_noise.matrix);
+	block = gsl_matrix_submatrix(&array.matrix, m, 0, nx, m);
+	gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, ws->sqrt_factor, H_small, 0.0, &block.matrix);
+	block = gsl_matrix_submatrix(&array.matrix, m, m, nx, nx);
+	gsl_matrix_memcpy(&block.matrix, ws->sqrt_factor);
+	gsl_linalg_QR_decomp(&array.matrix, &tau.vector);
+	
+	/* the factors are taken with a positive diagonal */
+	for(i=0; i<m+nx; i++){
+		if(gsl_matrix_get(&array.matrix, i, i) < 0){
+			for(j=i; j<m+nx; j++){
+				gsl_matrix_set(&array.matrix, i, j, -gsl_matrix_get(&array.matrix, i, j));
+			}
+		}
+	}
+	
+	gsl_matrix_set_zero(chol_innov_cov);
+	for(i=0; i<m; i++){
+		for(j=0; j<=i; j++){
+			gsl_matrix_set(chol_innov_cov, i, j, gsl_matrix_get(&array.matrix, j, i));
+		}
+		det *= gsl_matrix_get(&array.matrix, i, i);
+	}
+	det *= det;
+	if(fabs(det) < pow(1e-6, m)){
+		return 0.0;
+	}
+	block = gsl_matrix_submatrix(&array.matrix, 0, m, m, nx);
+	gsl_matrix_transpose_memcpy(kalman_gain, &block.matrix);
+	gsl_blas_dtrsm(CblasRight, CblasLower, CblasNoTrans, CblasNonUnit, 1.0, chol_innov_cov, kalman_gain);
+	return det;
+}
+
+/*the filtered P=U'U left by ekf_sqrt_update()*/
+static void ekf_sqrt_filtered(size_t num_non_miss, gsl_matrix *error_cov, EKFWorkspace *ws){
+	size_t nx = ws->sqrt_factor->size1;
+	gsl_matrix_view block = gsl_matrix_submatrix(ws->sqrt_meas_array, num_non_miss, num_non_miss, nx, nx);
+	ekf_upper_triangle(&block.matrix, ws->sqrt_factor);
+	gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, ws->sqrt_factor, ws->sqrt_factor, 0.0, error_cov);
+}
+
+/*d eta/dt=f(eta) and dP/dt=F(eta)P+PF(eta)'+Q at the stage in ws->fused_eta and ws->fused_P;
+ *func_dF_dx finds eta after the parameters in ws->dpparams, which holds the parameters already*/
+static void ekf_fused_derivative(double tstart, size_t regime, const gsl_matrix *eta_noise_cov,
+		double *params, size_t num_func_param, const gsl_vector *co_variate,
+		void (*func_dx_dt)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),
+		void (*func_dF_dx)(double, size_t, double *, const gsl_vector *, gsl_matrix *),
+		EKFWorkspace *ws){
+	size_t i, nx = ws->fused_eta->size;
+	for(i=0; i<nx; i++){
+		ws->dpparams[num_func_param+i] = gsl_vector_get(ws->fused_eta, i);
+	}
+	func_dx_dt(tstart, regime, ws->fused_eta, params, num_func_param, co_variate, ws->fused_d_eta);
+	func_dF_dx(tstart, regime, ws->dpparams, co_variate, ws->jacob_dynam);
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, ws->jacob_dynam, ws->fused_P, 0.0, ws->p_jacob_dynam);
+	gsl_matrix_transpose_memcpy(ws->fused_d_P, ws->p_jacob_dynam);
+	gsl_matrix_add(ws->fused_d_P, ws->p_jacob_dynam);
+	gsl_matrix_add(ws->fused_d_P, eta_noise_cov);
+}
+
+/*one RK4 step of [eta, P] together, so that the Jacobian in the P equation follows the eta trajectory;
+ *like rk4_odesolver(), all stages are evaluated at tstart*/
+static void ekf_fused_rk4(double tstart, double tend, size_t regime,
+		const gsl_vector *eta_t, const gsl_matrix *error_cov_t, const gsl_matrix *eta_noise_cov,
+		double *params, size_t num_func_param, const gsl_vector *co_variate,
+		void (*func_dx_dt)(double, size_t, const gsl_vector *, double *, size_t, const gsl_vector *, gsl_vector *),
+		void (*func_dF_dx)(double, size_t, double *, const gsl_vector *, gsl_matrix *),
+		gsl_vector *eta_t_plus_1, gsl_matrix *error_cov_t_plus_1, EKFWorkspace *ws){
+	static const double weight[4] = {1.0/6, 1.0/3, 1.0/3, 1.0/6};
+	static const double node[3] = {0.5, 0.5, 1.0};
+	double delta = tend-tstart;
+	size_t i, stage;
+	
+	for(i=0; i<num_func_param; i++){
+		ws->dpparams[i] = params[i];
+	}
+	gsl_vector_memcpy(eta_t_plus_1, eta_t);
+	gsl_matrix_memcpy(error_cov_t_plus_1, error_cov_t);
+	gsl_vector_memcpy(ws->fused_eta, eta_t);
+	gsl_matrix_memcpy(ws->fused_P, error_cov_t);
+	for(stage=0; stage<4; stage++){
+		ekf_fused_derivative(tstart, regime, eta_noise_cov, params, num_func_param, co_variate, func_dx_dt, func_dF_dx, ws);
+		gsl_blas_daxpy(delta*weight[stage], ws->fused_d_eta, eta_t_plus_1);
+		ekf_matrix_axpy(delta*weight[stage], ws->fused_d_P, error_cov_t_plus_1);
+		if(stage<3){
+			gsl_vector_memcpy(ws->fused_eta, eta_t);
+			gsl_blas_daxpy(delta*node[stage], ws->fused_d_eta, ws->fused_eta);
+			gsl_matrix_memcpy(ws->fused_P, error_cov_t);
+			ekf_matrix_axpy(delta*node[stage], ws->fused_d_P, ws->fused_P);
+		}
+	}
+}
 
 
 /******************************************************************************
@@ -55,6 +396,8 @@
 * error_cov_t_plus_1 -- a vector of the elements in the filtered error covariance matrix at time t: P_t[1,1],P_t[2,2],P_t[3,3],P_t[1,2],P_t[1,3],P_t[2,3]
 * innov_v-- innovation vector
 * innov_cov-- innovation covariance matrix
+* miss_pattern -- missing-data patterns of the data, or NULL
+* ws -- scratch space from ekf_workspace_alloc()
 * *
 * Output*
 * *
@@ -95,7 +438,9 @@ double ext_kalmanfilter(size_t t,
 		gsl_matrix *innov_cov,
 		bool isFirstTime,
 		bool isForReturn,
-		bool perturb, gsl_rng *seed){
+		bool perturb, gsl_rng *seed,
+		const MissPattern *miss_pattern,
+		EKFWorkspace *ws){
 	// N.B. eta_pred, error_cov_pred, innov_cov, innov_v, eta_t_plus_1, error_cov_t_plus_1 all must set set and passed back when used for final return
 	
 	int DEBUG_EKF = 0; /*0=false/no; 1=true/yes*/
@@ -108,26 +453,133 @@ double ext_kalmanfilter(size_t t,
 	
 	size_t i,j;
 	
+	/* the matrices of a linear model replace func_dynam, func_jacob_dynam and func_measure */
+	const LinearModel *linear = ws->linear;
+	bool isLinearDynam = linear != NULL && linear->transition != NULL;
+	bool isLinearMeasure = linear != NULL && linear->loading != NULL;
+	
+	/* linear continuous-time dynamics are discretized exactly when the interval is in ws->disc */
+	size_t dt_index = 0;
+	bool isExact = false;
+	if(!isFirstTime && ws->disc != NULL){
+		dt_index = exact_discretization_find(ws->disc, y_time[t]-y_time[t-1]);
+		isExact = dt_index < ws->disc->num_dt;
+	}
+	
 	
 	/** handling missing data **/
-	gsl_vector *y_non_miss_index = gsl_vector_alloc(y_t_plus_1->size);
-	size_t num_non_miss = find_miss_data(y_t_plus_1, y_non_miss_index);
-	gsl_vector *y_small = gsl_vector_alloc(num_non_miss);
-	filter_vector(y_t_plus_1, y_non_miss_index, y_small);
-	gsl_vector *innov_v_small = gsl_vector_alloc(num_non_miss);
+	/* The observed entries come from the pattern of row t when available, otherwise y is scanned for NA */
+	const size_t *obs_index;
+	size_t num_non_miss;
+	if(miss_pattern != NULL){
+		size_t pattern = miss_pattern->pattern_of_row[t];
+		obs_index = miss_pattern->obs_index + miss_pattern->obs_offset[pattern];
+		num_non_miss = miss_pattern->obs_offset[pattern+1] - miss_pattern->obs_offset[pattern];
+	}else{
+		num_non_miss = find_obs_index(y_t_plus_1, ws->obs_index);
+		obs_index = ws->obs_index;
+	}
+	/* The reduced (non-missing) objects are views into the workspace, which is sized for the full data */
+	gsl_vector_view y_small_view, innov_v_small_view, inv_innov_cov_v_small_view;
+	gsl_matrix_view H_small_view, ph_small_view, innov_cov_small_view, y_noise_cov_small_view, kalman_gain_view, inv_innov_cov_small_view, chol_innov_cov_small_view;
+	gsl_vector *y_small = NULL;
+	gsl_vector *innov_v_small = NULL;
+	gsl_vector *inv_innov_cov_v_small = NULL;
+	gsl_matrix *H_small = NULL;
+	gsl_matrix *ph_small = NULL; /* P*H' - error_cov*jacob'*/
+	gsl_matrix *innov_cov_small = NULL;
+	gsl_matrix *y_noise_cov_small = NULL;
+	gsl_matrix *kalman_gain = NULL;
+	gsl_matrix *inv_innov_cov_small = NULL;
+	gsl_matrix *chol_innov_cov_small = NULL;
+	if(num_non_miss > 0){
+		y_small_view = gsl_vector_subvector(ws->y_small, 0, num_non_miss);
+		y_small = &y_small_view.vector;
+		innov_v_small_view = gsl_vector_subvector(ws->innov_v_small, 0, num_non_miss);
+		innov_v_small = &innov_v_small_view.vector;
+		inv_innov_cov_v_small_view = gsl_vector_subvector(ws->inv_innov_cov_v_small, 0, num_non_miss);
+		inv_innov_cov_v_small = &inv_innov_cov_v_small_view.vector;
+		H_small_view = gsl_matrix_submatrix(ws->H_small, 0, 0, num_non_miss, nx);
+		H_small = &H_small_view.matrix;
+		innov_cov_small_view = gsl_matrix_submatrix(ws->innov_cov_small, 0, 0, num_non_miss, num_non_miss);
+		innov_cov_small = &innov_cov_small_view.matrix;
+		y_noise_cov_small_view = gsl_matrix_submatrix(ws->y_noise_cov_small, 0, 0, num_non_miss, num_non_miss);
+		y_noise_cov_small = &y_noise_cov_small_view.matrix;
+		inv_innov_cov_small_view = gsl_matrix_submatrix(ws->inv_innov_cov_small, 0, 0, num_non_miss, num_non_miss);
+		inv_innov_cov_small = &inv_innov_cov_small_view.matrix;
+		chol_innov_cov_small_view = gsl_matrix_submatrix(ws->chol_innov_cov_small, 0, 0, num_non_miss, num_non_miss);
+		chol_innov_cov_small = &chol_innov_cov_small_view.matrix;
+		ph_small_view = gsl_matrix_submatrix(ws->ph_small, 0, 0, nx, num_non_miss);
+		ph_small = &ph_small_view.matrix;
+		kalman_gain_view = gsl_matrix_submatrix(ws->kalman_gain, 0, 0, nx, num_non_miss);
+		kalman_gain = &kalman_gain_view.matrix;
+		
+		gather_vector(y_t_plus_1, obs_index, y_small);
+		gather_matrix_rows_cols(y_noise_cov, obs_index, y_noise_cov_small);
+	}
+	gsl_matrix *H_t_plus_1 = ws->H_t_plus_1;
+	gsl_matrix *ph = ws->ph; /* P*H' - error_cov*jacob'*/
 	
-	/* Allocate matrix pointers */
-	gsl_matrix *H_t_plus_1=gsl_matrix_calloc(y_t_plus_1->size, nx);
-	gsl_matrix *H_small=gsl_matrix_calloc(num_non_miss, nx);
-	gsl_matrix *ph_small=gsl_matrix_calloc(eta_t->size, num_non_miss); /* P*H' - error_cov*jacob'*/
-	gsl_matrix *ph=gsl_matrix_calloc(eta_t->size, y_t_plus_1->size); /* P*H' - error_cov*jacob'*/
-	gsl_matrix *innov_cov_small=gsl_matrix_calloc(num_non_miss, num_non_miss);
-	gsl_matrix *y_noise_cov_small=gsl_matrix_calloc(num_non_miss, num_non_miss);
-	gsl_matrix *kalman_gain=gsl_matrix_calloc(eta_t->size, num_non_miss);
-	gsl_matrix *inv_innov_cov_small=gsl_matrix_calloc(num_non_miss, num_non_miss);
+	/* a subject with the same design as a recorded one replays its covariance side, see EKFTrack */
+	EKFTrack *track = ws->track;
+	bool isReplay = track != NULL && ws->track_replay;
+	bool isRecord = track != NULL && !ws->track_replay;
 	
-	filter_matrix_rows_cols(y_noise_cov, y_non_miss_index, y_noise_cov_small);
+	/* a converged time-invariant covariance recursion is not repeated, see ekf_workspace_allow_steady_state();
+	 * the first time point, a missing value or another interval ends the steady state */
+	bool isRegular = false;
+	if(ws->steady_allowed && !isReplay){
+		isRegular = !isFirstTime && num_non_miss == y_t_plus_1->size && (ws->disc == NULL || isExact);
+		if(!isRegular || dt_index != ws->steady_dt_index){
+			ws->steady = false;
+			ws->steady_count = 0;
+			ws->steady_dt_index = dt_index;
+		}
+	}
+	bool isSteady = !isReplay && ws->steady;
 	
+	/* the covariance side that is not computed, when frozen or replayed */
+	bool isFixed = isSteady || isReplay;
+	double fixed_det = 0;
+	gsl_matrix *fixed_error_cov_pred = NULL, *fixed_error_cov = NULL, *fixed_kalman_gain = NULL, *fixed_chol_innov_cov = NULL;
+	if(isReplay){
+		fixed_det = track->det[ws->track_step];
+		fixed_error_cov_pred = track->error_cov_pred[ws->track_step];
+		fixed_error_cov = track->error_cov[ws->track_step];
+		fixed_kalman_gain = track->kalman_gain[ws->track_step];
+		fixed_chol_innov_cov = track->chol_innov_cov[ws->track_step];
+	} else if(isSteady){
+		fixed_det = ws->steady_det;
+		fixed_error_cov_pred = ws->steady_error_cov_pred;
+		fixed_error_cov = ws->steady_error_cov;
+		fixed_kalman_gain = ws->steady_kalman_gain;
+		fixed_chol_innov_cov = ws->steady_chol_innov_cov;
+	}
+	
+	/* the prediction of an earlier regime with the same dynamics, see EKFWorkspace::pred_eta */
+	bool isPredReplay = ws->pred_share && ws->pred_replay;
+	
+	/* Cholesky factors updated by QR decompositions, see ParamConfig::square_root; also the prediction where it is algebraic */
+	bool isSqrt = ws->sqrt_factor != NULL && !isFixed;
+	bool isSqrtPredict = isSqrt && !isFirstTime && !isPredReplay && (isExact || !isContinuousTime);
+	bool isSqrtUpdate = false;
+	/* the factor of error_cov_t carried from the previous step, or NULL, see EKFWorkspace::sqrt_regime;
+	 * whether ws->sqrt_factor holds the factor of the predicted P, and whether that P is formed */
+	bool isCarry = ws->sqrt_carry && ws->sqrt_regime != NULL;
+	const gsl_matrix *sqrt_prior = isSqrtPredict && isCarry && ws->sqrt_regime_valid[ws->sqrt_from]? ws->sqrt_regime[ws->sqrt_from] : NULL;
+	bool hasSqrtPred = isSqrtPredict;
+	bool isPredFormed = true;
+
+	/* combinations that the callers never set up, see the modes before ext_kalmanfilter() in ekf.h */
+	assert(track == NULL || (!isForReturn && !ws->pred_share && ws->track_step < track->num_step));
+	assert(!ws->steady || ws->steady_allowed);
+	assert(!ws->steady_allowed || !ws->pred_share);
+	assert(!isPredReplay || ws->pred_slot < regime);
+	assert(ws->retain_chol == NULL || isForReturn);
+	assert(!ws->fused || (isContinuousTime && ws->ode_eta == NULL));
+	assert(ws->disc == NULL || isContinuousTime);
+	assert(!isSqrt || !isFixed);
+
 	
 	/*------------------------------------------------------*\
 	* update xk *
@@ -148,14 +600,21 @@ double ext_kalmanfilter(size_t t,
 	
 	// dynamic noise = eta_noise_cov
 	// updated/filtered cov = error_cov_t
-	if(isFirstTime){
+	if(isPredReplay){
+		gsl_vector_memcpy(eta_t_plus_1, ws->pred_eta[ws->pred_slot]);
+	} else if(isFirstTime){
 		gsl_vector_memcpy(eta_t_plus_1,eta_t);
+		/*the step sizes carried over by the adaptive solver start afresh for each subject*/
+		if(ws->ode_eta != NULL){
+			memset(ws->ode_step, 0, 2*ws->sqrt_num_regime*ws->sqrt_num_regime*sizeof(double));
+		}
 	} else{
 		if(perturb){
 			// Optionally perturb state here
 			// Add multivariate Gaussian noise to eta_t with mean 0 and covariance eta_noise_cov
 			gsl_vector* rout = gsl_vector_calloc(nx);
 			gsl_matrix* eta_noise_cov_chol = gsl_matrix_calloc(nx, nx);
+			ws->num_alloc += 2;
 			gsl_matrix_memcpy(eta_noise_cov_chol, eta_noise_cov); //Uses updated/filtered latent state covariance
 			gsl_linalg_cholesky_decomp(eta_noise_cov_chol);
 			for(size_t gi=0; gi < nx; gi++){
@@ -179,7 +638,27 @@ double ext_kalmanfilter(size_t t,
 			gsl_matrix_free(eta_noise_cov_chol);
 			gsl_vector_free(rout);
 		}
-		func_dynam(y_time[t-1], y_time[t], regime, eta_t, params, num_func_param, co_variate, func_dx_dt, eta_t_plus_1); /** y_time - observed time**/
+		if(isExact){
+			func_dx_dt(y_time[t-1], regime, ws->disc_zero, params, num_func_param, co_variate, ws->disc_intercept);
+			gsl_blas_dgemv(CblasNoTrans, 1.0, ws->disc->transition[dt_index][regime], eta_t, 0.0, eta_t_plus_1);
+			gsl_blas_dgemv(CblasNoTrans, 1.0, ws->disc->input[dt_index][regime], ws->disc_intercept, 1.0, eta_t_plus_1);
+		} else if(isLinearDynam){
+			gsl_blas_dgemv(CblasNoTrans, 1.0, linear->transition[regime], eta_t, 0.0, eta_t_plus_1);
+			if(linear->dynam_exo != NULL){
+				gsl_blas_dgemv(CblasNoTrans, 1.0, linear->dynam_exo[regime], co_variate, 1.0, eta_t_plus_1);
+			}
+			gsl_vector_add(eta_t_plus_1, linear->dynam_intercept[regime]);
+		} else if(ws->fused){
+			ekf_fused_rk4(y_time[t-1], y_time[t], regime, eta_t, error_cov_t, eta_noise_cov, params, num_func_param, co_variate,
+				func_dx_dt, func_dF_dx, eta_t_plus_1, error_cov_t_plus_1, ws);
+		} else if(ws->ode_eta != NULL){
+			/*each pair carries its own step size, since the regimes of a pair set how fast its solution changes*/
+			ws->ode_eta->step = ws->ode_step[2*(ws->sqrt_from*ws->sqrt_num_regime+regime)];
+			ode_dopri_solve(ws->ode_eta, y_time[t-1], y_time[t], regime, eta_t, params, num_func_param, co_variate, func_dx_dt, eta_t_plus_1);
+			ws->ode_step[2*(ws->sqrt_from*ws->sqrt_num_regime+regime)] = ws->ode_eta->step;
+		} else {
+			func_dynam(y_time[t-1], y_time[t], regime, eta_t, params, num_func_param, co_variate, func_dx_dt, eta_t_plus_1); /** y_time - observed time**/
+		}
 		if(DEBUG_EKF){
 			MYPRINT("Dynamically forecast ahead latent state:\n");
 			print_vector(eta_t_plus_1);
@@ -195,10 +674,31 @@ double ext_kalmanfilter(size_t t,
 	/*------------------------------------------------------*\
 	* update P *
 	\*------------------------------------------------------*/
-	if (!isFirstTime & isContinuousTime){
+	if (isFixed){
+		gsl_matrix_memcpy(error_cov_t_plus_1, fixed_error_cov_pred);
+	} else if (isPredReplay){
+		gsl_matrix_memcpy(error_cov_t_plus_1, ws->pred_error_cov[ws->pred_slot]);
+		if(isSqrt && ws->sqrt_pred != NULL && ws->sqrt_pred_valid[ws->pred_slot]){
+			gsl_matrix_memcpy(ws->sqrt_factor, ws->sqrt_pred[ws->pred_slot]);
+			hasSqrtPred = true;
+		}
+	} else if (isSqrtPredict && isExact){
+		ekf_sqrt_predict(ws->disc->transition[dt_index][regime], error_cov_t, sqrt_prior, ws->disc->noise[dt_index][ws->noise_regime][regime], ws);
+	} else if (isExact){
+		
+		/*error_cov_t_plus_1=Phi%*%error_cov_t%*%t(Phi)+Q(dt)*/
+		const gsl_matrix *transition = ws->disc->transition[dt_index][regime];
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, transition, error_cov_t, 0.0, ws->p_jacob_dynam);
+		gsl_matrix_memcpy(error_cov_t_plus_1, ws->disc->noise[dt_index][ws->noise_regime][regime]);
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, ws->p_jacob_dynam, transition, 1.0, error_cov_t_plus_1);
 		
-		gsl_vector *Pnewvec = gsl_vector_calloc(nx*(nx+1)/2);
-		gsl_vector *error_cov_t_vec = gsl_vector_calloc(nx*(nx+1)/2);
+	} else if (!isFirstTime && ws->fused){
+		/* error_cov_t_plus_1 was advanced together with eta_t_plus_1 */
+	} else if (!isFirstTime & isContinuousTime){
+		
+		gsl_vector *Pnewvec = ws->Pnewvec;
+		gsl_vector *error_cov_t_vec = ws->error_cov_t_vec;
+		gsl_vector_set_zero(Pnewvec);
 		
 		/*------------------------------------------------------*\
 		* update P *
@@ -212,7 +712,7 @@ double ext_kalmanfilter(size_t t,
 		
 		/*dpparams include params, eta_t, and eta_noise_cov_vec*/
 		size_t n_dpparams=num_func_param+nx+(nx+1)*nx/2;
-		double dpparams[n_dpparams];
+		double *dpparams=ws->dpparams;
 		for (i=0; i<num_func_param; i++)
 			dpparams[i]=params[i];
 		for (i=0; i<nx; i++)
@@ -239,7 +739,13 @@ double ext_kalmanfilter(size_t t,
 		}
 		
 		
-		func_dynam(y_time[t-1], y_time[t], regime, error_cov_t_vec, dpparams, n_dpparams, co_variate, func_dP_dt, Pnewvec);
+		if(ws->ode_P != NULL){
+			ws->ode_P->step = ws->ode_step[2*(ws->sqrt_from*ws->sqrt_num_regime+regime)+1];
+			ode_dopri_solve(ws->ode_P, y_time[t-1], y_time[t], regime, error_cov_t_vec, dpparams, n_dpparams, co_variate, func_dP_dt, Pnewvec);
+			ws->ode_step[2*(ws->sqrt_from*ws->sqrt_num_regime+regime)+1] = ws->ode_P->step;
+		} else {
+			func_dynam(y_time[t-1], y_time[t], regime, error_cov_t_vec, dpparams, n_dpparams, co_variate, func_dP_dt, Pnewvec);
+		}
 		
 		
 		for(i=0; i<nx; i++){
@@ -251,33 +757,75 @@ double ext_kalmanfilter(size_t t,
 		}
 		
 		
-		gsl_vector_free(error_cov_t_vec);
-		gsl_vector_free(Pnewvec);
-		
 	} else if(!isFirstTime & !isContinuousTime) { /* end continuous time "Update P" calculation */
 		
 		/*Update P for discrete time*/
-		gsl_matrix *jacob_dynam = gsl_matrix_calloc(nx,nx);
-		gsl_matrix *p_jacob_dynam = gsl_matrix_calloc(nx, nx);
+		gsl_matrix *jacob_dynam = ws->jacob_dynam;
+		gsl_matrix *p_jacob_dynam = ws->p_jacob_dynam;
+		gsl_matrix_set_zero(jacob_dynam);
 		/*------------------------------------------------------*\
 		* Update P discrete--------error_cov_t_plus_1=eta_noise_cov+jacobdynamic%*%error_cov_t%*%t(jacobdynamic)*
 		\*------------------------------------------------------*/
 		// error_cov_t_plus_1 = Predicted P for latent variables
 		
-		func_jacob_dynam(y_time[t-1], y_time[t], regime, eta_t, params, num_func_param, co_variate, func_dF_dx, jacob_dynam);
-		/* compute P*jacobdynamic' */
-		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, error_cov_t, jacob_dynam, 0.0, p_jacob_dynam);
-		/* compute jacobdynamic*P*jacobdynamic' */
-		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, jacob_dynam, p_jacob_dynam, 0.0, error_cov_t_plus_1);
-		/* compute H*P*H'+Q */
-		gsl_matrix_add(error_cov_t_plus_1, eta_noise_cov);
-		
-		gsl_matrix_free(jacob_dynam);
-		gsl_matrix_free(p_jacob_dynam);
+		if(isLinearDynam){
+			gsl_matrix_memcpy(jacob_dynam, linear->transition[regime]);
+		}else{
+			func_jacob_dynam(y_time[t-1], y_time[t], regime, eta_t, params, num_func_param, co_variate, func_dF_dx, jacob_dynam);
+		}
+		if(isSqrtPredict){
+			ekf_sqrt_predict(jacob_dynam, error_cov_t, sqrt_prior, eta_noise_cov, ws);
+		}else{
+			/* compute P*jacobdynamic' */
+			gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, error_cov_t, jacob_dynam, 0.0, p_jacob_dynam);
+			/* compute jacobdynamic*P*jacobdynamic' */
+			gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, jacob_dynam, p_jacob_dynam, 0.0, error_cov_t_plus_1);
+			/* compute H*P*H'+Q */
+			gsl_matrix_add(error_cov_t_plus_1, eta_noise_cov);
+		}
 	} else if(isFirstTime){
 		gsl_matrix_memcpy(error_cov_t_plus_1, error_cov_t);
 	}
 	/* End "Update P" */
+	if(isSqrtPredict){
+		/* a square-root update that carries its factor reads the predicted P only when it falls back to the pseudo-inverse */
+		isPredFormed = !(isCarry && num_non_miss > 0 && !isRecord && !isRegular && !isForReturn && ws->retain_chol == NULL && !ws->pred_share);
+		if(isPredFormed){
+			ekf_sqrt_form(error_cov_t_plus_1, ws);
+		}
+	}
+	if(isRecord){
+		gsl_matrix_memcpy(track->error_cov_pred[ws->track_step], error_cov_t_plus_1);
+	}
+	ws->retain_has_jacob = false;
+	ws->retain_has_chol = false;
+	if(ws->retain_chol != NULL && !isFirstTime && !isPredReplay){
+		if(ws->retain_jacob != NULL){
+			if(isExact){
+				gsl_matrix_memcpy(ws->retain_jacob, ws->disc->transition[dt_index][regime]);
+				ws->retain_has_jacob = true;
+			} else if(!isContinuousTime && isFixed){
+				if(isLinearDynam){
+					gsl_matrix_memcpy(ws->retain_jacob, linear->transition[regime]);
+					ws->retain_has_jacob = true;
+				}
+			} else if(!isContinuousTime){
+				gsl_matrix_memcpy(ws->retain_jacob, ws->jacob_dynam);
+				ws->retain_has_jacob = true;
+			}
+		}
+		ws->retain_has_chol = ekf_retain_factor(error_cov_t_plus_1, isSqrtPredict, ws);
+	}
+	if(ws->pred_share && !ws->pred_replay){
+		gsl_vector_memcpy(ws->pred_eta[ws->pred_slot], eta_t_plus_1);
+		gsl_matrix_memcpy(ws->pred_error_cov[ws->pred_slot], error_cov_t_plus_1);
+		if(ws->sqrt_pred != NULL){
+			ws->sqrt_pred_valid[ws->pred_slot] = hasSqrtPred;
+			if(hasSqrtPred){
+				gsl_matrix_memcpy(ws->sqrt_pred[ws->pred_slot], ws->sqrt_factor);
+			}
+		}
+	}
 	
 	// copy error_cov_pred for storeage and return when running for return (i.e. "smoothing")
 	if(isForReturn){
@@ -301,18 +849,45 @@ double ext_kalmanfilter(size_t t,
 	if(DEBUG_EKF){
 		MYPRINT("About to call measurement function\n");
 	}
-	func_measure(t, regime, params, eta_t_plus_1, co_variate, H_t_plus_1, innov_v);
+	if(isLinearMeasure){
+		gsl_matrix_memcpy(H_t_plus_1, linear->loading[regime]);
+		gsl_blas_dgemv(CblasNoTrans, 1.0, H_t_plus_1, eta_t_plus_1, 0.0, innov_v);
+		if(linear->measure_exo != NULL){
+			gsl_blas_dgemv(CblasNoTrans, 1.0, linear->measure_exo[regime], co_variate, 1.0, innov_v);
+		}
+		gsl_vector_add(innov_v, linear->measure_intercept[regime]);
+	}else{
+		gsl_matrix_set_zero(H_t_plus_1);
+		func_measure(t, regime, params, eta_t_plus_1, co_variate, H_t_plus_1, innov_v);
+	}
 	if(DEBUG_EKF){
 		MYPRINT("y_hat(%d):", t);
 		print_vector(innov_v);
 		MYPRINT("\n");
 	}
-	filter_matrix_rows(H_t_plus_1, y_non_miss_index, H_small);
-	filter_vector(innov_v, y_non_miss_index, innov_v_small);
+	if(num_non_miss > 0){
+		gather_matrix_rows(H_t_plus_1, obs_index, H_small);
+		gather_vector(innov_v, obs_index, innov_v_small);
+	}
 	if(DEBUG_EKF){
 		MYPRINT("Just filtered measurement for missing data\n");
 	}
 	
+	/* with ParamConfig::sequential_update, a diagonal R is processed one observed entry at a time, and with
+	 * ParamConfig::collapsed_update, many observed entries in the latent dimension, without forming the innovation covariance;
+	 * not where the gain or the factor of the innovation covariance is kept. Either falls back to the joint update below */
+	if(num_non_miss > 0 && !isFixed && !isSqrt && !isRecord && !isRegular && !isForReturn){
+		double collapsed_neg_log_p;
+		if(ws->sequential_error_cov != NULL && ekf_is_diagonal(y_noise_cov_small)
+				&& ekf_sequential_update(y_small, H_small, y_noise_cov_small, innov_v_small, ph_small, eta_t_plus_1, error_cov_t_plus_1, ws, &collapsed_neg_log_p)){
+			return collapsed_neg_log_p;
+		}
+		if(ws->collapse_noise != NULL && num_non_miss > EKF_COLLAPSE_RATIO*nx
+				&& ekf_collapsed_update(y_small, H_small, y_noise_cov_small, innov_v_small, eta_t_plus_1, error_cov_t_plus_1, ws, &collapsed_neg_log_p)){
+			return collapsed_neg_log_p;
+		}
+	}
+	
 	
 	/*------------------------------------------------------*\
 	// Predicted Covariance matrix for observed variables
@@ -321,7 +896,25 @@ double ext_kalmanfilter(size_t t,
 	if(DEBUG_EKF){
 		MYPRINT("Gonna multiply me some P and H\n");
 	}
-	if(num_non_miss > 0){
+	if(num_non_miss > 0 && isSqrt){
+		if(!hasSqrtPred){
+			mathfunction_cholesky_psd(error_cov_t_plus_1, ws->sqrt_eta_noise);
+			gsl_matrix_transpose_memcpy(ws->sqrt_factor, ws->sqrt_eta_noise);
+		}
+		det = ekf_sqrt_update(H_small, y_noise_cov_small, chol_innov_cov_small, kalman_gain, ws);
+		/* a nearly singular innovation covariance goes through the pseudo-inverse below */
+		isSqrtUpdate = det != 0.0;
+		if(!isSqrtUpdate && !isPredFormed){
+			ekf_sqrt_form(error_cov_t_plus_1, ws);
+		}
+		if(isSqrtUpdate && isRegular){
+			gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, chol_innov_cov_small, chol_innov_cov_small, 0.0, innov_cov_small);
+		}
+		if(isSqrtUpdate && isForReturn){
+			gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, error_cov_t_plus_1, H_small, 0.0, ph_small);
+		}
+	}
+	if(num_non_miss > 0 && !isFixed && !isSqrtUpdate){
 		/* compute P*H' */
 		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, error_cov_t_plus_1, H_small, 0.0, ph_small);
 		/* compute H*P*H' */
@@ -350,7 +943,9 @@ double ext_kalmanfilter(size_t t,
 			MYPRINT("\n");
 		}
 	}
-	if(isForReturn){
+	if(isForReturn && isSteady){
+		gsl_matrix_memcpy(innov_cov, ws->steady_innov_cov);
+	} else if(isForReturn){
 		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, error_cov_t_plus_1, H_t_plus_1, 0.0, ph);
 		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, H_t_plus_1, ph, 0.0, innov_cov);
 		gsl_matrix_add(innov_cov, y_noise_cov);
@@ -367,23 +962,46 @@ double ext_kalmanfilter(size_t t,
 	if(DEBUG_EKF){
 		MYPRINT("Looking to Kalman for some GAINZ\n");
 	}
-	if(num_non_miss > 0){
-		det = mathfunction_inv_matrix_det(innov_cov_small, inv_innov_cov_small);
-		/* compute P*H*S^{-1} */
-		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, ph_small, inv_innov_cov_small, 0.0, kalman_gain);
+	/* count the regular steps over which the predicted P and the innovation covariance stayed put */
+	if(isRegular && !isSteady){
+		bool isConverged = ws->steady_count > 0 && ekf_steady_close(error_cov_t_plus_1, ws->steady_error_cov_pred)
+			&& ekf_steady_close(innov_cov_small, ws->steady_innov_cov);
+		ws->steady_count = isConverged? ws->steady_count+1 : 1;
+		gsl_matrix_memcpy(ws->steady_error_cov_pred, error_cov_t_plus_1);
+		gsl_matrix_memcpy(ws->steady_innov_cov, innov_cov_small);
+	}
+	
+	if(num_non_miss > 0 && isFixed){
+		det = fixed_det;
+		kalman_gain_view = gsl_matrix_submatrix(fixed_kalman_gain, 0, 0, nx, num_non_miss);
+		kalman_gain = &kalman_gain_view.matrix;
+		chol_innov_cov_small_view = gsl_matrix_submatrix(fixed_chol_innov_cov, 0, 0, num_non_miss, num_non_miss);
+		chol_innov_cov_small = &chol_innov_cov_small_view.matrix;
+	} else if(isSqrtUpdate){
+		/* the gain and the factor come from ekf_sqrt_update() */
+	} else if(num_non_miss > 0){
+		/* the gain and the likelihood use triangular solves with the Cholesky factor S=LL' */
+		det = mathfunction_cholesky_det_pinv(innov_cov_small, chol_innov_cov_small);
+		if(det == 0.0){
+			/* the pseudo-inverse fallback allocates its own SVD scratch */
+			ws->num_pinv++;
+			ws->num_alloc += MATHFUNCTION_PINV_NUM_ALLOC;
+			/* compute P*H*S^{+} */
+			gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, ph_small, chol_innov_cov_small, 0.0, kalman_gain);
+		}else{
+			/* compute P*H*S^{-1} = P*H*L'^{-1}*L^{-1} */
+			gsl_matrix_memcpy(kalman_gain, ph_small);
+			gsl_blas_dtrsm(CblasRight, CblasLower, CblasTrans, CblasNonUnit, 1.0, chol_innov_cov_small, kalman_gain);
+			gsl_blas_dtrsm(CblasRight, CblasLower, CblasNoTrans, CblasNonUnit, 1.0, chol_innov_cov_small, kalman_gain);
+		}
 		
 		
-		if(DEBUG_EKF){
-			MYPRINT("inv_innov_cov filtered:\n");
-			print_matrix(inv_innov_cov_small);
-			MYPRINT("\n");
-		}
 		if(DEBUG_EKF){
 			MYPRINT("ph:\n");
 			print_matrix(ph_small);
 			MYPRINT("\n");
-			MYPRINT("inverse residu:\n");
-			print_matrix(inv_innov_cov_small);
+			MYPRINT("Cholesky factor of the residual cov:\n");
+			print_matrix(chol_innov_cov_small);
 			MYPRINT("\n");
 			MYPRINT("kalman_gain:\n");
 			print_matrix(kalman_gain);
@@ -426,7 +1044,11 @@ double ext_kalmanfilter(size_t t,
 	/* P_kplus1 = Pnew - Kk%*%H_t_plus_1%*%Pnew */
 	
 	
-	if(num_non_miss > 0){
+	if(isFixed){
+		gsl_matrix_memcpy(error_cov_t_plus_1, fixed_error_cov);
+	} else if(isSqrtUpdate){
+		ekf_sqrt_filtered(num_non_miss, error_cov_t_plus_1, ws);
+	} else if(num_non_miss > 0){
 		/* W*S*W'- P = P*H'*W'- P = Pnew*H_t_plus_1'*Kk' - Pnew */
 		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, ph_small, kalman_gain, -1.0, error_cov_t_plus_1);
 		
@@ -434,36 +1056,407 @@ double ext_kalmanfilter(size_t t,
 		gsl_matrix_scale(error_cov_t_plus_1, -1.0);
 	}
 	
+	/* freeze the gain once the recursion has converged */
+	if(isRegular && !isSteady && ws->steady_count > EKF_STEADY_STEPS && det != 0.0){
+		ws->steady = true;
+		ws->steady_det = det;
+		gsl_matrix_memcpy(ws->steady_kalman_gain, kalman_gain);
+		gsl_matrix_memcpy(ws->steady_chol_innov_cov, chol_innov_cov_small);
+		gsl_matrix_memcpy(ws->steady_error_cov, error_cov_t_plus_1);
+	}
+	
+	if(isCarry){
+		/* the filtered factor, which is that of the predicted P when nothing is observed */
+		size_t pair = ws->sqrt_from*ws->sqrt_num_regime+regime;
+		ws->sqrt_pair_valid[pair] = isSqrtUpdate || (num_non_miss == 0 && hasSqrtPred);
+		if(ws->sqrt_pair_valid[pair]){
+			gsl_matrix_memcpy(ws->sqrt_pair[pair], ws->sqrt_factor);
+		}
+	}
+	
+	if(isRecord){
+		track->det[ws->track_step] = det;
+		gsl_matrix_memcpy(track->error_cov[ws->track_step], error_cov_t_plus_1);
+		if(num_non_miss > 0){
+			gsl_matrix_view block = gsl_matrix_submatrix(track->kalman_gain[ws->track_step], 0, 0, nx, num_non_miss);
+			gsl_matrix_memcpy(&block.matrix, kalman_gain);
+			block = gsl_matrix_submatrix(track->chol_innov_cov[ws->track_step], 0, 0, num_non_miss, num_non_miss);
+			gsl_matrix_memcpy(&block.matrix, chol_innov_cov_small);
+		}
+	}
+	
 	
 	if(DEBUG_EKF){
 		MYPRINT("About to compute likelihood for time %lf\n", y_time[t]);
 	}
-	double neg_log_p = mathfunction_negloglike_multivariate_normal_invcov(innov_v_small, inv_innov_cov_small, num_non_miss, det);
+	double neg_log_p;
+	if(det != 0.0){
+		neg_log_p = mathfunction_negloglike_multivariate_normal_chol(innov_v_small, chol_innov_cov_small, inv_innov_cov_v_small);
+	}else{
+		/* nothing observed, or the pseudo-inverse */
+		neg_log_p = mathfunction_negloglike_multivariate_normal_invcov(innov_v_small, chol_innov_cov_small, num_non_miss, det, inv_innov_cov_v_small);
+	}
+	
+	/* the explicit inverse is formed for calls that are for return only, where the score reads it */
+	if(isForReturn && num_non_miss > 0){
+		gsl_matrix_memcpy(inv_innov_cov_small, chol_innov_cov_small);
+		if(det != 0.0){
+			gsl_linalg_cholesky_invert(inv_innov_cov_small);
+		}
+	}
 	
 	if(DEBUG_EKF){
 		MYPRINT("neg_log_p(%lf): %lf", y_time[t], neg_log_p);
 		MYPRINT("\n");
 	}
 	
-	/** free allocated space **/
-	if(DEBUG_EKF){
-		MYPRINT("Freeing allocated space\n");
-	}
-	gsl_matrix_free(ph);
-	gsl_matrix_free(ph_small);
-	gsl_matrix_free(innov_cov_small);
-	gsl_matrix_free(kalman_gain);
-	gsl_matrix_free(H_t_plus_1);
-	gsl_vector_free(y_non_miss_index);
-	gsl_vector_free(y_small);
-	gsl_vector_free(innov_v_small);
-	gsl_matrix_free(H_small);
-	gsl_matrix_free(y_noise_cov_small);
-	gsl_matrix_free(inv_innov_cov_small);
-	
 	return neg_log_p;
 }
 
+/**
+ * This method allocates the scratch space of ext_kalmanfilter() for a given model
+ * @param config the configuration of the model. Only the dimensions are used.
+ * @return a workspace that can be passed to any number of ext_kalmanfilter() calls, but only by one thread at a time
+ */
+EKFWorkspace *ekf_workspace_alloc(const ParamConfig *config){
+	size_t nx = config->dim_latent_var;
+	size_t ny = config->dim_obs_var;
+	EKFWorkspace *ws = (EKFWorkspace *)malloc(sizeof(EKFWorkspace));
+	
+	ws->obs_index = (size_t *)malloc(ny*sizeof(size_t));
+	ws->y_small = gsl_vector_alloc(ny);
+	ws->innov_v_small = gsl_vector_alloc(ny);
+	ws->inv_innov_cov_v_small = gsl_vector_alloc(ny);
+	ws->H_t_plus_1 = gsl_matrix_calloc(ny, nx);
+	ws->H_small = gsl_matrix_calloc(ny, nx);
+	ws->ph_small = gsl_matrix_calloc(nx, ny);
+	ws->ph = gsl_matrix_calloc(nx, ny);
+	ws->innov_cov_small = gsl_matrix_calloc(ny, ny);
+	ws->y_noise_cov_small = gsl_matrix_calloc(ny, ny);
+	ws->kalman_gain = gsl_matrix_calloc(nx, ny);
+	ws->inv_innov_cov_small = gsl_matrix_calloc(ny, ny);
+	ws->chol_innov_cov_small = gsl_matrix_calloc(ny, ny);
+	ws->eta_delta = gsl_vector_calloc(nx);
+	
+	ws->Pnewvec = gsl_vector_calloc(nx*(nx+1)/2);
+	ws->error_cov_t_vec = gsl_vector_calloc(nx*(nx+1)/2);
+	ws->dpparams = (double *)malloc((config->num_func_param+nx+(nx+1)*nx/2)*sizeof(double));
+	ws->jacob_dynam = gsl_matrix_calloc(nx, nx);
+	ws->p_jacob_dynam = gsl_matrix_calloc(nx, nx);
+	if(config->isContinuousTime && config->adaodesolver){
+		ws->ode_eta = ode_workspace_alloc(nx);
+		ws->ode_P = ode_workspace_alloc(nx*(nx+1)/2);
+		ws->ode_step = (double *)calloc(2*config->num_regime*config->num_regime, sizeof(double));
+	} else {
+		ws->ode_eta = NULL;
+		ws->ode_P = NULL;
+		ws->ode_step = NULL;
+	}
+	
+	ws->fused = config->isContinuousTime && config->fused_ode;
+	ws->fused_eta = gsl_vector_calloc(nx);
+	ws->fused_d_eta = gsl_vector_calloc(nx);
+	ws->fused_P = gsl_matrix_calloc(nx, nx);
+	ws->fused_d_P = gsl_matrix_calloc(nx, nx);
+	ws->disc = NULL;
+	ws->linear = NULL;
+	
+	ws->steady_allowed = false;
+	ws->steady = false;
+	ws->steady_count = 0;
+	ws->steady_dt_index = 0;
+	ws->steady_det = 0;
+	if(config->steady_state){
+		ws->steady_error_cov_pred = gsl_matrix_calloc(nx, nx);
+		ws->steady_innov_cov = gsl_matrix_calloc(ny, ny);
+		ws->steady_error_cov = gsl_matrix_calloc(nx, nx);
+		ws->steady_kalman_gain = gsl_matrix_calloc(nx, ny);
+		ws->steady_chol_innov_cov = gsl_matrix_calloc(ny, ny);
+	}else{
+		ws->steady_error_cov_pred = NULL;
+		ws->steady_innov_cov = NULL;
+		ws->steady_error_cov = NULL;
+		ws->steady_kalman_gain = NULL;
+		ws->steady_chol_innov_cov = NULL;
+	}
+	if(config->square_root){
+		ws->sqrt_factor = gsl_matrix_calloc(nx, nx);
+		ws->sqrt_eta_noise = gsl_matrix_calloc(nx, nx);
+		ws->sqrt_y_noise = gsl_matrix_calloc(ny, ny);
+		ws->sqrt_time_array = gsl_matrix_calloc(2*nx, nx);
+		ws->sqrt_time_tau = gsl_vector_calloc(nx);
+		ws->sqrt_meas_array = gsl_matrix_calloc(ny+nx, ny+nx);
+		ws->sqrt_meas_tau = gsl_vector_calloc(ny+nx);
+	}else{
+		ws->sqrt_factor = NULL;
+		ws->sqrt_eta_noise = NULL;
+		ws->sqrt_y_noise = NULL;
+		ws->sqrt_time_array = NULL;
+		ws->sqrt_time_tau = NULL;
+		ws->sqrt_meas_array = NULL;
+		ws->sqrt_meas_tau = NULL;
+	}
+	ws->sqrt_carry = false;
+	ws->sqrt_from = 0;
+	ws->sqrt_num_regime = config->num_regime;
+	if(config->square_root){
+		ws->sqrt_regime = tensor_matrix_alloc(config->num_regime, nx, nx);
+		ws->sqrt_regime_valid = (bool *)calloc(config->num_regime, sizeof(bool));
+		ws->sqrt_pair = tensor_matrix_alloc(config->num_regime*config->num_regime, nx, nx);
+		ws->sqrt_pair_valid = (bool *)calloc(config->num_regime*config->num_regime, sizeof(bool));
+		ws->sqrt_collapse_array = gsl_matrix_calloc(config->num_regime*(nx+1), nx);
+		ws->sqrt_collapse_tau = gsl_vector_calloc(nx);
+	}else{
+		ws->sqrt_regime = NULL;
+		ws->sqrt_regime_valid = NULL;
+		ws->sqrt_pair = NULL;
+		ws->sqrt_pair_valid = NULL;
+		ws->sqrt_collapse_array = NULL;
+		ws->sqrt_collapse_tau = NULL;
+	}
+	ws->sequential_error_cov = config->sequential_update? gsl_matrix_calloc(nx, nx) : NULL;
+	if(config->collapsed_update && ny > EKF_COLLAPSE_RATIO*nx){
+		ws->collapse_m = (size_t *)calloc(config->num_regime, sizeof(size_t));
+		ws->collapse_noise_pd = (bool *)calloc(config->num_regime, sizeof(bool));
+		ws->collapse_has_w = (bool *)calloc(config->num_regime, sizeof(bool));
+		ws->collapse_log_det = (double *)calloc(config->num_regime, sizeof(double));
+		ws->collapse_noise = tensor_matrix_alloc(config->num_regime, ny, ny);
+		ws->collapse_chol = tensor_matrix_alloc(config->num_regime, ny, ny);
+		ws->collapse_loading = tensor_matrix_alloc(config->num_regime, ny, nx);
+		ws->collapse_w = tensor_matrix_alloc(config->num_regime, ny, nx);
+		ws->collapse_gram = tensor_matrix_alloc(config->num_regime, nx, nx);
+		ws->collapse_factor = gsl_matrix_calloc(nx, nx);
+		ws->collapse_inner = gsl_matrix_calloc(nx, nx);
+		ws->collapse_temp = gsl_matrix_calloc(nx, nx);
+		ws->collapse_z = gsl_vector_calloc(ny);
+		ws->collapse_g = gsl_vector_calloc(nx);
+		ws->collapse_b = gsl_vector_calloc(nx);
+	}else{
+		ws->collapse_m = NULL;
+		ws->collapse_noise_pd = NULL;
+		ws->collapse_has_w = NULL;
+		ws->collapse_log_det = NULL;
+		ws->collapse_noise = NULL;
+		ws->collapse_chol = NULL;
+		ws->collapse_loading = NULL;
+		ws->collapse_w = NULL;
+		ws->collapse_gram = NULL;
+		ws->collapse_factor = NULL;
+		ws->collapse_inner = NULL;
+		ws->collapse_temp = NULL;
+		ws->collapse_z = NULL;
+		ws->collapse_g = NULL;
+		ws->collapse_b = NULL;
+	}
+	if(config->num_regime > 1){
+		ws->pred_eta = tensor_vector_alloc(config->num_regime, nx);
+		ws->pred_error_cov = tensor_matrix_alloc(config->num_regime, nx, nx);
+	}else{
+		ws->pred_eta = NULL;
+		ws->pred_error_cov = NULL;
+	}
+	if(config->num_regime > 1 && config->square_root){
+		ws->sqrt_pred = tensor_matrix_alloc(config->num_regime, nx, nx);
+		ws->sqrt_pred_valid = (bool *)calloc(config->num_regime, sizeof(bool));
+	}else{
+		ws->sqrt_pred = NULL;
+		ws->sqrt_pred_valid = NULL;
+	}
+	ws->pred_share = false;
+	ws->pred_replay = false;
+	ws->pred_slot = 0;
+	ws->retain_jacob = NULL;
+	ws->retain_chol = NULL;
+	ws->retain_has_jacob = false;
+	ws->retain_has_chol = false;
+	ws->track = NULL;
+	ws->track_replay = false;
+	ws->track_step = 0;
+	ws->noise_regime = 0;
+	ws->disc_zero = gsl_vector_calloc(nx);
+	ws->disc_intercept = gsl_vector_calloc(nx);
+	
+	ws->num_alloc = 0;
+	ws->num_pinv = 0;
+	return ws;
+}
+
+void ekf_workspace_free(EKFWorkspace *ws){
+	free(ws->obs_index);
+	gsl_vector_free(ws->y_small);
+	gsl_vector_free(ws->innov_v_small);
+	gsl_vector_free(ws->inv_innov_cov_v_small);
+	gsl_matrix_free(ws->H_t_plus_1);
+	gsl_matrix_free(ws->H_small);
+	gsl_matrix_free(ws->ph_small);
+	gsl_matrix_free(ws->ph);
+	gsl_matrix_free(ws->innov_cov_small);
+	gsl_matrix_free(ws->y_noise_cov_small);
+	gsl_matrix_free(ws->kalman_gain);
+	gsl_matrix_free(ws->inv_innov_cov_small);
+	gsl_matrix_free(ws->chol_innov_cov_small);
+	gsl_vector_free(ws->eta_delta);
+	gsl_vector_free(ws->Pnewvec);
+	gsl_vector_free(ws->error_cov_t_vec);
+	free(ws->dpparams);
+	gsl_matrix_free(ws->jacob_dynam);
+	gsl_matrix_free(ws->p_jacob_dynam);
+	if(ws->ode_eta != NULL){
+		ode_workspace_free(ws->ode_eta);
+		ode_workspace_free(ws->ode_P);
+		free(ws->ode_step);
+	}
+	gsl_vector_free(ws->fused_eta);
+	gsl_vector_free(ws->fused_d_eta);
+	gsl_matrix_free(ws->fused_P);
+	gsl_matrix_free(ws->fused_d_P);
+	gsl_vector_free(ws->disc_zero);
+	gsl_vector_free(ws->disc_intercept);
+	if(ws->steady_error_cov_pred != NULL){
+		gsl_matrix_free(ws->steady_error_cov_pred);
+		gsl_matrix_free(ws->steady_innov_cov);
+		gsl_matrix_free(ws->steady_error_cov);
+		gsl_matrix_free(ws->steady_kalman_gain);
+		gsl_matrix_free(ws->steady_chol_innov_cov);
+	}
+	if(ws->sqrt_factor != NULL){
+		gsl_matrix_free(ws->sqrt_factor);
+		gsl_matrix_free(ws->sqrt_eta_noise);
+		gsl_matrix_free(ws->sqrt_y_noise);
+		gsl_matrix_free(ws->sqrt_time_array);
+		gsl_vector_free(ws->sqrt_time_tau);
+		gsl_matrix_free(ws->sqrt_meas_array);
+		gsl_vector_free(ws->sqrt_meas_tau);
+	}
+	if(ws->sqrt_regime != NULL){
+		tensor_free(ws->sqrt_regime);
+		free(ws->sqrt_regime_valid);
+		tensor_free(ws->sqrt_pair);
+		free(ws->sqrt_pair_valid);
+		gsl_matrix_free(ws->sqrt_collapse_array);
+		gsl_vector_free(ws->sqrt_collapse_tau);
+	}
+	if(ws->sqrt_pred != NULL){
+		tensor_free(ws->sqrt_pred);
+		free(ws->sqrt_pred_valid);
+	}
+	if(ws->pred_eta != NULL){
+		tensor_free(ws->pred_eta);
+		tensor_free(ws->pred_error_cov);
+	}
+	if(ws->sequential_error_cov != NULL){
+		gsl_matrix_free(ws->sequential_error_cov);
+	}
+	if(ws->collapse_noise != NULL){
+		free(ws->collapse_m);
+		free(ws->collapse_noise_pd);
+		free(ws->collapse_has_w);
+		free(ws->collapse_log_det);
+		tensor_free(ws->collapse_noise);
+		tensor_free(ws->collapse_chol);
+		tensor_free(ws->collapse_loading);
+		tensor_free(ws->collapse_w);
+		tensor_free(ws->collapse_gram);
+		gsl_matrix_free(ws->collapse_factor);
+		gsl_matrix_free(ws->collapse_inner);
+		gsl_matrix_free(ws->collapse_temp);
+		gsl_vector_free(ws->collapse_z);
+		gsl_vector_free(ws->collapse_g);
+		gsl_vector_free(ws->collapse_b);
+	}
+	free(ws);
+}
+
+void ekf_workspace_allow_steady_state(EKFWorkspace *ws, const ParamConfig *config){
+	/*the predicted P of a single regime changes with time only through the Jacobians and the interval*/
+	ws->steady_allowed = config->steady_state && ws->linear != NULL && ws->linear->loading != NULL
+		&& (config->isContinuousTime? ws->disc != NULL : ws->linear->transition != NULL);
+	ws->steady = false;
+	ws->steady_count = 0;
+}
+
+void ekf_sqrt_share(EKFWorkspace *ws, size_t regime_j, size_t regime_k, size_t src_j, size_t src_k){
+	size_t nr = ws->sqrt_num_regime, pair = regime_j*nr+regime_k, src = src_j*nr+src_k;
+	if(ws->sqrt_pair == NULL || !ws->sqrt_carry){
+		return;
+	}
+	ws->sqrt_pair_valid[pair] = ws->sqrt_pair_valid[src];
+	if(ws->sqrt_pair_valid[src]){
+		gsl_matrix_memcpy(ws->sqrt_pair[pair], ws->sqrt_pair[src]);
+	}
+}
+
+void ekf_sqrt_collapse(EKFWorkspace *ws, size_t regime_k, gsl_vector *const *eta_jk, const gsl_vector *weight, double scale, const gsl_vector *eta_k){
+	size_t nr = ws->sqrt_num_regime, nx, regime_j, pair;
+	double w;
+	gsl_matrix_view block;
+	gsl_vector_view row;
+	if(ws->sqrt_pair == NULL || !ws->sqrt_carry){
+		return;
+	}
+	if(nr == 1){
+		/*the collapse is the identity, see brekfis()*/
+		ws->sqrt_regime_valid[0] = ws->sqrt_pair_valid[0];
+		if(ws->sqrt_pair_valid[0]){
+			gsl_matrix_memcpy(ws->sqrt_regime[0], ws->sqrt_pair[0]);
+		}
+		return;
+	}
+	nx = eta_k->size;
+	ws->sqrt_regime_valid[regime_k] = false;
+	for(regime_j=0; regime_j<nr; regime_j++){
+		pair = regime_j*nr+regime_k;
+		w = scale*gsl_vector_get(weight, regime_j);
+		block = gsl_matrix_submatrix(ws->sqrt_collapse_array, regime_j*(nx+1), 0, nx, nx);
+		row = gsl_matrix_row(ws->sqrt_collapse_array, regime_j*(nx+1)+nx);
+		if(!(w > 0)){
+			gsl_matrix_set_zero(&block.matrix);
+			gsl_vector_set_zero(&row.vector);
+			continue;
+		}
+		if(!ws->sqrt_pair_valid[pair]){
+			return;
+		}
+		w = sqrt(w);
+		gsl_matrix_memcpy(&block.matrix, ws->sqrt_pair[pair]);
+		gsl_matrix_scale(&block.matrix, w);
+		gsl_vector_memcpy(&row.vector, eta_k);
+		gsl_vector_sub(&row.vector, eta_jk[regime_j]);
+		gsl_vector_scale(&row.vector, w);
+	}
+	gsl_linalg_QR_decomp(ws->sqrt_collapse_array, ws->sqrt_collapse_tau);
+	block = gsl_matrix_submatrix(ws->sqrt_collapse_array, 0, 0, nx, nx);
+	ekf_upper_triangle(&block.matrix, ws->sqrt_regime[regime_k]);
+	ws->sqrt_regime_valid[regime_k] = true;
+}
+
+/**
+ * This method allocates the steps of an EKFTrack
+ * @param num_step the number of time points of the subjects that share it
+ * @param config the configuration of the model. Only the dimensions are used.
+ */
+EKFTrack *ekf_track_alloc(size_t num_step, const ParamConfig *config){
+	size_t nx = config->dim_latent_var;
+	size_t ny = config->dim_obs_var;
+	EKFTrack *track = (EKFTrack *)malloc(sizeof(EKFTrack));
+	track->num_step = num_step;
+	track->det = (double *)calloc(num_step, sizeof(double));
+	track->error_cov_pred = tensor_matrix_alloc(num_step, nx, nx);
+	track->error_cov = tensor_matrix_alloc(num_step, nx, nx);
+	track->kalman_gain = tensor_matrix_alloc(num_step, nx, ny);
+	track->chol_innov_cov = tensor_matrix_alloc(num_step, ny, ny);
+	return track;
+}
+
+void ekf_track_free(EKFTrack *track){
+	free(track->det);
+	tensor_free(track->error_cov_pred);
+	tensor_free(track->error_cov);
+	tensor_free(track->kalman_gain);
+	tensor_free(track->chol_innov_cov);
+	free(track);
+}
+
 
 /**
  * This method finds the missing data and creates a vector that indicates which entries are missing
@@ -484,6 +1477,235 @@ size_t find_miss_data(const gsl_vector *y, gsl_vector *non_miss){
 	return(y->size - sum);
 }
 
+/**
+ * This method finds the indices of the observed (non-NA) entries of y
+ * @param y the data. missing ones are represented as NA in R
+ * @param obs_index the indices of the observed entries, in increasing order. Must have room for y->size entries.
+ * @return the number of non-missing entries of y
+ */
+size_t find_obs_index(const gsl_vector *y, size_t *obs_index){
+	size_t num_obs = 0;
+	for(size_t col_index=0; col_index < y->size; col_index++){
+		if(!ISNA(gsl_vector_get(y, col_index))){
+			obs_index[num_obs] = col_index;
+			num_obs++;
+		}
+	}
+	return num_obs;
+}
+
+/* FNV-1a hash of an index list */
+static unsigned long hash_obs_index(const size_t *obs_index, size_t num_obs){
+	unsigned long h = 2166136261UL;
+	for(size_t i=0; i < num_obs; i++){
+		h = (h ^ (unsigned long) obs_index[i]) * 16777619UL;
+	}
+	return (h ^ (unsigned long) num_obs) * 16777619UL;
+}
+
+/**
+ * This method groups the rows of the data by their missing-data pattern
+ * @param y the data. missing ones are represented as NA in R
+ * @param total_obs the number of rows of y
+ * @param dim_obs_var the number of entries in each row of y
+ * @return the patterns, to be released with miss_pattern_free()
+ */
+MissPattern *miss_pattern_alloc(gsl_vector **y, size_t total_obs, size_t dim_obs_var){
+	size_t t, pattern, slot;
+	size_t capacity = 16;
+	size_t table_size = 64; /* open addressing, kept at most half full */
+	size_t num_obs;
+	
+	MissPattern *mp = (MissPattern *)malloc(sizeof(MissPattern));
+	mp->num_pattern = 0;
+	mp->pattern_of_row = (size_t *)malloc(total_obs*sizeof(size_t));
+	mp->obs_offset = (size_t *)malloc((capacity+1)*sizeof(size_t));
+	mp->obs_index = (size_t *)malloc(capacity*dim_obs_var*sizeof(size_t));
+	mp->obs_offset[0] = 0;
+	
+	unsigned long *pattern_hash = (unsigned long *)malloc(capacity*sizeof(unsigned long));
+	size_t *table = (size_t *)calloc(table_size, sizeof(size_t)); /* pattern ID + 1, 0 for an empty slot */
+	size_t *row_index = (size_t *)malloc(dim_obs_var*sizeof(size_t));
+	
+	for(t=0; t < total_obs; t++){
+		num_obs = find_obs_index(y[t], row_index);
+		unsigned long h = hash_obs_index(row_index, num_obs);
+		
+		for(slot = h & (table_size-1); table[slot] != 0; slot = (slot+1) & (table_size-1)){
+			pattern = table[slot]-1;
+			if(pattern_hash[pattern] == h && mp->obs_offset[pattern+1]-mp->obs_offset[pattern] == num_obs &&
+				memcmp(mp->obs_index+mp->obs_offset[pattern], row_index, num_obs*sizeof(size_t)) == 0){
+				break;
+			}
+		}
+		
+		if(table[slot] == 0){
+			/* a new pattern */
+			pattern = mp->num_pattern;
+			if(pattern == capacity){
+				capacity *= 2;
+				mp->obs_offset = (size_t *)realloc(mp->obs_offset, (capacity+1)*sizeof(size_t));
+				mp->obs_index = (size_t *)realloc(mp->obs_index, capacity*dim_obs_var*sizeof(size_t));
+				pattern_hash = (unsigned long *)realloc(pattern_hash, capacity*sizeof(unsigned long));
+			}
+			memcpy(mp->obs_index+mp->obs_offset[pattern], row_index, num_obs*sizeof(size_t));
+			mp->obs_offset[pattern+1] = mp->obs_offset[pattern] + num_obs;
+			pattern_hash[pattern] = h;
+			table[slot] = pattern+1;
+			mp->num_pattern++;
+			
+			if(2*mp->num_pattern > table_size){
+				table_size *= 2;
+				free(table);
+				table = (size_t *)calloc(table_size, sizeof(size_t));
+				for(size_t p=0; p < mp->num_pattern; p++){
+					for(slot = pattern_hash[p] & (table_size-1); table[slot] != 0; slot = (slot+1) & (table_size-1));
+					table[slot] = p+1;
+				}
+			}
+		}else{
+			pattern = table[slot]-1;
+		}
+		mp->pattern_of_row[t] = pattern;
+	}
+	
+	free(row_index);
+	free(table);
+	free(pattern_hash);
+	return mp;
+}
+
+void miss_pattern_free(MissPattern *mp){
+	free(mp->pattern_of_row);
+	free(mp->obs_offset);
+	free(mp->obs_index);
+	free(mp);
+}
+
+/* FNV-1a hash of the intervals and the missing-data patterns of rows start to end-1 */
+static unsigned long hash_design(const double *y_time, size_t start, size_t end, const MissPattern *mp){
+	unsigned long h = 2166136261UL;
+	unsigned long long bits;
+	double dt;
+	for(size_t t=start; t < end; t++){
+		h = (h ^ (unsigned long) mp->pattern_of_row[t]) * 16777619UL;
+		if(t > start){
+			dt = y_time[t]-y_time[t-1];
+			memcpy(&bits, &dt, sizeof(double));
+			h = (h ^ (unsigned long) (bits ^ (bits >> 32))) * 16777619UL;
+		}
+	}
+	return (h ^ (unsigned long) (end-start)) * 16777619UL;
+}
+
+/* whether subjects a and b have the same intervals and missing-data patterns */
+static bool same_design(size_t a, size_t b, const double *y_time, const size_t *index_sbj, const MissPattern *mp){
+	size_t num_t = index_sbj[a+1]-index_sbj[a], ta = index_sbj[a], tb = index_sbj[b];
+	if(index_sbj[b+1]-index_sbj[b] != num_t){
+		return false;
+	}
+	for(size_t i=0; i < num_t; i++){
+		if(mp->pattern_of_row[ta+i] != mp->pattern_of_row[tb+i]){
+			return false;
+		}
+		if(i > 0 && y_time[ta+i]-y_time[ta+i-1] != y_time[tb+i]-y_time[tb+i-1]){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * This method groups the subjects by their design, see DesignGroups
+ * @param y_time the time of each row of the data
+ * @param index_sbj the first row of each subject, and the total number of rows
+ * @param num_sbj the number of subjects
+ * @param mp the missing-data patterns of the rows
+ * @return the groups, to be released with design_groups_free()
+ */
+DesignGroups *design_groups_alloc(const double *y_time, const size_t *index_sbj, size_t num_sbj, const MissPattern *mp){
+	size_t sbj, group, slot;
+	size_t table_size = 64; /* open addressing, at least twice the number of subjects */
+	while(table_size < 2*num_sbj){
+		table_size *= 2;
+	}
+	
+	DesignGroups *groups = (DesignGroups *)malloc(sizeof(DesignGroups));
+	groups->num_group = 0;
+	groups->group_of_sbj = (size_t *)malloc(num_sbj*sizeof(size_t));
+	groups->group_offset = (size_t *)calloc(num_sbj+1, sizeof(size_t));
+	groups->sbj_of_group = (size_t *)malloc(num_sbj*sizeof(size_t));
+	
+	size_t *leader = (size_t *)malloc(num_sbj*sizeof(size_t)); /* first subject of each group */
+	unsigned long *group_hash = (unsigned long *)malloc(num_sbj*sizeof(unsigned long));
+	size_t *table = (size_t *)calloc(table_size, sizeof(size_t)); /* group ID + 1, 0 for an empty slot */
+	
+	for(sbj=0; sbj < num_sbj; sbj++){
+		unsigned long h = hash_design(y_time, index_sbj[sbj], index_sbj[sbj+1], mp);
+		for(slot = h & (table_size-1); table[slot] != 0; slot = (slot+1) & (table_size-1)){
+			group = table[slot]-1;
+			if(group_hash[group] == h && same_design(leader[group], sbj, y_time, index_sbj, mp)){
+				break;
+			}
+		}
+		if(table[slot] == 0){
+			group = groups->num_group++;
+			leader[group] = sbj;
+			group_hash[group] = h;
+			table[slot] = group+1;
+		}else{
+			group = table[slot]-1;
+		}
+		groups->group_of_sbj[sbj] = group;
+		groups->group_offset[group+1]++;
+	}
+	
+	/* subjects in increasing order within each group */
+	for(group=0; group < groups->num_group; group++){
+		groups->group_offset[group+1] += groups->group_offset[group];
+		leader[group] = groups->group_offset[group];
+	}
+	for(sbj=0; sbj < num_sbj; sbj++){
+		groups->sbj_of_group[leader[groups->group_of_sbj[sbj]]++] = sbj;
+	}
+	
+	free(leader);
+	free(group_hash);
+	free(table);
+	return groups;
+}
+
+void design_groups_free(DesignGroups *groups){
+	free(groups->group_of_sbj);
+	free(groups->group_offset);
+	free(groups->sbj_of_group);
+	free(groups);
+}
+
+// Gather the listed elements of a vector
+void gather_vector(const gsl_vector *y, const size_t *index, gsl_vector *ysmall){
+	for(size_t i=0; i < ysmall->size; i++){
+		gsl_vector_set(ysmall, i, gsl_vector_get(y, index[i]));
+	}
+}
+
+// Gather the listed ROWS of a matrix, keeping all columns
+void gather_matrix_rows(const gsl_matrix *X, const size_t *index, gsl_matrix *Xsmall){
+	for(size_t i=0; i < Xsmall->size1; i++){
+		gsl_vector_const_view row = gsl_matrix_const_row(X, index[i]);
+		gsl_matrix_set_row(Xsmall, i, &row.vector);
+	}
+}
+
+// Gather the listed ROWS and COLS of a matrix
+void gather_matrix_rows_cols(const gsl_matrix *X, const size_t *index, gsl_matrix *Xsmall){
+	for(size_t i=0; i < Xsmall->size1; i++){
+		for(size_t j=0; j < Xsmall->size2; j++){
+			gsl_matrix_set(Xsmall, i, j, gsl_matrix_get(X, index[i], index[j]));
+		}
+	}
+}
+
 // Filter out elements of a vector
 void filter_vector(const gsl_vector *y, const gsl_vector *y_ind, gsl_vector *ysmall){
 	size_t miss_index = 0;
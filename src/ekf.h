@@ -4,9 +4,212 @@
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include "adaodesolver.h"
+#include "dopriodesolver.h"
+#include "discretization.h"
+#include "linearmodel.h"
+#include "data_structure.h"
 #include <gsl/gsl_rng.h>
 #include <R.h>
 #include <Rinternals.h>
+
+#define EKF_STEADY_TOL 1e-10 /*change of P and of the innovation covariance between steps, relative to their largest entry, below which the recursion counts as converged*/
+#define EKF_STEADY_STEPS 3 /*number of consecutive converged steps after which the gain is frozen*/
+#define EKF_COLLAPSE_RATIO 3 /*number of observed entries per latent variable above which the measurement update works in the latent dimension*/
+
+/**
+ * The covariance side of the ext_kalmanfilter() steps of one subject: predicted and filtered P, gain,
+ * Cholesky factor of the innovation covariance and its determinant.
+ * With one regime, parameter-only noise and linear matrices it depends on the design of the subject only,
+ * see DesignGroups, so the steps recorded for one subject are replayed for the others with the same design.
+ * The gain and the factor are kept in the leading block of the observed entries of each step;
+ * where det is 0 the factor is replaced by the pseudo-inverse, see mathfunction_cholesky_det_pinv().
+ */
+typedef struct EKFTrack{
+	size_t num_step;
+	double *det;
+	gsl_matrix **error_cov_pred;
+	gsl_matrix **error_cov;
+	gsl_matrix **kalman_gain;
+	gsl_matrix **chol_innov_cov;
+} EKFTrack;
+
+EKFTrack *ekf_track_alloc(size_t num_step, const ParamConfig *config);
+
+void ekf_track_free(EKFTrack *track);
+
+/**
+ * Scratch space of ext_kalmanfilter(), sized once from the model dimensions so that
+ * the filter step itself does not allocate.
+ * The reduced (non-missing) objects are used through views of their leading block.
+ */
+typedef struct EKFWorkspace{
+	size_t *obs_index; /** indices of the observed entries of y when no missing-data pattern is given **/
+	gsl_vector *y_small;
+	gsl_vector *innov_v_small;
+	gsl_vector *inv_innov_cov_v_small; /** inverse innovation covariance times innovation **/
+	gsl_matrix *H_t_plus_1;
+	gsl_matrix *H_small;
+	gsl_matrix *ph_small;
+	gsl_matrix *ph;
+	gsl_matrix *innov_cov_small;
+	gsl_matrix *y_noise_cov_small;
+	gsl_matrix *kalman_gain;
+	gsl_matrix *inv_innov_cov_small; /** formed from chol_innov_cov_small for calls that are for return only **/
+	gsl_matrix *chol_innov_cov_small; /** Cholesky factor of the innovation covariance, or its pseudo-inverse, see mathfunction_cholesky_det_pinv() **/
+	gsl_vector *eta_delta; /** change of eta over the update that processes the observed entries one at a time **/
+	/** continuous-time covariance update **/
+	gsl_vector *Pnewvec;
+	gsl_vector *error_cov_t_vec;
+	double *dpparams;
+	/** discrete-time covariance update **/
+	gsl_matrix *jacob_dynam;
+	gsl_matrix *p_jacob_dynam;
+	/** adaptive integration of eta and of vech(P), or NULL when the model uses a fixed-step solver **/
+	OdeWorkspace *ode_eta;
+	OdeWorkspace *ode_P;
+	double *ode_step; /** row-major per pair (sqrt_from, regime), the step sizes the last steps of eta and of vech(P) of the pair ended with, or 0 **/
+	/** fused RK4 propagation of eta and P, see ext_kalmanfilter(); uses dpparams, jacob_dynam and p_jacob_dynam as scratch **/
+	bool fused;
+	gsl_vector *fused_eta; /** eta at the current stage **/
+	gsl_vector *fused_d_eta; /** d eta/dt at the current stage **/
+	gsl_matrix *fused_P;
+	gsl_matrix *fused_d_P;
+	/** exact discretization used in place of the ODE solver, or NULL; set by the caller together with noise_regime **/
+	const ExactDiscretization *disc;
+	size_t noise_regime; /** regime whose eta_noise_cov is passed to ext_kalmanfilter() **/
+	gsl_vector *disc_zero; /** the zero state, at which func_dx_dt gives the intercept b **/
+	gsl_vector *disc_intercept;
+	/** matrices of a linear model used in place of the model functions, or NULL; set by the caller **/
+	const LinearModel *linear;
+	/** steady state of a time-invariant covariance recursion, see ekf_workspace_allow_steady_state(); the matrices are NULL unless ParamConfig::steady_state **/
+	bool steady_allowed;
+	bool steady; /** whether the frozen moments below replace the covariance recursion **/
+	size_t steady_count; /** number of consecutive regular steps, the last ones of which left P and the innovation covariance unchanged **/
+	size_t steady_dt_index; /** interval of ws->disc of these steps **/
+	double steady_det; /** determinant of the innovation covariance **/
+	gsl_matrix *steady_error_cov_pred; /** predicted P, of the previous step until the gain is frozen **/
+	gsl_matrix *steady_innov_cov; /** innovation covariance, of the previous step until the gain is frozen **/
+	gsl_matrix *steady_error_cov; /** filtered P **/
+	gsl_matrix *steady_kalman_gain;
+	gsl_matrix *steady_chol_innov_cov;
+	/** square-root covariance updates, see ParamConfig::square_root; NULL otherwise **/
+	gsl_matrix *sqrt_factor; /** upper triangular R of the predicted P = R'R **/
+	gsl_matrix *sqrt_eta_noise; /** lower triangular square roots of the noise covariance matrices **/
+	gsl_matrix *sqrt_y_noise;
+	gsl_matrix *sqrt_time_array; /** 2nx x nx array of the prediction, triangularized in place **/
+	gsl_vector *sqrt_time_tau;
+	gsl_matrix *sqrt_meas_array; /** (ny+nx) x (ny+nx) array of the measurement update, triangularized in place **/
+	gsl_vector *sqrt_meas_tau;
+	/** factors carried across time points, so that the filtered P is not factored again at the next prediction;
+	 * used when sqrt_carry is set by the caller, see ekf_sqrt_collapse() **/
+	bool sqrt_carry;
+	size_t sqrt_from; /** the regime j of the step, set by the caller; also keys ode_step **/
+	size_t sqrt_num_regime;
+	gsl_matrix **sqrt_regime; /** per regime j, upper triangular U of the filtered P=U'U the steps from j start from **/
+	bool *sqrt_regime_valid;
+	gsl_matrix **sqrt_pair; /** row-major per pair (j,k), U of the filtered P of the step **/
+	bool *sqrt_pair_valid;
+	gsl_matrix **sqrt_pred; /** per slot of pred_error_cov, R of the shared predicted P, or NULL with one regime **/
+	bool *sqrt_pred_valid;
+	gsl_matrix *sqrt_collapse_array; /** num_regime(nx+1) x nx array of the collapse, triangularized in place **/
+	gsl_vector *sqrt_collapse_tau;
+	/** P before the update one observed entry at a time, restored when it falls back, see ParamConfig::sequential_update; NULL otherwise **/
+	gsl_matrix *sequential_error_cov;
+	/** measurement update in the latent dimension for many observed entries, see ParamConfig::collapsed_update and
+	 * EKF_COLLAPSE_RATIO; NULL when the option is off or dim_obs_var is not large enough.
+	 * The factor of the measurement noise covariance, and its product with the loading, are kept per regime of the noise
+	 * covariance (noise_regime) while they stay the same; the arrays below are indexed by that regime **/
+	size_t *collapse_m; /** number of observed entries of the kept factor, or 0 **/
+	bool *collapse_noise_pd; /** whether the kept measurement noise covariance is positive definite **/
+	bool *collapse_has_w;
+	double *collapse_log_det; /** log determinant of the kept measurement noise covariance **/
+	gsl_matrix **collapse_noise; /** measurement noise covariance R of the observed entries **/
+	gsl_matrix **collapse_chol; /** lower triangular C, R = CC' **/
+	gsl_matrix **collapse_loading; /** loading H of the observed entries **/
+	gsl_matrix **collapse_w; /** C^{-1}H **/
+	gsl_matrix **collapse_gram; /** H'R^{-1}H **/
+	gsl_matrix *collapse_factor;
+	gsl_matrix *collapse_inner;
+	gsl_matrix *collapse_temp;
+	gsl_vector *collapse_z;
+	gsl_vector *collapse_g;
+	gsl_vector *collapse_b;
+	/** predictions shared by the regime pairs from the same regime j into regimes with the same dynamics, one slot per regime,
+	 * or NULL with one regime; used when pred_share is set by the caller, for calls that are not perturbed **/
+	gsl_vector **pred_eta;
+	gsl_matrix **pred_error_cov;
+	bool pred_share;
+	bool pred_replay; /** whether the prediction is copied from slot pred_slot instead of being computed and recorded there **/
+	size_t pred_slot;
+	/** the transition matrix of the prediction and the lower triangular factor of the predicted P, written for the smoother
+	 * when set by the caller, or NULL; retain_jacob is NULL when only the factor is kept. retain_has_jacob and retain_has_chol
+	 * tell whether the step wrote them, see KimRetained **/
+	gsl_matrix *retain_jacob;
+	gsl_matrix *retain_chol;
+	bool retain_has_jacob;
+	bool retain_has_chol;
+	/** steps recorded into, or replayed from, step track_step of track, or NULL; set by the caller, for calls that are not for return **/
+	EKFTrack *track;
+	bool track_replay;
+	size_t track_step;
+	size_t num_alloc; /** number of heap allocations made by ext_kalmanfilter() calls since the workspace was created **/
+	size_t num_pinv; /** number of those calls whose innovation covariance fell back to the pseudo-inverse **/
+} EKFWorkspace;
+
+EKFWorkspace *ekf_workspace_alloc(const ParamConfig *config);
+
+void ekf_workspace_free(EKFWorkspace *ws);
+
+/**
+ * Let ext_kalmanfilter() freeze the gain once the covariance recursion has converged.
+ * This is allowed when config->steady_state is set and ws->linear, together with ws->disc in continuous time,
+ * makes the recursion time-invariant, so call it after setting those.
+ * A steady state lasts while every entry of y is observed and, in continuous time, the interval stays the same.
+ */
+void ekf_workspace_allow_steady_state(EKFWorkspace *ws, const ParamConfig *config);
+
+/**
+ * With square-root updates, the step of the pair (src_j, src_k) is also taken by the pair (regime_j, regime_k),
+ * as for a shared or a pruned step; its factor is copied along. Does nothing otherwise.
+ */
+void ekf_sqrt_share(EKFWorkspace *ws, size_t regime_j, size_t regime_k, size_t src_j, size_t src_k);
+
+/**
+ * With square-root updates, collapses the factors of the steps into regime_k the way mathfunction_collapse_cov() collapses P:
+ * U_k is the triangular factor of the stacked rows sqrt(scale weight_j) U_jk and sqrt(scale weight_j) (eta_k-eta_jk)',
+ * from a QR decomposition. The factor of regime_k is kept for the next steps from it only when those of the steps with
+ * a positive weight were. Does nothing otherwise.
+ * @param eta_jk the filtered means of the steps from every regime j
+ * @param eta_k the collapsed mean
+ */
+void ekf_sqrt_collapse(EKFWorkspace *ws, size_t regime_k, gsl_vector *const *eta_jk, const gsl_vector *weight, double scale, const gsl_vector *eta_k);
+
+/**
+ * Modes of an ext_kalmanfilter() step. The caller picks them through isFirstTime, isForReturn and the fields of
+ * EKFWorkspace, and the step derives its flags from them; the combinations allowed are:
+ * - isForReturn: a step of EKimFilter() or EKimFilterStream(), which also fills eta_pred, error_cov_pred and the
+ *   innovation covariance. Only these steps take retain_jacob and retain_chol, and they never take a track.
+ * - isRecord, isReplay: a step of brekfis() for a subject whose design is shared, see EKFTrack; only with one regime,
+ *   so never with pred_share. A recording step may run any other mode but the sequential and the collapsed update,
+ *   which keep no gain and no factor of the innovation covariance.
+ * - isRegular, isSteady: with steady_allowed, so one regime and never while replaying. A regular step counts towards
+ *   the steady state, a steady one reuses the frozen moments.
+ * - isFixed, for isSteady or isReplay: the covariance side is copied. No square-root, sequential or collapsed update
+ *   runs on a fixed step, so the carried factor of its pair is lost.
+ * - isPredReplay: the prediction is copied from the earlier regime pred_slot with the same dynamics; only with
+ *   pred_share, that is several regimes and no perturbation. The square-root update still runs, from the stored factor.
+ * - isSqrt: square_root on a step that is not fixed. isSqrtPredict: also neither the first time point nor a replayed
+ *   prediction, in discrete time or with exact discretization. isPredFormed is false only when the carried factor
+ *   suffices: something is observed, and the step neither records, counts towards the steady state, is for return,
+ *   retains its factor nor shares its prediction.
+ * - The sequential and the collapsed update: only on a step that observes something and is neither fixed, square-root,
+ *   recording, regular nor for return; either falls back to the joint update when it cannot run.
+ * - The prediction: copied when fixed or replayed, else the exact discretization (only in continuous time), the linear
+ *   transition, the fused Runge-Kutta step (only in continuous time, never with the adaptive solver), the adaptive
+ *   solver (only in continuous time) or func_dynam.
+ * ext_kalmanfilter() asserts what its callers must not combine; the package builds with NDEBUG, as R expects.
+ */
+
 /******************************************************************************
 * Discrete/continuous-discrete extended kalman filter (EKF)
 * *
@@ -44,6 +247,8 @@
 * error_cov_t_plus_1 -- a vector of the elements in the filtered error covariance matrix at time t: P_t[1,1],P_t[2,2],P_t[3,3],P_t[1,2],P_t[1,3],P_t[2,3]
 * innov_v-- innovation vector
 * innov_cov-- innovation covariance matrix
+* miss_pattern -- missing-data patterns of the data, or NULL
+* ws -- scratch space from ekf_workspace_alloc()
 * *
 *********************************************/
 
@@ -67,10 +272,28 @@ double ext_kalmanfilter(size_t t, size_t regime,
 	gsl_vector *innov_v, gsl_matrix *inv_innov_cov,
 	gsl_matrix *innov_cov,
 	bool isFirstTime, bool isForReturn,
-	bool perturb, gsl_rng *seed);
+	bool perturb, gsl_rng *seed,
+	const MissPattern *miss_pattern,
+	EKFWorkspace *ws);
 
 size_t find_miss_data(const gsl_vector *y, gsl_vector *non_miss);
 
+size_t find_obs_index(const gsl_vector *y, size_t *obs_index);
+
+MissPattern *miss_pattern_alloc(gsl_vector **y, size_t total_obs, size_t dim_obs_var);
+
+void miss_pattern_free(MissPattern *mp);
+
+DesignGroups *design_groups_alloc(const double *y_time, const size_t *index_sbj, size_t num_sbj, const MissPattern *mp);
+
+void design_groups_free(DesignGroups *groups);
+
+void gather_vector(const gsl_vector *y, const size_t *index, gsl_vector *ysmall);
+
+void gather_matrix_rows(const gsl_matrix *X, const size_t *index, gsl_matrix *Xsmall);
+
+void gather_matrix_rows_cols(const gsl_matrix *X, const size_t *index, gsl_matrix *Xsmall);
+
 void filter_vector(const gsl_vector *y, const gsl_vector *y_ind, gsl_vector *ysmall);
 
 void filter_matrix_rows(const gsl_matrix *X, const gsl_vector *y_ind, gsl_matrix *Xsmall);
@@ -0,0 +1,78 @@
+/**
+ * This file assembles the matrices of linear models used by ext_kalmanfilter() in place of
+ * the model functions, see linearmodel.h.
+ */
+#include <stdlib.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "linearmodel.h"
+#include "tensor.h"
+
+/*the matrices filled by func_dynam and func_measure at param, either of which may be NULL*/
+static LinearModel *linear_model_assemble(const ParamConfig *config,
+	void (*func_dynam)(size_t, double *, gsl_matrix *, gsl_matrix *, gsl_vector *),
+	void (*func_measure)(size_t, double *, gsl_matrix *, gsl_matrix *, gsl_vector *), double *param){
+	size_t nx=config->dim_latent_var, ny=config->dim_obs_var, nu=config->dim_co_variate;
+	size_t num_regime=config->num_regime, regime;
+	bool has_dynam=!config->isContinuousTime && func_dynam != NULL;
+	bool has_measure=func_measure != NULL;
+	if(!has_dynam && !has_measure){
+		return NULL;
+	}
+	LinearModel *lin=(LinearModel *)malloc(sizeof(LinearModel));
+	lin->transition=NULL;
+	lin->dynam_exo=NULL;
+	lin->dynam_intercept=NULL;
+	lin->loading=NULL;
+	lin->measure_exo=NULL;
+	lin->measure_intercept=NULL;
+
+	/*the tensors are zero-filled, and the recipes set the nonzero entries only*/
+	if(has_dynam){
+		lin->transition=tensor_matrix_alloc(num_regime, nx, nx);
+		lin->dynam_exo=nu > 0? tensor_matrix_alloc(num_regime, nx, nu) : NULL;
+		lin->dynam_intercept=tensor_vector_alloc(num_regime, nx);
+		for(regime=0; regime<num_regime; regime++){
+			func_dynam(regime, param, lin->transition[regime],
+				lin->dynam_exo != NULL? lin->dynam_exo[regime] : NULL, lin->dynam_intercept[regime]);
+		}
+	}
+	if(has_measure){
+		lin->loading=tensor_matrix_alloc(num_regime, ny, nx);
+		lin->measure_exo=nu > 0? tensor_matrix_alloc(num_regime, ny, nu) : NULL;
+		lin->measure_intercept=tensor_vector_alloc(num_regime, ny);
+		for(regime=0; regime<num_regime; regime++){
+			func_measure(regime, param, lin->loading[regime],
+				lin->measure_exo != NULL? lin->measure_exo[regime] : NULL, lin->measure_intercept[regime]);
+		}
+	}
+	return lin;
+}
+
+LinearModel *linear_model_alloc(const ParamConfig *config, const Param *param){
+	return linear_model_assemble(config, config->func_linear_dynam, config->func_linear_measure, param->func_param);
+}
+
+LinearModel *linear_model_dparam_alloc(const ParamConfig *config, double *dparam){
+	return linear_model_assemble(config,
+		config->func_linear_dynam != NULL? config->func_linear_dynam_dparam : NULL,
+		config->func_linear_measure != NULL? config->func_linear_measure_dparam : NULL, dparam);
+}
+
+void linear_model_free(LinearModel *lin){
+	if(lin->transition != NULL){
+		tensor_free(lin->transition);
+		tensor_free(lin->dynam_intercept);
+	}
+	if(lin->dynam_exo != NULL){
+		tensor_free(lin->dynam_exo);
+	}
+	if(lin->loading != NULL){
+		tensor_free(lin->loading);
+		tensor_free(lin->measure_intercept);
+	}
+	if(lin->measure_exo != NULL){
+		tensor_free(lin->measure_exo);
+	}
+	free(lin);
+}
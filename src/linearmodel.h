@@ -0,0 +1,47 @@
+#ifndef LINEARMODEL_H_INCLUDED
+#define LINEARMODEL_H_INCLUDED
+
+#include <stdlib.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "data_structure.h"
+
+/**
+ * The matrices of a linear model, assembled once per parameter vector from the optional
+ * ParamConfig::func_linear_dynam and ParamConfig::func_linear_measure written by the matrix recipes.
+ * With them ext_kalmanfilter() predicts and measures as
+ *   x[t] = A x[t-1] + B u[t] + c,   y[t] = H x[t] + D u[t] + d,
+ * without calling the model functions, which assemble the same matrices on every call,
+ * and the Jacobian of the dynamics is A itself.
+ * B and D have one column per covariate of the data; covariates a recipe does not use have zero columns.
+ */
+
+typedef struct LinearModel{
+	gsl_matrix **transition; /** per regime A, or NULL when the dynamics go through func_dynam **/
+	gsl_matrix **dynam_exo; /** per regime B, or NULL without covariates **/
+	gsl_vector **dynam_intercept; /** per regime c **/
+	gsl_matrix **loading; /** per regime H, or NULL when the measurement goes through func_measure **/
+	gsl_matrix **measure_exo; /** per regime D, or NULL without covariates **/
+	gsl_vector **measure_intercept; /** per regime d **/
+} LinearModel;
+
+/**
+ * The dynamics are used for discrete-time models only; linear continuous-time dynamics are
+ * discretized by exact_discretization_alloc() instead.
+ * @return the matrices of the linear parts of the model, to be shared read-only by all threads,
+ * or NULL if no part of the model is known to be linear
+ */
+LinearModel *linear_model_alloc(const ParamConfig *config, const Param *param);
+
+/**
+ * The derivatives of the matrices of linear_model_alloc() along the direction dparam of the parameters,
+ * from the optional ParamConfig::func_linear_dynam_dparam and ParamConfig::func_linear_measure_dparam.
+ * The entries of the matrices are constants or parameters, so these are exact, and used by the tangent-linear filter.
+ * @return the derivatives, with the parts that have no derivative function left NULL,
+ * or NULL if no part of the model has one
+ */
+LinearModel *linear_model_dparam_alloc(const ParamConfig *config, double *dparam);
+
+void linear_model_free(LinearModel *lin);
+
+#endif
@@ -29,6 +29,7 @@ Note
 #include "data_structure.h"
 #include "brekfis.h"
 #include "adaodesolver.h"
+#include "dopriodesolver.h"
 #include "model.h"
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_linalg.h>
@@ -38,6 +39,7 @@ Note
 #include "wrappernegloglike.h"
 #include "numeric_derivatives.h"
 #include "estimation.h"
+#include "tensor.h"
 #include <R.h>
 #include <Rinternals.h>
 #include <Rmath.h>
@@ -57,6 +59,169 @@ SEXP getListElement(SEXP list, const char *str)
 	}
 	return elmt;
 }
+/**
+ * Hand out the rows of a matrix as gsl vectors that share its storage.
+ * The pointer array and the vector headers are a single block, released with free().
+ * @param mat the matrix
+ * @return an array of mat->size1 vectors; element t is row t of mat
+ */
+static gsl_vector **matrix_row_views(gsl_matrix *mat){
+	size_t t;
+	gsl_vector **rows = (gsl_vector **)malloc(mat->size1*(sizeof(gsl_vector *)+sizeof(gsl_vector)));
+	gsl_vector *headers = (gsl_vector *)(rows + mat->size1);
+	for(t=0; t < mat->size1; t++){
+		headers[t] = gsl_matrix_row(mat, t).vector;
+		rows[t] = &headers[t];
+	}
+	return rows;
+}
+
+/**
+ * Hand out the rows of an R data set (observed variables or covariates) as gsl vectors.
+ * The data are copied into *storage, one contiguous row per time point, so that the filter reads each y[t] without a stride.
+ * data_sexp is a double matrix with total_obs rows and dim columns, or a list (e.g., a data.frame) with columns named
+ * prefix1, prefix2, ..., in any order. The columns of a list are found in a single pass over the names and coerced to double if needed.
+ * @param data_sexp the data set
+ * @param prefix the prefix of the column names, "obs" or "covar"
+ * @param total_obs the number of time points
+ * @param dim the number of variables
+ * @param storage where the copy is kept
+ * @return an array of total_obs vectors, released with free()
+ */
+static gsl_vector **ingest_data_columns(SEXP data_sexp, const char *prefix, size_t total_obs, size_t dim, gsl_matrix **storage){
+	size_t index;
+	
+	if(isMatrix(data_sexp) && TYPEOF(data_sexp) == REALSXP && (size_t) nrows(data_sexp) == total_obs && (size_t) ncols(data_sexp) == dim){
+		/*column-major: column index starts at index*total_obs*/
+		*storage = gsl_matrix_alloc(total_obs, dim);
+		for(index=0; index < dim; index++){
+			gsl_vector_const_view column = gsl_vector_const_view_array(REAL(data_sexp)+index*total_obs, total_obs);
+			gsl_matrix_set_col(*storage, index, &column.vector);
+		}
+		return matrix_row_views(*storage);
+	}
+	
+	/*the columns are found and checked before anything is allocated on the heap, since error() does not return*/
+	SEXP *column_sexp = (SEXP *) R_alloc(dim, sizeof(SEXP));
+	for(index=0; index < dim; index++){
+		column_sexp[index] = R_NilValue;
+	}
+	SEXP names = getAttrib(data_sexp, R_NamesSymbol);
+	if(!isNewList(data_sexp) || isNull(names)){
+		error("The %s data must be a double matrix with %lu rows and %lu columns, or a list of named columns.\n", prefix, (long unsigned int) total_obs, (long unsigned int) dim);
+	}
+	size_t prefix_length = strlen(prefix);
+	for(index=0; index < (size_t) length(data_sexp); index++){
+		const char *name = CHAR(STRING_ELT(names, index));
+		char *end;
+		if(strncmp(name, prefix, prefix_length) == 0){
+			unsigned long column = strtoul(name+prefix_length, &end, 10);
+			if(*end == '\0' && column >= 1 && column <= dim){
+				column_sexp[column-1] = VECTOR_ELT(data_sexp, index);
+			}
+		}
+	}
+	for(index=0; index < dim; index++){
+		if(column_sexp[index] == R_NilValue || (size_t) length(column_sexp[index]) != total_obs){
+			error("Column %s%lu of the data is missing or has the wrong length.\n", prefix, (long unsigned int) index+1);
+		}
+	}
+	
+	*storage = gsl_matrix_calloc(total_obs, dim);
+	for(index=0; index < dim; index++){
+		SEXP column_real = PROTECT(coerceVector(column_sexp[index], REALSXP));
+		gsl_vector_const_view column = gsl_vector_const_view_array(REAL(column_real), total_obs);
+		gsl_matrix_set_col(*storage, index, &column.vector);
+		UNPROTECT(1);
+	}
+	return matrix_row_views(*storage);
+}
+
+/**
+ * Destination of the filtered moments in the R output: column-major arrays of
+ * dim_latent_var x num_col, dim_latent_var x dim_latent_var x num_col and num_regime x num_col.
+ * num_col is total_obs, or num_sbj when only the last time point of each subject is kept (index_sbj not NULL).
+ */
+typedef struct FilteredOutput{
+	double *eta;
+	double *error_cov;
+	double *pr;
+	size_t dim_latent_var;
+	size_t num_regime;
+	const size_t *index_sbj; /** first time point of each subject, or NULL to keep every time point **/
+	size_t sbj; /** subject of the next time point kept, when index_sbj is set **/
+} FilteredOutput;
+
+/**
+ * Copy the filtered moments of time points t_start, ..., t_start+num_t-1 into the R output.
+ * Also used as the chunk sink of EKimFilterStream(), whose chunks arrive in increasing t.
+ */
+static void copy_filtered_chunk(size_t t_start, size_t num_t, gsl_vector **eta_t, gsl_matrix **error_cov_t, gsl_vector **pr_t, void *sink){
+	FilteredOutput *out = (FilteredOutput *)sink;
+	size_t nx = out->dim_latent_var, nr = out->num_regime;
+	size_t i, row, col, out_col;
+	for(i=0; i<num_t; i++){
+		out_col = t_start+i;
+		if(out->index_sbj != NULL){
+			if(out_col != out->index_sbj[out->sbj+1]-1){
+				continue;
+			}
+			out_col = out->sbj++;
+		}
+		double *eta = out->eta + nx*out_col;
+		double *error_cov = out->error_cov + nx*nx*out_col;
+		double *pr = out->pr + nr*out_col;
+		for(col=0; col<nx; col++){
+			eta[col] = gsl_vector_get(eta_t[i], col);
+			for(row=0; row<nx; row++){
+				error_cov[row+nx*col] = gsl_matrix_get(error_cov_t[i], row, col);
+			}
+		}
+		for(col=0; col<nr; col++){
+			pr[col] = gsl_vector_get(pr_t[i], col);
+		}
+	}
+}
+
+/**
+ * What a model function depends on, from its optional *_dependency() address in func_address.
+ * Without one, as for hand-written model functions, it may depend on anything.
+ */
+static size_t function_dependency(SEXP f_dependency_sexp){
+	int (*f_dependency)(void);
+	if(isNull(f_dependency_sexp)){
+		return DEPEND_TIME;
+	}
+	*(void **) (&f_dependency) = R_ExternalPtrAddr(f_dependency_sexp);
+	return f_dependency == NULL ? DEPEND_TIME : (size_t) f_dependency();
+}
+
+/**
+ * The class of each regime, the first regime with the same model function, from its optional *_regime_class() address in func_address.
+ * A class that is not an earlier regime or the regime itself is ignored, together with the others.
+ * @return a malloc'ed array of num_regime classes, or NULL without one, as for hand-written model functions, where every regime may differ
+ */
+static size_t *function_regime_class(SEXP f_regime_class_sexp, size_t num_regime){
+	size_t (*f_regime_class)(size_t);
+	size_t regime, *regime_class;
+	if(isNull(f_regime_class_sexp)){
+		return NULL;
+	}
+	*(void **) (&f_regime_class) = R_ExternalPtrAddr(f_regime_class_sexp);
+	if(f_regime_class == NULL){
+		return NULL;
+	}
+	regime_class = (size_t *)malloc(num_regime*sizeof(size_t));
+	for(regime=0; regime < num_regime; regime++){
+		regime_class[regime] = f_regime_class(regime);
+		if(regime_class[regime] > regime){
+			free(regime_class);
+			return NULL;
+		}
+	}
+	return regime_class;
+}
+
 /**
  * The gateway function for the R interface
  * @param model_list is a list in R of all model specifications.
@@ -84,7 +249,8 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	
 	/** =======================Interface : Start to Set up the data and the model========================= **/
 	
-	static Data_and_Model data_model;
+	Data_and_Model data_model;
+	memset(&data_model, 0, sizeof(Data_and_Model));
 	data_model.pc.verbose_flag = (bool) verbose_flag;
 	
 	/* From the SEXP called model_list, get the list element named "num_sbj" */
@@ -132,6 +298,36 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	*(void **) (&data_model.pc.func_initial_condition) = R_ExternalPtrAddr(f_initial_condition_sexp);
 	*(void **) (&data_model.pc.func_transform) = R_ExternalPtrAddr(f_transform_sexp);
 	
+	/*whether the regime switch and noise functions can be evaluated once per parameter vector*/
+	SEXP f_regime_switch_dependency_sexp = PROTECT(getListElement(func_address_list, "f_regime_switch_dependency"));
+	SEXP f_noise_cov_dependency_sexp = PROTECT(getListElement(func_address_list, "f_noise_cov_dependency"));
+	SEXP f_dF_dx_dependency_sexp = PROTECT(getListElement(func_address_list, "f_dF_dx_dependency"));
+	data_model.pc.regime_switch_dependency = function_dependency(f_regime_switch_dependency_sexp);
+	data_model.pc.noise_cov_dependency = function_dependency(f_noise_cov_dependency_sexp);
+	data_model.pc.dF_dx_dependency = function_dependency(f_dF_dx_dependency_sexp);
+	DYNRPRINT(verbose_flag, "regime_switch_dependency: %lu, noise_cov_dependency: %lu, dF_dx_dependency: %lu\n", (long unsigned int) data_model.pc.regime_switch_dependency, (long unsigned int) data_model.pc.noise_cov_dependency, (long unsigned int) data_model.pc.dF_dx_dependency);
+	
+	/*the matrices of linear recipes, which the filter uses in place of the model functions*/
+	SEXP f_linear_dynam_sexp = PROTECT(getListElement(func_address_list, "f_linear_dynam"));
+	SEXP f_linear_measure_sexp = PROTECT(getListElement(func_address_list, "f_linear_measure"));
+	*(void **) (&data_model.pc.func_linear_dynam) = isNull(f_linear_dynam_sexp)? NULL : R_ExternalPtrAddr(f_linear_dynam_sexp);
+	*(void **) (&data_model.pc.func_linear_measure) = isNull(f_linear_measure_sexp)? NULL : R_ExternalPtrAddr(f_linear_measure_sexp);
+	DYNRPRINT(verbose_flag, "linear dynamics: %s, linear measurement: %s\n", data_model.pc.func_linear_dynam != NULL? "true" : "false", data_model.pc.func_linear_measure != NULL? "true" : "false");
+	/*and their derivatives, for the tangent-linear filter*/
+	SEXP f_linear_dynam_dparam_sexp = PROTECT(getListElement(func_address_list, "f_linear_dynam_dparam"));
+	SEXP f_linear_measure_dparam_sexp = PROTECT(getListElement(func_address_list, "f_linear_measure_dparam"));
+	*(void **) (&data_model.pc.func_linear_dynam_dparam) = isNull(f_linear_dynam_dparam_sexp)? NULL : R_ExternalPtrAddr(f_linear_dynam_dparam_sexp);
+	*(void **) (&data_model.pc.func_linear_measure_dparam) = isNull(f_linear_measure_dparam_sexp)? NULL : R_ExternalPtrAddr(f_linear_measure_dparam_sexp);
+
+	/*regimes with the same dynamics or measurement, whose regime pairs the Kim filter steps once*/
+	SEXP f_dynam_regime_class_sexp = PROTECT(getListElement(func_address_list, "f_dynam_regime_class"));
+	SEXP f_measure_regime_class_sexp = PROTECT(getListElement(func_address_list, "f_measure_regime_class"));
+	size_t *dynam_regime_class = function_regime_class(f_dynam_regime_class_sexp, data_model.pc.num_regime);
+	size_t *measure_regime_class = function_regime_class(f_measure_regime_class_sexp, data_model.pc.num_regime);
+	data_model.pc.dynam_regime_class = dynam_regime_class;
+	data_model.pc.measure_regime_class = measure_regime_class;
+	DYNRPRINT(verbose_flag, "regime classes of the dynamics: %s, of the measurement: %s\n", dynam_regime_class != NULL? "true" : "false", measure_regime_class != NULL? "true" : "false");
+	
 	/*
 	 *   data_model.pc.func_dx_dt=function_dx_dt;
 	 *   data_model.pc.func_dP_dt=function_dP_dt;
@@ -151,9 +347,11 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 		*(void **) (&data_model.pc.func_dx_dt) = R_ExternalPtrAddr(f_dx_dt_sexp);
 		*(void **) (&data_model.pc.func_dF_dx) = R_ExternalPtrAddr(f_dF_dx_sexp);
 		*(void **) (&data_model.pc.func_dP_dt) = R_ExternalPtrAddr(f_dP_dt_sexp);
-		data_model.pc.adaodesolver=false;/*true: use adapative ode solver; false: RK4*/
+		SEXP adaodesolver_sexp = PROTECT(getListElement(getListElement(model_list, "options"), "adaodesolver"));
+		data_model.pc.adaodesolver = !isNull(adaodesolver_sexp) && *LOGICAL(adaodesolver_sexp);/*true: use adapative ode solver; false: RK4*/
+		DYNRPRINT(verbose_flag, "ode solver: %s\n", data_model.pc.adaodesolver? "adaptive Dormand-Prince" : "RK4");
 		if (data_model.pc.adaodesolver){
-			data_model.pc.func_dynam=function_dynam_ada;
+			data_model.pc.func_dynam=dopri_odesolver;
 		} else {
 			data_model.pc.func_dynam=rk4_odesolver;
 		}
@@ -193,51 +391,14 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	/*covariates*/
 	SEXP covariates_sexp = PROTECT(getListElement(data_list,"covariates"));
 	
-	data_model.y=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
+	/*y[t] corresponds to y(), which is a view of row t of the data*/
+	data_model.y = ingest_data_columns(observed_sexp, "obs", data_model.pc.total_obs, data_model.pc.dim_obs_var, &data_model.y_mat);
 	size_t t;
-	for(t=0; t < data_model.pc.total_obs; t++){
-		data_model.y[t] = gsl_vector_calloc(data_model.pc.dim_obs_var);
-		/*y[t] corresponds to y(), which is a gsl_vector; loop through total_obj*/
-	}
-	
-	// Create enough_length as number of digits ( ceil(log10(x)) ) in which ever is larger: numObs or numCovar
-	// Add a few for good measure
-	size_t enough_length = (ceil( log10( (double) data_model.pc.dim_obs_var > data_model.pc.dim_co_variate ? data_model.pc.dim_obs_var : data_model.pc.dim_co_variate )) + 7) * sizeof(char);
-	char *str_number = (char *)malloc(enough_length);
-	char *str_name = (char *)malloc(enough_length+7);
-	
-	for(index=0;index<data_model.pc.dim_obs_var;index++){
-		snprintf(str_number, enough_length, "%lu", (long unsigned int) index+1);
-		snprintf(str_name, enough_length, "%s%lu", "obs", (long unsigned int) index+1);
-		/*DYNRPRINT(verbose_flag, "The str_number is %s\n",str_number);
-		  DYNRPRINT(verbose_flag, "The str_name length is %lu\n",strlen(str_name));*/
-		ptr_index = REAL(PROTECT(getListElement(observed_sexp, str_name)));
-		for(t=0; t < data_model.pc.total_obs; t++){
-			gsl_vector_set(data_model.y[t], index, ptr_index[t]);
-		}
-		UNPROTECT(1);
-	}
-	
 	
 	if (data_model.pc.dim_co_variate > 0){
-		data_model.co_variate=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-		
-		for(t=0; t < data_model.pc.total_obs; t++){
-			data_model.co_variate[t] = gsl_vector_calloc(data_model.pc.dim_co_variate);
-		}
-		
-		for(index=0; index < data_model.pc.dim_co_variate; index++){
-			snprintf(str_number, enough_length, "%lu", (long unsigned int) index+1);
-			snprintf(str_name, enough_length, "%s%lu", "covar", (long unsigned int) index+1);
-			/*DYNRPRINT(verbose_flag, "The str_number is %s\n",str_number);
-			  DYNRPRINT(verbose_flag, "The str_name length is %lu\n",strlen(str_name));*/
-			ptr_index = REAL(PROTECT(getListElement(covariates_sexp, str_name)));
-			for(t=0; t < data_model.pc.total_obs; t++){
-				gsl_vector_set(data_model.co_variate[t], index, ptr_index[t]);
-			}
-			UNPROTECT(1);
-		}
+		data_model.co_variate = ingest_data_columns(covariates_sexp, "covar", data_model.pc.total_obs, data_model.pc.dim_co_variate, &data_model.co_variate_mat);
 	} else {
+		data_model.co_variate_mat = NULL;
 		data_model.co_variate = (gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
 		
 		for(t=0; t < data_model.pc.total_obs; t++){
@@ -245,9 +406,19 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 		}
 	}
 	
+	/*missing-data patterns of the observed data*/
+	MissPattern *miss_pattern = miss_pattern_alloc(data_model.y, data_model.pc.total_obs, data_model.pc.dim_obs_var);
+	data_model.pc.miss_pattern = miss_pattern;
+	DYNRPRINT(verbose_flag, "missing-data patterns: %lu\n", (long unsigned int) miss_pattern->num_pattern);
+	
 	data_model.y_time = (double *)malloc(data_model.pc.total_obs*sizeof(double));
 	memcpy(data_model.y_time, REAL(PROTECT(getListElement(data_list, "time"))), data_model.pc.total_obs*sizeof(double));
 	
+	/*subjects with the same intervals and missing-data patterns*/
+	DesignGroups *design_groups = design_groups_alloc(data_model.y_time, data_model.pc.index_sbj, data_model.pc.num_sbj, miss_pattern);
+	data_model.pc.design_groups = design_groups;
+	DYNRPRINT(verbose_flag, "distinct designs: %lu\n", (long unsigned int) design_groups->num_group);
+	
 	/*DYNRPRINT(verbose_flag, "In main_R:\n");
 	print_vector(data_model.y[0]);
 	DYNRPRINT(verbose_flag, "\n");
@@ -270,6 +441,63 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	double *ftol_abs = REAL(ftol_abs_sexp);
 	int *maxeval = INTEGER(maxeval_sexp);
 	double *maxtime = REAL(maxtime_sexp);
+	/*whether a filter-only run may stream through the data without retaining the per-time filter output*/
+	SEXP streaming_sexp = PROTECT(getListElement(option_list, "streaming"));
+	bool streaming_flag = !isNull(streaming_sexp) && *LOGICAL(streaming_sexp);
+	/*whether the gradient for the optimizer uses central instead of forward differences*/
+	SEXP central_diff_sexp = PROTECT(getListElement(option_list, "central_diff"));
+	data_model.pc.central_diff_grad = !isNull(central_diff_sexp) && *LOGICAL(central_diff_sexp);
+	/*whether the gradient for the optimizer comes from the tangent-linear filter instead of differences*/
+	SEXP analytic_grad_sexp = PROTECT(getListElement(option_list, "analytic_grad"));
+	data_model.pc.analytic_grad = !isNull(analytic_grad_sexp) && *LOGICAL(analytic_grad_sexp);
+	DYNRPRINT(verbose_flag, "gradient: %s\n", data_model.pc.analytic_grad? "analytic" : (data_model.pc.central_diff_grad? "central differences" : "forward differences"));
+	/*whether linear continuous-time dynamics are discretized exactly instead of integrated;
+	 *this needs a constant drift matrix and process noise, and the tangent-linear filter integrates the ODEs*/
+	SEXP exact_discretization_sexp = PROTECT(getListElement(option_list, "exact_discretization"));
+	data_model.pc.exact_discretization = !isNull(exact_discretization_sexp) && *LOGICAL(exact_discretization_sexp)
+		&& data_model.pc.isContinuousTime && data_model.pc.dF_dx_dependency == DEPEND_PARAM
+		&& data_model.pc.noise_cov_dependency == DEPEND_PARAM && !data_model.pc.analytic_grad;
+	DYNRPRINT(verbose_flag, "exact discretization: %s\n", data_model.pc.exact_discretization? "true" : "false");
+	if(!isNull(exact_discretization_sexp) && *LOGICAL(exact_discretization_sexp) && data_model.pc.isContinuousTime
+			&& !data_model.pc.exact_discretization && !data_model.pc.analytic_grad){
+		warning("exact_discretization is ignored because the drift matrix or the process noise covariance is not constant. The ODEs are integrated instead.");
+	}
+	/*whether the RK4 step integrates eta and P together, with the Jacobian along the eta trajectory;
+	 *like exact_discretization, not with the tangent-linear filter*/
+	SEXP fused_ode_sexp = PROTECT(getListElement(option_list, "fused_ode"));
+	data_model.pc.fused_ode = !isNull(fused_ode_sexp) && *LOGICAL(fused_ode_sexp)
+		&& data_model.pc.isContinuousTime && !data_model.pc.adaodesolver && !data_model.pc.analytic_grad;
+	DYNRPRINT(verbose_flag, "fused ode: %s\n", data_model.pc.fused_ode? "true" : "false");
+	/*whether the filter keeps the gain once the covariance recursion has converged; the recursion is time-invariant
+	 *only with one regime, noise that depends on the parameters only and, in continuous time, exact discretization*/
+	SEXP steady_state_sexp = PROTECT(getListElement(option_list, "steady_state"));
+	data_model.pc.steady_state = !isNull(steady_state_sexp) && *LOGICAL(steady_state_sexp)
+		&& data_model.pc.num_regime == 1 && data_model.pc.noise_cov_dependency == DEPEND_PARAM
+		&& (!data_model.pc.isContinuousTime || data_model.pc.exact_discretization) && !data_model.pc.analytic_grad;
+	DYNRPRINT(verbose_flag, "steady state: %s\n", data_model.pc.steady_state? "true" : "false");
+	/*whether the filter updates Cholesky factors of the covariance matrices by QR decompositions;
+	 *the tangent-linear filter differentiates the full-matrix recursion*/
+	SEXP square_root_sexp = PROTECT(getListElement(option_list, "square_root"));
+	data_model.pc.square_root = !isNull(square_root_sexp) && *LOGICAL(square_root_sexp) && !data_model.pc.analytic_grad;
+	DYNRPRINT(verbose_flag, "square root: %s\n", data_model.pc.square_root? "true" : "false");
+	/*whether a diagonal measurement noise covariance is processed one observed entry at a time;
+	 *the tangent-linear filter keeps the joint innovation covariance*/
+	SEXP sequential_update_sexp = PROTECT(getListElement(option_list, "sequential_update"));
+	data_model.pc.sequential_update = !isNull(sequential_update_sexp) && *LOGICAL(sequential_update_sexp) && !data_model.pc.analytic_grad;
+	DYNRPRINT(verbose_flag, "sequential update: %s\n", data_model.pc.sequential_update? "true" : "false");
+	/*whether many observed entries per latent variable are processed in the latent dimension;
+	 *the tangent-linear filter keeps the joint innovation covariance*/
+	SEXP collapsed_update_sexp = PROTECT(getListElement(option_list, "collapsed_update"));
+	data_model.pc.collapsed_update = !isNull(collapsed_update_sexp) && *LOGICAL(collapsed_update_sexp) && !data_model.pc.analytic_grad;
+	DYNRPRINT(verbose_flag, "collapsed update: %s\n", data_model.pc.collapsed_update? "true" : "false");
+	/*the prior mass of a regime pair below which the Kim filter does not step it; the tangent-linear filter steps every pair*/
+	SEXP prune_threshold_sexp = PROTECT(getListElement(option_list, "prune_threshold"));
+	data_model.pc.prune_threshold = (!isNull(prune_threshold_sexp) && data_model.pc.num_regime > 1 && !data_model.pc.analytic_grad)?
+		asReal(prune_threshold_sexp) : 0.0;
+	DYNRPRINT(verbose_flag, "prune threshold: %g\n", data_model.pc.prune_threshold);
+	/*the counters of the filter runs are reported once, at the end of the fit*/
+	FilterDiagnostics diagnostics = {0, 0, 0, 0, 0, 0.0, 0.0};
+	data_model.pc.diagnostics = &diagnostics;
 	
 	/** Optimization bounds and starting values **/
 	
@@ -303,6 +531,21 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	/** =======================Interface: Model and data set up========================= **/
 	
 	/** =================Optimization: start======================**/
+	if (verbose_flag && data_model.pc.analytic_grad){
+		/*a check of the score against central differences of the likelihood, at the starting values*/
+		double grad_score[data_model.pc.num_func_param], grad_diff[data_model.pc.num_func_param];
+		function_neg_log_like_score(params, grad_score, &data_model);
+		central_diff_grad(grad_diff, params, &data_model, function_neg_log_like);
+		MYPRINT("gradient at the starting values, analytic:");
+		for (h=0; h < data_model.pc.num_func_param; h++){
+			MYPRINT(" %.10g", grad_score[h]);
+		}
+		MYPRINT("\ngradient at the starting values, central differences:");
+		for (h=0; h < data_model.pc.num_func_param; h++){
+			MYPRINT(" %.10g", grad_diff[h]);
+		}
+		MYPRINT("\n");
+	}
 	gsl_matrix *Hessian_mat=gsl_matrix_calloc(data_model.pc.num_func_param,data_model.pc.num_func_param);
 	int status;
 	if (optimization_flag){
@@ -310,6 +553,8 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 		
 		gsl_matrix *inv_Hessian_mat = gsl_matrix_calloc(data_model.pc.num_func_param, data_model.pc.num_func_param);
 		status = opt_nlopt(&data_model, data_model.pc.num_func_param, ub, lb, &minf, fittedpar, Hessian_mat, inv_Hessian_mat, xtol_rel, stopval, ftol_rel, ftol_abs, maxeval, maxtime);
+		/*the objective of the filter used for the likelihood, which with pruning differs from neg.log.likelihood below*/
+		DYNRPRINT(verbose_flag, "minimum of the objective: %.15g\n", minf);
 		
 		gsl_matrix_free(inv_Hessian_mat);
 	}else{
@@ -323,128 +568,112 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 
     /*declaritions for C program*/
 
-    size_t index_sbj_t,regime_j,regime_k;
+    size_t index_sbj_t;
+
+	/*A filter-only run streams through the data: the smoother is skipped and none of the per-time filter tensors are built*/
+	bool stream_flag = streaming_flag && !optimization_flag && !debug_flag;
+	if (streaming_flag && !stream_flag){
+		DYNRPRINT(verbose_flag, "Streaming is only used without optimization and debug output. Running the full filter and smoother.\n");
+	}
+	/*number of time points kept for the smoother output, and for the filtered output: a streaming run keeps the last time point of each subject only,
+	 *so that no output grows with the length of the series*/
+	size_t num_t_smooth = stream_flag? 0 : data_model.pc.total_obs;
+	size_t num_t_filtered = stream_flag? data_model.pc.num_sbj : data_model.pc.total_obs;
+
+	DYNRPRINT(verbose_flag, "Creating and allocating R output ... \n");
+	SEXP res_list;
+	SEXP res_names;
+
+	if (debug_flag){
+	    res_list=PROTECT(allocVector(VECSXP, 14));
+	    res_names=PROTECT(allocVector(STRSXP, 14));
+	}else{
+	    res_list=PROTECT(allocVector(VECSXP,10));
+	    res_names=PROTECT(allocVector(STRSXP, 10));
+	}
+
+	/*the filtered moments are written into the R output as the filter produces them*/
+	SEXP dims_eta_filtered=PROTECT(allocVector(INTSXP, 2));
+	memcpy(INTEGER(dims_eta_filtered), ((int[]){data_model.pc.dim_latent_var, num_t_filtered}), 2*sizeof(int));
+	SEXP eta_filtered = PROTECT(Rf_allocArray(REALSXP, dims_eta_filtered));
+	SET_STRING_ELT(res_names, 7, mkChar("eta_filtered"));
+	SET_VECTOR_ELT(res_list, 7, eta_filtered);
+	UNPROTECT(2);
+
+	SEXP dims_error_cov_filtered=PROTECT(allocVector(INTSXP, 3));
+	memcpy(INTEGER(dims_error_cov_filtered), ((int[]){data_model.pc.dim_latent_var,  data_model.pc.dim_latent_var,  num_t_filtered}),3*sizeof(int));
+	SEXP error_cov_filtered = PROTECT(Rf_allocArray(REALSXP, dims_error_cov_filtered));
+	SET_STRING_ELT(res_names, 8, mkChar("error_cov_filtered"));
+	SET_VECTOR_ELT(res_list, 8, error_cov_filtered);
+	UNPROTECT(2);
+
+	SEXP dims_pr_t_given_t=PROTECT(allocVector(INTSXP,2));
+	memcpy(INTEGER(dims_pr_t_given_t), ((int[]){data_model.pc.num_regime,  num_t_filtered}),2*sizeof(int));
+	SEXP pr_t_given_t = PROTECT(Rf_allocArray(REALSXP,dims_pr_t_given_t));
+	SET_STRING_ELT(res_names, 9, mkChar("pr_t_given_t"));
+	SET_VECTOR_ELT(res_list, 9, pr_t_given_t);
+	UNPROTECT(2);
+
+	FilteredOutput filtered_out = {REAL(eta_filtered), REAL(error_cov_filtered), REAL(pr_t_given_t),
+		data_model.pc.dim_latent_var, data_model.pc.num_regime, stream_flag? data_model.pc.index_sbj : NULL, 0};
 
 	    /**initialization**/
+	    /*each output below is a single allocation of gsl views, released with tensor_free()*/
+	    gsl_vector ***eta_regime_j_t=NULL;
+	    gsl_matrix ***error_cov_regime_j_t=NULL;
+	    gsl_vector ****eta_regime_jk_pred=NULL;
+	    gsl_matrix ****error_cov_regime_jk_pred=NULL;
+	    KimRetained *retain=NULL;
+	    gsl_vector **pr_t=NULL;
+	    gsl_vector **pr_t_given_t_minus_1=NULL;
+	    gsl_vector **eta_smooth=NULL;
+	    gsl_matrix **error_cov_smooth=NULL;
+	    gsl_vector **pr_T=NULL;
+	    gsl_vector ***transprob_T=NULL;
+	    gsl_vector **eta_t=NULL;
+	    gsl_matrix **error_cov_t=NULL;
+	    gsl_vector **eta_pred_t=NULL;
+	    gsl_matrix **error_cov_pred_t=NULL;
+	    gsl_vector **innov_v_t=NULL;
+	    gsl_matrix **residual_cov_t=NULL;
+	    if (!stream_flag){
 	    /*input and output of filter & input of smooth: eta^k_it|t*/
-	    gsl_vector ***eta_regime_j_t=(gsl_vector ***)malloc(data_model.pc.total_obs*sizeof(gsl_vector **));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		eta_regime_j_t[index_sbj_t]=(gsl_vector **)malloc(data_model.pc.num_regime*sizeof(gsl_vector *));
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    eta_regime_j_t[index_sbj_t][regime_j]=gsl_vector_calloc(data_model.pc.dim_latent_var);
-		}
-	    }
+	    eta_regime_j_t=tensor_vector2_alloc(data_model.pc.total_obs, data_model.pc.num_regime, data_model.pc.dim_latent_var);
 	    /*input and output of filter & input of smooth: error_cov^k_it|t*/
-	    gsl_matrix ***error_cov_regime_j_t=(gsl_matrix ***)malloc(data_model.pc.total_obs*sizeof(gsl_matrix **));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		error_cov_regime_j_t[index_sbj_t]=(gsl_matrix **)malloc(data_model.pc.num_regime*sizeof(gsl_matrix *));
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    error_cov_regime_j_t[index_sbj_t][regime_j]=gsl_matrix_calloc(data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
-		}
-	    }
+	    error_cov_regime_j_t=tensor_matrix2_alloc(data_model.pc.total_obs, data_model.pc.num_regime, data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
 
 	    /*output of filter and input of smooth: eta^regime_jk_it|t-1*/
-	    gsl_vector ****eta_regime_jk_pred=(gsl_vector ****)malloc(data_model.pc.total_obs*sizeof(gsl_vector ***));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		eta_regime_jk_pred[index_sbj_t]=(gsl_vector ***)malloc(data_model.pc.num_regime*sizeof(gsl_vector *));
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    eta_regime_jk_pred[index_sbj_t][regime_j]=(gsl_vector **)malloc(data_model.pc.num_regime*sizeof(gsl_vector *));
-		}
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    for(regime_k=0; regime_k<data_model.pc.num_regime; regime_k++)
-		    eta_regime_jk_pred[index_sbj_t][regime_j][regime_k]=gsl_vector_calloc(data_model.pc.dim_latent_var);
-		}
-	    }
+	    eta_regime_jk_pred=tensor_vector3_alloc(data_model.pc.total_obs, data_model.pc.num_regime, data_model.pc.num_regime, data_model.pc.dim_latent_var);
 	    /*output of filter and input of smooth: error_cov^regime_jk_it|t-1*/
-	    gsl_matrix ****error_cov_regime_jk_pred=(gsl_matrix ****)malloc(data_model.pc.total_obs*sizeof(gsl_matrix ***));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		error_cov_regime_jk_pred[index_sbj_t]=(gsl_matrix ***)malloc(data_model.pc.num_regime*sizeof(gsl_matrix **));
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    error_cov_regime_jk_pred[index_sbj_t][regime_j]=(gsl_matrix **)malloc(data_model.pc.num_regime*sizeof(gsl_matrix *));
-		}
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    for(regime_k=0; regime_k<data_model.pc.num_regime; regime_k++)
-			error_cov_regime_jk_pred[index_sbj_t][regime_j][regime_k]=gsl_matrix_calloc(data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
-		}
-	    }
+	    error_cov_regime_jk_pred=tensor_matrix3_alloc(data_model.pc.total_obs, data_model.pc.num_regime, data_model.pc.num_regime, data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
+	    /*output of filter and input of smooth: the transitions and factors of the predictions*/
+	    retain=kim_retained_alloc(&(data_model.pc));
 	    /*output of filter and input of smooth: Pr(S_it=k|Y_it)*/
-	    gsl_vector **pr_t=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		pr_t[index_sbj_t]=gsl_vector_calloc(data_model.pc.num_regime);
-	    }
+	    pr_t=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.num_regime);
 	    /*output of filter and input of smooth: Pr(S_it=k|Y_i,t-1)*/
-	    gsl_vector **pr_t_given_t_minus_1=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		pr_t_given_t_minus_1[index_sbj_t]=gsl_vector_calloc(data_model.pc.num_regime);
-	    }
+	    pr_t_given_t_minus_1=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.num_regime);
 
 	    /*output of smooth: eta_it|T*/
-	    gsl_vector **eta_smooth=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		eta_smooth[index_sbj_t]=gsl_vector_calloc(data_model.pc.dim_latent_var);
-	    }
+	    eta_smooth=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.dim_latent_var);
 	    /*output of smooth: error_cov_it|T*/
-	    gsl_matrix **error_cov_smooth=(gsl_matrix **)malloc(data_model.pc.total_obs*sizeof(gsl_matrix *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		error_cov_smooth[index_sbj_t]=gsl_matrix_calloc(data_model.pc.dim_latent_var,data_model.pc.dim_latent_var);
-	    }
+	    error_cov_smooth=tensor_matrix_alloc(data_model.pc.total_obs, data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
 	    /*output of smooth: Pr(S_it=k|Y_iT)*/
-	    gsl_vector **pr_T=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		pr_T[index_sbj_t]=gsl_vector_calloc(data_model.pc.num_regime);
-	    }
+	    pr_T=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.num_regime);
 	    /*output of smooth: Pr(S_i,t+1=h, S_it=k|Y_iT)*/
-	    gsl_vector ***transprob_T=(gsl_vector ***)malloc(data_model.pc.total_obs*sizeof(gsl_vector **));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		transprob_T[index_sbj_t]=(gsl_vector **)malloc(data_model.pc.num_regime*sizeof(gsl_vector *));
-	    }
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-		    transprob_T[index_sbj_t][regime_j]=gsl_vector_calloc(data_model.pc.num_regime);
-		}
-	    }
+	    transprob_T=tensor_vector2_alloc(data_model.pc.total_obs, data_model.pc.num_regime, data_model.pc.num_regime);
 	    /*output of filter: eta_it|t*/
-	    gsl_vector **eta_t=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		eta_t[index_sbj_t] = gsl_vector_calloc(data_model.pc.dim_latent_var);
-	    }
+	    eta_t=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.dim_latent_var);
 		/*output of filter: error_cov_it|t*/
-	    gsl_matrix **error_cov_t=(gsl_matrix **)malloc(data_model.pc.total_obs*sizeof(gsl_matrix *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		error_cov_t[index_sbj_t] = gsl_matrix_calloc(data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
-		}
+	    error_cov_t=tensor_matrix_alloc(data_model.pc.total_obs, data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
 		/*output of filter: eta_it|t-1*/
-	    gsl_vector **eta_pred_t=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		eta_pred_t[index_sbj_t] = gsl_vector_calloc(data_model.pc.dim_latent_var);
-	    }
+	    eta_pred_t=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.dim_latent_var);
 		/*output of filter: error_cov_it|t-1*/
-	    gsl_matrix **error_cov_pred_t=(gsl_matrix **)malloc(data_model.pc.total_obs*sizeof(gsl_matrix *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		error_cov_pred_t[index_sbj_t] = gsl_matrix_calloc(data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
-		}
+	    error_cov_pred_t=tensor_matrix_alloc(data_model.pc.total_obs, data_model.pc.dim_latent_var, data_model.pc.dim_latent_var);
 		/*output of filter: innovation vector*/
-	    gsl_vector **innov_v_t=(gsl_vector **)malloc(data_model.pc.total_obs*sizeof(gsl_vector *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		innov_v_t[index_sbj_t] = gsl_vector_calloc(data_model.pc.dim_obs_var);
-	    }
+	    innov_v_t=tensor_vector_alloc(data_model.pc.total_obs, data_model.pc.dim_obs_var);
 		/*output of filter: residual covariance*/
-	    gsl_matrix **residual_cov_t=(gsl_matrix **)malloc(data_model.pc.total_obs*sizeof(gsl_matrix *));
-	    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		residual_cov_t[index_sbj_t] = gsl_matrix_calloc(data_model.pc.dim_obs_var, data_model.pc.dim_obs_var);
-		}
+	    residual_cov_t=tensor_matrix_alloc(data_model.pc.total_obs, data_model.pc.dim_obs_var, data_model.pc.dim_obs_var);
+	    }
 		
 		/**Actual Functions**/
 		/** initialize regime parameter**/
@@ -490,14 +719,24 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	    /*print_matrix(par.y_noise_cov);
 	    DYNRPRINT(verbose_flag, "\n");*/
 
-        double neg_log_like=EKimFilter(data_model.y, data_model.co_variate, data_model.y_time, &(data_model.pc), &pi, &par,
-	    	eta_regime_j_t, error_cov_regime_j_t,
-			eta_regime_jk_pred, error_cov_regime_jk_pred,
-	    	pr_t, pr_t_given_t_minus_1,
-			eta_t, error_cov_t,
-			eta_pred_t, error_cov_pred_t, 
-			innov_v_t, residual_cov_t,
-			perturb_flag, rng_seed);
+	    double neg_log_like;
+	    if (stream_flag){
+	    	DYNRPRINT(verbose_flag, "Streaming filter in chunks of %lu time points.\n", (unsigned long) EKIMFILTER_STREAM_CHUNK);
+	    	neg_log_like=EKimFilterStream(data_model.y, data_model.co_variate, data_model.y_time, &(data_model.pc), &pi, &par,
+	    		EKIMFILTER_STREAM_CHUNK, copy_filtered_chunk, &filtered_out,
+	    		perturb_flag, rng_seed);
+	    }else{
+	    	neg_log_like=EKimFilter(data_model.y, data_model.co_variate, data_model.y_time, &(data_model.pc), &pi, &par,
+	    		eta_regime_j_t, error_cov_regime_j_t,
+	    		eta_regime_jk_pred, error_cov_regime_jk_pred,
+	    		pr_t, pr_t_given_t_minus_1,
+	    		eta_t, error_cov_t,
+	    		eta_pred_t, error_cov_pred_t, 
+	    		innov_v_t, residual_cov_t,
+	    		retain,
+	    		perturb_flag, rng_seed);
+	    	copy_filtered_chunk(0, data_model.pc.total_obs, eta_t, error_cov_t, pr_t, &filtered_out);
+	    }
 
 	    if (optimization_flag & ( (status < 0) | (!isfinite(neg_log_like)) ) ) {
 			MYPRINT("nlopt failed!\n");
@@ -512,28 +751,20 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 		}
 
 
-	    EKimSmoother(data_model.y_time, data_model.co_variate, &data_model.pc, &par, 
-			pr_t_given_t_minus_1, pr_t, 
-			eta_regime_jk_pred, error_cov_regime_jk_pred, 
-			eta_regime_j_t, error_cov_regime_j_t,
-			eta_smooth, error_cov_smooth, pr_T, transprob_T,
-			perturb_flag, rng_seed);
+	    if (!stream_flag){
+	    	EKimSmoother(data_model.y_time, data_model.co_variate, &data_model.pc, &par, 
+	    		pr_t_given_t_minus_1, pr_t, 
+	    		eta_regime_jk_pred, error_cov_regime_jk_pred, 
+	    		eta_regime_j_t, error_cov_regime_j_t,
+	    		eta_smooth, error_cov_smooth, pr_T, transprob_T,
+	    		retain,
+	    		perturb_flag, rng_seed);
+	    }
 
     /** =================Extended Kim Filter and Smoother: done======================**/
+	brekfis_diagnostics_print(&data_model.pc);
 
     /** =================Interface: SEXP Output====================== **/
-	DYNRPRINT(verbose_flag, "Creating and allocating R output ... \n");
-	SEXP res_list;
-	SEXP res_names;
-
-	if (debug_flag){
-	    res_list=PROTECT(allocVector(VECSXP, 14));
-	    res_names=PROTECT(allocVector(STRSXP, 14));
-	}else{
-	    res_list=PROTECT(allocVector(VECSXP,10));
-	    res_names=PROTECT(allocVector(STRSXP, 10));
-	}
-	
 	// Free the seed used for ensemble random number generation
 	gsl_rng_free(rng_seed);
 
@@ -594,11 +825,11 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
     /*eta_smooth_final: output of smooth: eta_it|T*/
     /*error_cov_smooth_final:output of smooth: error_cov_it|T*/
 	     SEXP dims_eta_smooth_final=PROTECT(allocVector(INTSXP,2));
-	     memcpy(INTEGER(dims_eta_smooth_final), ((int[]){data_model.pc.dim_latent_var, data_model.pc.total_obs}),2*sizeof(int));
+	     memcpy(INTEGER(dims_eta_smooth_final), ((int[]){data_model.pc.dim_latent_var, num_t_smooth}),2*sizeof(int));
 	     SEXP eta_smooth_final = PROTECT(Rf_allocArray(REALSXP,dims_eta_smooth_final));
 	     index=0;
 	     ptr_index=REAL(eta_smooth_final);
-	     for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
+	     for(index_sbj_t=0;index_sbj_t<num_t_smooth;index_sbj_t++){
 	         for(index_col=0; index_col<data_model.pc.dim_latent_var; index_col++){
 	             ptr_index[index]=gsl_vector_get(eta_smooth[index_sbj_t],index_col);
 	             index++;
@@ -610,11 +841,11 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	     DYNRPRINT(verbose_flag, "eta_smooth_final created and copied.\n");
 
 	     SEXP dims_error_cov_smooth_final=PROTECT(allocVector(INTSXP,3));
-	     memcpy(INTEGER(dims_error_cov_smooth_final), ((int[]){data_model.pc.dim_latent_var,  data_model.pc.dim_latent_var,  data_model.pc.total_obs}),3*sizeof(int));
+	     memcpy(INTEGER(dims_error_cov_smooth_final), ((int[]){data_model.pc.dim_latent_var,  data_model.pc.dim_latent_var,  num_t_smooth}),3*sizeof(int));
 	     SEXP error_cov_smooth_final = PROTECT(Rf_allocArray(REALSXP,dims_error_cov_smooth_final));
 	     index=0;
 	     ptr_index=REAL(error_cov_smooth_final);
-	     for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
+	     for(index_sbj_t=0;index_sbj_t<num_t_smooth;index_sbj_t++){
 	         for(index_col=0; index_col<data_model.pc.dim_latent_var; index_col++){
 	             for(index_row=0; index_row<data_model.pc.dim_latent_var; index_row++){
 	                 ptr_index[index]=gsl_matrix_get(error_cov_smooth[index_sbj_t],index_row, index_col);
@@ -628,11 +859,11 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 	     DYNRPRINT(verbose_flag, "error_cov_smooth_final created and copied.\n");
 
 		 SEXP dims_pr_t_given_T=PROTECT(allocVector(INTSXP,2));
-		 memcpy(INTEGER(dims_pr_t_given_T), ((int[]){data_model.pc.num_regime,  data_model.pc.total_obs}), 2*sizeof(int));
+		 memcpy(INTEGER(dims_pr_t_given_T), ((int[]){data_model.pc.num_regime,  num_t_smooth}), 2*sizeof(int));
 		 SEXP pr_t_given_T = PROTECT(Rf_allocArray(REALSXP,dims_pr_t_given_T));
 		 index=0;
 		 ptr_index=REAL(pr_t_given_T);
-		 for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
+		 for(index_sbj_t=0;index_sbj_t<num_t_smooth;index_sbj_t++){
 			 for(index_col=0; index_col<data_model.pc.num_regime; index_col++){
 				 ptr_index[index]=gsl_vector_get(pr_T[index_sbj_t],index_col);
 				 index++;
@@ -643,58 +874,8 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
 		 UNPROTECT(2);
 		 DYNRPRINT(verbose_flag, "pr_t_given_T created and copied.\n");
 		 
-		 SEXP dims_pr_t_given_t=PROTECT(allocVector(INTSXP,2));
-		 memcpy(INTEGER(dims_pr_t_given_t), ((int[]){data_model.pc.num_regime,  data_model.pc.total_obs}),2*sizeof(int));
-		 SEXP pr_t_given_t = PROTECT(Rf_allocArray(REALSXP,dims_pr_t_given_t));
-		 index=0;
-		 ptr_index=REAL(pr_t_given_t);
-		 for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-			 for(index_col=0; index_col<data_model.pc.num_regime; index_col++){
-				 ptr_index[index]=gsl_vector_get(pr_t[index_sbj_t],index_col);
-				 index++;
-			 }
-		 }
- 	 	 SET_STRING_ELT(res_names, 9, mkChar("pr_t_given_t"));
- 	 	 SET_VECTOR_ELT(res_list, 9, pr_t_given_t);
- 	 	 UNPROTECT(2);
-		 DYNRPRINT(verbose_flag, "pr_t_given_t created and copied.\n");
-
-		 	 
- 		/*filtered state estimate*/
- 		SEXP dims_eta_filtered=PROTECT(allocVector(INTSXP, 2));
- 		memcpy(INTEGER(dims_eta_filtered), ((int[]){data_model.pc.dim_latent_var, data_model.pc.total_obs}), 2*sizeof(int));
- 		SEXP eta_filtered = PROTECT(Rf_allocArray(REALSXP, dims_eta_filtered));
- 		index = 0;
- 		ptr_index = REAL(eta_filtered);
- 		for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
- 				for(index_col=0; index_col<data_model.pc.dim_latent_var; index_col++){
- 					ptr_index[index]=gsl_vector_get(eta_t[index_sbj_t],index_col);
- 					index++;
- 				}
- 		}
-	 	SET_STRING_ELT(res_names, 7, mkChar("eta_filtered"));
-	 	SET_VECTOR_ELT(res_list, 7, eta_filtered);
-	 	UNPROTECT(2);
-  		DYNRPRINT(verbose_flag, "eta_filtered created and copied.\n");
-		
- 		/*filtered error covariance estimate*/
- 		SEXP dims_error_cov_filtered=PROTECT(allocVector(INTSXP, 3));
- 		memcpy(INTEGER(dims_error_cov_filtered), ((int[]){data_model.pc.dim_latent_var,  data_model.pc.dim_latent_var,  data_model.pc.total_obs}),3*sizeof(int));
- 		SEXP error_cov_filtered = PROTECT(Rf_allocArray(REALSXP, dims_error_cov_filtered));
- 		index = 0;
- 		ptr_index=REAL(error_cov_filtered);
- 		for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
- 				for(index_col=0; index_col<data_model.pc.dim_latent_var; index_col++){
- 					for(index_row=0; index_row<data_model.pc.dim_latent_var; index_row++){
- 						ptr_index[index]=gsl_matrix_get(error_cov_t[index_sbj_t],index_row, index_col);
- 						index++;
- 					}
- 				}
- 		}
-	 	SET_STRING_ELT(res_names, 8, mkChar("error_cov_filtered"));
-	    SET_VECTOR_ELT(res_list, 8, error_cov_filtered);
-	    UNPROTECT(2);
-		DYNRPRINT(verbose_flag, "error_cov_filtered created and copied.\n");
+		 /*pr_t_given_t, eta_filtered and error_cov_filtered were filled in by the filter*/
+		 DYNRPRINT(verbose_flag, "pr_t_given_t, eta_filtered and error_cov_filtered copied.\n");
 
 
 	if (debug_flag){
@@ -781,22 +962,24 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
     /** =================Free Allocated space====================== **/
 	DYNRPRINT(verbose_flag, "Freeing objects before return ... \n");
     if (data_model.pc.isContinuousTime){
-			UNPROTECT(18+3+16+2);
+			UNPROTECT(30+4+23+2);
 	}else{
-			UNPROTECT(18+2+16+2);
+			UNPROTECT(30+2+23+2);
 	}
 	
-    free(str_number);
     free(data_model.pc.index_sbj);
 
-    for(index=0; index<data_model.pc.total_obs; index++){
-    gsl_vector_free(data_model.y[index]);}
     free(data_model.y);
+    gsl_matrix_free(data_model.y_mat);
 
-    for(index=0; index<data_model.pc.total_obs; index++){
-        gsl_vector_free(data_model.co_variate[index]);
-    }
     free(data_model.co_variate);
+    if (data_model.co_variate_mat != NULL){
+        gsl_matrix_free(data_model.co_variate_mat);
+    }
+    miss_pattern_free(miss_pattern);
+    design_groups_free(design_groups);
+    free(dynam_regime_class);
+    free(measure_regime_class);
 
 
     free(data_model.y_time);
@@ -827,135 +1010,25 @@ SEXP main_R(SEXP model_list, SEXP data_list, SEXP weight_flag_in, SEXP debug_fla
     free(par.func_param);
 
 
-    /*input and output of filter & input of smooth: eta^k_it|t*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            gsl_vector_free(eta_regime_j_t[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        free(eta_regime_j_t[index_sbj_t]);
-    }
-    free(eta_regime_j_t);
-
-    /*input and output of filter & input of smooth: error_cov^k_it|t*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            gsl_matrix_free(error_cov_regime_j_t[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        free(error_cov_regime_j_t[index_sbj_t]);
-    }
-    free(error_cov_regime_j_t);
-
-    /*output of filter and input of smooth: eta^regime_jk_it|t-1*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            for(regime_k=0; regime_k<data_model.pc.num_regime; regime_k++)
-            gsl_vector_free(eta_regime_jk_pred[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            free(eta_regime_jk_pred[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        free(eta_regime_jk_pred[index_sbj_t]);
-    }
-    free(eta_regime_jk_pred);
-
-    /*output of filter and input of smooth: error_cov^regime_jk_it|t-1*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            for(regime_k=0; regime_k<data_model.pc.num_regime; regime_k++)
-                gsl_matrix_free(error_cov_regime_jk_pred[index_sbj_t][regime_j][regime_k]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            free(error_cov_regime_jk_pred[index_sbj_t][regime_j]);
-        }
+    tensor_free(eta_regime_j_t);
+    tensor_free(error_cov_regime_j_t);
+    tensor_free(eta_regime_jk_pred);
+    tensor_free(error_cov_regime_jk_pred);
+    if(retain!=NULL){
+        kim_retained_free(retain);
     }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        free(error_cov_regime_jk_pred[index_sbj_t]);
-    }
-    free(error_cov_regime_jk_pred);
-
-    /*output of filter and input of smooth: Pr(S_it=k|Y_it)*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        gsl_vector_free(pr_t[index_sbj_t]);
-    }
-    free(pr_t);
-
-    /*output of filter and input of smooth: Pr(S_it=k|Y_i,t-1)*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        gsl_vector_free(pr_t_given_t_minus_1[index_sbj_t]);
-    }
-    free(pr_t_given_t_minus_1);
-
-    /*output of smooth: eta_it|T*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        gsl_vector_free(eta_smooth[index_sbj_t]);
-    }
-    free(eta_smooth);
-
-    /*output of smooth: error_cov_it|T*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        gsl_matrix_free(error_cov_smooth[index_sbj_t]);
-    }
-    free(error_cov_smooth);
-
-    /*output of smooth: Pr(S_it=k|Y_iT)*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        gsl_vector_free(pr_T[index_sbj_t]);
-    }
-    free(pr_T);
-
-    /*output of smooth: Pr(S_i,t+1=h, S_it=k|Y_iT)*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        for(regime_j=0; regime_j<data_model.pc.num_regime; regime_j++){
-            gsl_vector_free(transprob_T[index_sbj_t][regime_j]);
-        }
-    }
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-        free(transprob_T[index_sbj_t]);
-    }
-    free(transprob_T);
-	
-    /*output of filter: eta_it|t*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		gsl_vector_free(eta_t[index_sbj_t]);
-    }
-	free(eta_t);
-	/*output of filter: error_cov_it|t*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		gsl_matrix_free(error_cov_t[index_sbj_t]);
-	}
-	free(error_cov_t);
-	
-    /*output of filter: eta_it|t-1*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		gsl_vector_free(eta_pred_t[index_sbj_t]);
-    }
-	free(eta_pred_t);
-	/*output of filter: error_cov_it|t-1*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		gsl_matrix_free(error_cov_pred_t[index_sbj_t]);
-	}
-	free(error_cov_pred_t);
-	
-    /*output of filter: innovation vector*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		gsl_vector_free(innov_v_t[index_sbj_t]);
-    }
-	free(innov_v_t);
-	/*output of filter: residual covariance*/
-    for(index_sbj_t=0;index_sbj_t<data_model.pc.total_obs;index_sbj_t++){
-		gsl_matrix_free(residual_cov_t[index_sbj_t]);
-	}
-	free(residual_cov_t);
+    tensor_free(pr_t);
+    tensor_free(pr_t_given_t_minus_1);
+    tensor_free(eta_smooth);
+    tensor_free(error_cov_smooth);
+    tensor_free(pr_T);
+    tensor_free(transprob_T);
+    tensor_free(eta_t);
+    tensor_free(error_cov_t);
+    tensor_free(eta_pred_t);
+    tensor_free(error_cov_pred_t);
+    tensor_free(innov_v_t);
+    tensor_free(residual_cov_t);
 
     return res_list;
 }
@@ -6,6 +6,7 @@
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include <math.h>
+#include <float.h>
 #include <time.h>
 #include <gsl/gsl_linalg.h>
 #include <gsl/gsl_blas.h>
@@ -17,15 +18,16 @@
  * @param x the variable (column) vector
  * @param det the determinate of the cov_matrix
  * @param inv_cov_matrix the covariance matrix
+ * @param temp scratch vector of the same size as x, or NULL to allocate one here
  * @return the negative log-likelihood
  */
-double mathfunction_negloglike_multivariate_normal_invcov(const gsl_vector *x, const gsl_matrix *inv_cov_matrix, size_t num_observed, double det){
+double mathfunction_negloglike_multivariate_normal_invcov(const gsl_vector *x, const gsl_matrix *inv_cov_matrix, size_t num_observed, double det, gsl_vector *temp){
 	/*MYPRINT("x(0)=%f\n", gsl_vector_get(x, 0));*/
 	double result = 0;
 	
 	if (num_observed!=0){
 		
-		gsl_vector *y = gsl_vector_calloc(x->size); /* y will save inv_cov_matrix*x*/
+		gsl_vector *y = (temp == NULL) ? gsl_vector_calloc(x->size) : temp; /* y will save inv_cov_matrix*x*/
 		double mu; /* save result of x'*inv_cov_matrix*x*/
 		
 		/** compute the log likelihood **/
@@ -40,7 +42,9 @@ double mathfunction_negloglike_multivariate_normal_invcov(const gsl_vector *x, c
 		result += mu/2.0;
 		
 		/** free allocated space **/
-		gsl_vector_free(y);
+		if(temp == NULL){
+			gsl_vector_free(y);
+		}
 	} // else leave result at 0
 	/* All-missing case starts */
 	
@@ -61,6 +65,27 @@ double mathfunction_negloglike_multivariate_normal_invcov(const gsl_vector *x, c
 	return result;
 }
 
+/**
+ * This method computes the negative log-likelihood of a multivariate normal distribution
+ * from the Cholesky factor of its covariance matrix, with triangular solves in place of the inverse.
+ * @param x the variable (column) vector
+ * @param chol_cov_matrix the Cholesky factor L of the covariance matrix, in its lower triangle
+ * @param inv_cov_x receives the inverse covariance matrix times x
+ * @return the negative log-likelihood
+ */
+double mathfunction_negloglike_multivariate_normal_chol(const gsl_vector *x, const gsl_matrix *chol_cov_matrix, gsl_vector *inv_cov_x){
+	size_t i;
+	double mu, half_log_det = 0;
+	for(i=0; i < x->size; i++){
+		half_log_det += log(gsl_matrix_get(chol_cov_matrix, i, i));
+	}
+	gsl_vector_memcpy(inv_cov_x, x);
+	gsl_blas_dtrsv(CblasLower, CblasNoTrans, CblasNonUnit, chol_cov_matrix, inv_cov_x); /* L^{-1}x */
+	gsl_blas_ddot(inv_cov_x, inv_cov_x, &mu);
+	gsl_blas_dtrsv(CblasLower, CblasTrans, CblasNonUnit, chol_cov_matrix, inv_cov_x); /* L^{-T}L^{-1}x */
+	return (x->size/2.0)*log(M_PI*2) + half_log_det + mu/2.0;
+}
+
 /**
  * compute the inverse of a given matrix
  * @param mat the given matrix
@@ -116,6 +141,64 @@ double mathfunction_inv_matrix_det(const gsl_matrix *mat, gsl_matrix *inv_mat){
 	return det;
 }
 
+/**
+ * compute the Cholesky factor of a given matrix and returns the determinant
+ * A singular or non-positive definite matrix, by the test of mathfunction_inv_matrix_det(), gets its pseudo-inverse instead.
+ * @param mat the given matrix
+ * @param chol_mat the matrix where the Cholesky factor, in the lower triangle, or the pseudo-inverse is stored.
+ * @return the determinant, or 0 when chol_mat holds the pseudo-inverse
+ */
+double mathfunction_cholesky_det_pinv(const gsl_matrix *mat, gsl_matrix *chol_mat){
+	gsl_set_error_handler_off();
+	gsl_matrix_memcpy(chol_mat, mat);
+	int info = gsl_linalg_cholesky_decomp(chol_mat);
+	double det = mathfunction_cholesky_det(chol_mat);
+	if(fabs(det) < pow(1e-6, mat->size1) || info == GSL_EDOM){
+		gsl_matrix_memcpy(chol_mat, mat);
+		mathfunction_moore_penrose_pinv(chol_mat);
+		det = 0.0;
+	}
+	return det;
+}
+
+/**
+ * compute a lower triangular square root L of a positive semi-definite matrix, mat = LL'
+ * Pivots that are not positive, as for the states without noise in a noise covariance matrix
+ * or from rounding, give zero columns of L instead of failing.
+ * @param mat the given matrix, of which the lower triangle is used
+ * @param chol_mat the matrix where L is stored, with zeros above the diagonal
+ * @return the number of positive pivots, mat->size1 when mat is positive definite
+ */
+size_t mathfunction_cholesky_psd(const gsl_matrix *mat, gsl_matrix *chol_mat){
+	size_t n = mat->size1, i, j, k, rank = 0;
+	double s, d, tol = 0;
+	for(i=0; i < n; i++){
+		tol = fmax(tol, fabs(gsl_matrix_get(mat, i, i)));
+	}
+	tol *= n*DBL_EPSILON;
+	gsl_matrix_set_zero(chol_mat);
+	for(j=0; j < n; j++){
+		s = gsl_matrix_get(mat, j, j);
+		for(k=0; k < j; k++){
+			s -= gsl_matrix_get(chol_mat, j, k)*gsl_matrix_get(chol_mat, j, k);
+		}
+		if(!(s > tol)){
+			continue;
+		}
+		d = sqrt(s);
+		gsl_matrix_set(chol_mat, j, j, d);
+		for(i=j+1; i < n; i++){
+			s = gsl_matrix_get(mat, i, j);
+			for(k=0; k < j; k++){
+				s -= gsl_matrix_get(chol_mat, i, k)*gsl_matrix_get(chol_mat, j, k);
+			}
+			gsl_matrix_set(chol_mat, i, j, s/d);
+		}
+		rank++;
+	}
+	return rank;
+}
+
 /**
  * compute the determinant of a Cholesky matrix
  * It's just the square of the product of the diagonal elements
@@ -442,31 +525,58 @@ double mathfunction_mat_trace(const gsl_matrix *mat){
 }
 
 /**
- * This function collapses regime-dependent matrices by adding to a target matrix
- * the following weighted score:
- *	weight * [mat_add + (vec_former-vec_latter)(vec_former-vec_latter)']  (1)
- * @param vec_former the vec_former in Equation (1)
- * @param vec_latter the vec_latter in Equation (1)
- * @param mat_add the mat_add in Equation (1)
- * @param weight the weight in Equation (1) 
- * @param mat_tomodify the target square matrix to be modified.
+ * This function collapses regime-dependent covariance matrices around a given mean, over the regimes j:
+ *	mat_collapsed = scale * sum_j weight_j [mat_j + (vec_collapsed-vec_j)(vec_collapsed-vec_j)']  (1)
+ * Only the lower triangle is accumulated, with one gsl_blas_dsyr() rank-1 update per regime, and it is then mirrored.
+ * @param num the number of regimes j
+ * @param vec_collapsed the vec_collapsed in Equation (1)
+ * @param vec the vec_j in Equation (1)
+ * @param mat the mat_j in Equation (1)
+ * @param weight the weight_j in Equation (1)
+ * @param scale the scale in Equation (1), usually the reciprocal of the sum of the weights
+ * @param mat_collapsed the result.
  * @param temp_diff_vec temporary vector space holder for the difference.
- * @param temp_diff_col temporary matrix column space holder for the difference.
- * @param temp_modif_mat temporary matrix space holder.
  */
-void mathfunction_collapse(gsl_vector *vec_former, gsl_vector *vec_latter,
-	gsl_matrix *mat_add, double weight, gsl_matrix *mat_tomodify,
-	gsl_vector *temp_diff_vec, gsl_matrix *temp_diff_col, gsl_matrix *temp_modif_mat){
-	/* compute vec_former-vec_latter*/
-	gsl_vector_memcpy(temp_diff_vec, vec_former);
-	gsl_vector_sub(temp_diff_vec, vec_latter);
-	gsl_matrix_set_col(temp_diff_col, 0, temp_diff_vec);
-	/* compute (vec_former-vec_latter)(vec_former-vec_latter)'*/
-	gsl_matrix_set_zero(temp_modif_mat);
-	gsl_blas_dgemm(CblasNoTrans,CblasTrans, 1.0, temp_diff_col, temp_diff_col, 0.0, temp_modif_mat);
-	/* compute W_{i,t}{P^{k}+(vec_former-vec_latter)(vec_former-vec_latter)'}*/
-	gsl_matrix_add(temp_modif_mat, mat_add);
-	gsl_matrix_scale(temp_modif_mat, weight);
-	/* compute sum_j{}*/
-	gsl_matrix_add(mat_tomodify, temp_modif_mat);
+void mathfunction_collapse_cov(size_t num, const gsl_vector *vec_collapsed, gsl_vector *const *vec, gsl_matrix *const *mat,
+	const gsl_vector *weight, double scale, gsl_matrix *mat_collapsed, gsl_vector *temp_diff_vec){
+	size_t n=mat_collapsed->size1, j, r, c;
+	double w, *row;
+	const double *row_add;
+	gsl_matrix_set_zero(mat_collapsed);
+	for(j=0; j < num; j++){
+		w=gsl_vector_get(weight, j);
+		for(r=0; r < n; r++){
+			row=gsl_matrix_ptr(mat_collapsed, r, 0);
+			row_add=gsl_matrix_const_ptr(mat[j], r, 0);
+			for(c=0; c <= r; c++){
+				row[c]+=w*row_add[c];
+			}
+		}
+		gsl_vector_memcpy(temp_diff_vec, vec_collapsed);
+		gsl_vector_sub(temp_diff_vec, vec[j]);
+		gsl_blas_dsyr(CblasLower, w, temp_diff_vec, mat_collapsed);
+	}
+	for(r=0; r < n; r++){
+		row=gsl_matrix_ptr(mat_collapsed, r, 0);
+		for(c=0; c <= r; c++){
+			row[c]*=scale;
+			gsl_matrix_set(mat_collapsed, c, r, row[c]);
+		}
+	}
+}
+
+/**
+ * This function collapses regime-dependent means and covariance matrices together:
+ *	vec_collapsed = scale * sum_j weight_j vec_j
+ * and mat_collapsed as in mathfunction_collapse_cov() around it.
+ */
+void mathfunction_collapse_moments(size_t num, gsl_vector *const *vec, gsl_matrix *const *mat,
+	const gsl_vector *weight, double scale, gsl_vector *vec_collapsed, gsl_matrix *mat_collapsed, gsl_vector *temp_diff_vec){
+	size_t j;
+	gsl_vector_set_zero(vec_collapsed);
+	for(j=0; j < num; j++){
+		gsl_blas_daxpy(gsl_vector_get(weight, j), vec[j], vec_collapsed);
+	}
+	gsl_vector_scale(vec_collapsed, scale);
+	mathfunction_collapse_cov(num, vec_collapsed, vec, mat, weight, scale, mat_collapsed, temp_diff_vec);
 }
@@ -68,22 +68,31 @@ void mathfunction_inv_matrix(const gsl_matrix *mat, gsl_matrix *inv_mat);
  *
  **/
 void mathfunction_moore_penrose_pinv(gsl_matrix *inv_mat);
-/**
- * This function collapses regime-dependent matrices by adding to a target matrix 
- * the following weighted score:
- *	weight * [mat_add + (vec_former-vec_latter)(vec_former-vec_latter)']  (1)
- * @param vec_former the vec_former in Equation (1)
- * @param vec_latter the vec_latter in Equation (1)
- * @param mat_add the mat_add in Equation (1)
- * @param weight the weight in Equation (1) 
- * @param mat_tomodify the target square matrix to be modified.
+/** the number of gsl objects allocated by one call of mathfunction_moore_penrose_pinv() **/
+#define MATHFUNCTION_PINV_NUM_ALLOC 6
+/**
+ * This function collapses regime-dependent covariance matrices around a given mean, over the regimes j:
+ *	mat_collapsed = scale * sum_j weight_j [mat_j + (vec_collapsed-vec_j)(vec_collapsed-vec_j)']  (1)
+ * Only the lower triangle is accumulated, by one symmetric rank-1 update per regime, and it is then mirrored.
+ * @param num the number of regimes j
+ * @param vec_collapsed the vec_collapsed in Equation (1)
+ * @param vec the vec_j in Equation (1)
+ * @param mat the mat_j in Equation (1)
+ * @param weight the weight_j in Equation (1)
+ * @param scale the scale in Equation (1), usually the reciprocal of the sum of the weights
+ * @param mat_collapsed the result.
  * @param temp_diff_vec temporary vector space holder for the difference.
- * @param temp_diff_col temporary matrix column space holder for the difference.
- * @param temp_modif_mat temporary matrix space holder.
  */
-void mathfunction_collapse(gsl_vector *vec_former, gsl_vector *vec_latter, 
-	gsl_matrix *mat_add, double weight, gsl_matrix *mat_tomodify,
-	gsl_vector *temp_diff_vec, gsl_matrix *temp_diff_col, gsl_matrix *temp_modif_mat);
+void mathfunction_collapse_cov(size_t num, const gsl_vector *vec_collapsed, gsl_vector *const *vec, gsl_matrix *const *mat,
+	const gsl_vector *weight, double scale, gsl_matrix *mat_collapsed, gsl_vector *temp_diff_vec);
+
+/**
+ * This function collapses regime-dependent means and covariance matrices together:
+ *	vec_collapsed = scale * sum_j weight_j vec_j
+ * and mat_collapsed as in mathfunction_collapse_cov() around it.
+ */
+void mathfunction_collapse_moments(size_t num, gsl_vector *const *vec, gsl_matrix *const *mat,
+	const gsl_vector *weight, double scale, gsl_vector *vec_collapsed, gsl_matrix *mat_collapsed, gsl_vector *temp_diff_vec);
 	
 /**
  * This method computes the trace of the given matrix
@@ -108,9 +117,12 @@ void mathfunction_matrix_mul(const gsl_matrix *mat_a, const gsl_matrix *mat_b, b
 double mathfunction_sum_vector(const gsl_vector *vec);
 double mathfunction_min(const double x,const double y,const double z);
 double mathfunction_inv_matrix_det(const gsl_matrix *mat, gsl_matrix *inv_mat); /*via Cholesky decomp*/
+double mathfunction_cholesky_det_pinv(const gsl_matrix *mat, gsl_matrix *chol_mat); /*Cholesky factor, or the pseudo-inverse*/
+size_t mathfunction_cholesky_psd(const gsl_matrix *mat, gsl_matrix *chol_mat); /*Cholesky factor of a positive semi-definite matrix*/
 double mathfunction_cholesky_det(const gsl_matrix *mat);
 double mathfunction_inv_matrix_det_lu(const gsl_matrix *mat, gsl_matrix *inv_mat); /*via LU decomp*/
-double mathfunction_negloglike_multivariate_normal_invcov(const gsl_vector *x, const gsl_matrix *inv_cov_matrix, size_t num_observed, double det);
+double mathfunction_negloglike_multivariate_normal_invcov(const gsl_vector *x, const gsl_matrix *inv_cov_matrix, size_t num_observed, double det, gsl_vector *temp);
+double mathfunction_negloglike_multivariate_normal_chol(const gsl_vector *x, const gsl_matrix *chol_cov_matrix, gsl_vector *inv_cov_x);
 /**
  * convert a matrix (e.g.,
  * [1 4 5
@@ -6,28 +6,71 @@
 
 
 
+/**
+ * The perturbed points are independent, so they are spread over threads. With fewer parameters than subjects
+ * the loop stays serial and brekfis() runs its subjects in parallel instead.
+ * The fits at the perturbed points never print, since R output is not thread-safe.
+ */
 void forward_diff_grad(double *grad_approx, double ref_fit, const double *x, void * data, double (*func_obj)(const double *, void *))
 {
 	Data_and_Model data_model=*((Data_and_Model *)data); /*dereference the void pointer*/
+	data_model.pc.verbose_flag = false;
 	
 	double eps = 1e-4;
-	double new_point[data_model.pc.num_func_param];
-	memcpy(new_point, x, sizeof(new_point));
+	int num_param = (int) data_model.pc.num_func_param;
 	int i;
-	for(i=0; i < data_model.pc.num_func_param; i++){
+	#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) if(num_param > 1 && (size_t) num_param > data_model.pc.num_sbj)
+	#endif
+	for(i=0; i < num_param; i++){
+		double new_point[num_param];
+		memcpy(new_point, x, sizeof(new_point));
 		new_point[i] += eps;
-		grad_approx[i] = (func_obj(new_point, data) - ref_fit)/eps;
+		grad_approx[i] = (func_obj(new_point, &data_model) - ref_fit)/eps;
 		/*use exp(log(numerator) - log(denominator)) */
-		new_point[i] = x[i];
+	}
+}
+
+/**
+ * (f(x+eps) - f(x-eps))/(2 eps): twice the function evaluations of forward_diff_grad(), with O(eps^2) instead of O(eps) error.
+ * Threaded like forward_diff_grad(): serial when num_param <= num_sbj, where brekfis() runs the subjects in parallel.
+ */
+void central_diff_grad(double *grad_approx, const double *x, void * data, double (*func_obj)(const double *, void *))
+{
+	Data_and_Model data_model=*((Data_and_Model *)data); /*dereference the void pointer*/
+	data_model.pc.verbose_flag = false;
+	
+	double eps = 1e-4;
+	int num_param = (int) data_model.pc.num_func_param;
+	int i;
+	#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) if(num_param > 1 && (size_t) num_param > data_model.pc.num_sbj)
+	#endif
+	for(i=0; i < num_param; i++){
+		double new_point[num_param];
+		double f_add, f_sub;
+		memcpy(new_point, x, sizeof(new_point));
+		new_point[i] = x[i] + eps;
+		f_add = func_obj(new_point, &data_model);
+		new_point[i] = x[i] - eps;
+		f_sub = func_obj(new_point, &data_model);
+		grad_approx[i] = (f_add - f_sub)/(2*eps);
 	}
 }
 
 
 double neg_log_like_with_grad(unsigned n, const double *x, double *grad, void *my_func_data)
 {
+	if (grad && ((Data_and_Model *)my_func_data)->pc.analytic_grad) {
+		return function_neg_log_like_score(x, grad, my_func_data);
+	}
 	double fitval = function_neg_log_like(x, my_func_data);
 	if (grad) {
-		forward_diff_grad(grad, fitval, x, my_func_data, function_neg_log_like);
+		if(((Data_and_Model *)my_func_data)->pc.central_diff_grad){
+			central_diff_grad(grad, x, my_func_data, function_neg_log_like);
+		}else{
+			forward_diff_grad(grad, fitval, x, my_func_data, function_neg_log_like);
+		}
 	}
 	return fitval;
 }
@@ -82,44 +125,123 @@ void hessianR(const double *x,void *data,double (*func_obj)(const double *, void
 	}
 }
 
-void hessianRichardson(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian){
-	int i, j;
-	for(i=0; i < Hessian->size1; i++){
-		hessianOnDiagonal(x, data, func_obj, fx, Hessian, i);
-	}
+/**
+ * Evaluate func_obj at num_point points. Point p is x with parameter param[2p] moved by offset[2p] and,
+ * when param[2p+1] >= 0, parameter param[2p+1] moved by offset[2p+1].
+ * The points are independent, so they are spread over threads as in forward_diff_grad().
+ */
+static void hessian_eval_points(const double *x, void *data, double (*func_obj)(const double *, void *), size_t num_point, const int *param, const double *offset, double *f_eval){
+	Data_and_Model data_model=*((Data_and_Model *)data);/*dereference the void pointer*/
+	data_model.pc.verbose_flag = false;
 	
-	for(j=0; j < Hessian->size1; j++){
-		for(i=j+1; i < Hessian->size1; i++){
-			hessianOffDiagonal(x, data, func_obj, fx, Hessian, i, j);
+	int num_param = (int) data_model.pc.num_func_param;
+	int p;
+	#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) if(num_point > data_model.pc.num_sbj)
+	#endif
+	for(p=0; p < (int) num_point; p++){
+		double xWiggle[num_param];
+		memcpy(xWiggle, x, sizeof(xWiggle));
+		xWiggle[param[2*p]] = x[param[2*p]] + offset[2*p];
+		if(param[2*p+1] >= 0){
+			xWiggle[param[2*p+1]] = x[param[2*p+1]] + offset[2*p+1];
 		}
+		f_eval[p] = func_obj(xWiggle, &data_model);
 	}
 }
 
-void hessianOnDiagonal(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian, int index){
-	Data_and_Model data_model=*((Data_and_Model *)data);/*dereference the void pointer*/
+/*add the pair of points x +/- (i_step, j_step) to the batch; j < 0 moves parameter i only*/
+static void hessian_add_points(int *param, double *offset, size_t p, int i, double i_step, int j, double j_step){
+	param[2*p] = i;
+	param[2*p+1] = j;
+	offset[2*p] = i_step;
+	offset[2*p+1] = j_step;
+	param[2*p+2] = i;
+	param[2*p+3] = j;
+	offset[2*p+2] = -i_step;
+	offset[2*p+3] = -j_step;
+}
+
+/**
+ * The function evaluations are made in two batches. The diagonal entries come first, since the off-diagonal
+ * formula subtracts them; within each batch all evaluations are independent and run in parallel.
+ */
+void hessianRichardson(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian){
+	int num_param = (int) Hessian->size1;
+	int num_pair = num_param*(num_param-1)/2;
+	int i, j, k, q;
+	static const double v = 2.0; //Note: NumDeriv comments that this could be a parameter, but is hard-coded in the algorithm
 	
 	/*TODO Consider elaborating this to 
 	 * double d=0.1; max(fabs(d * x[index]), stepSize)
 	 *
 	*/
 	double stepSize = 1e-4;
-	int numIter = 4;
-	int k, m;
-	static const double v = 2.0; //Note: NumDeriv comments that this could be a parameter, but is hard-coded in the algorithm
-	double iOffset = (fabs(stepSize * x[index])) > stepSize ? (fabs(stepSize * x[index])) : stepSize; /* if a > b, then a, else b*/
+	/*offset of parameter i at Richardson iteration k: step[i*HESSIAN_NUM_ITER+k]*/
+	double *step = (double *)malloc(num_param*HESSIAN_NUM_ITER*sizeof(double));
+	for(i=0; i < num_param; i++){
+		double iOffset = (fabs(stepSize * x[i])) > stepSize ? (fabs(stepSize * x[i])) : stepSize; /* if a > b, then a, else b*/
+		for(k=0; k < HESSIAN_NUM_ITER; k++){
+			step[i*HESSIAN_NUM_ITER+k] = iOffset;
+			iOffset /= v;
+		}
+	}
+	
+	size_t max_point = 2*HESSIAN_NUM_ITER*(size_t)(num_param > num_pair ? num_param : num_pair);
+	int *param = (int *)calloc(2*max_point, sizeof(int));
+	double *offset = (double *)calloc(2*max_point, sizeof(double));
+	double *f_eval = (double *)malloc(max_point*sizeof(double));
+	
+	/** phase 1: diagonal entries **/
+	for(i=0; i < num_param; i++){
+		for(k=0; k < HESSIAN_NUM_ITER; k++){
+			hessian_add_points(param, offset, 2*(i*HESSIAN_NUM_ITER+k), i, step[i*HESSIAN_NUM_ITER+k], -1, 0.0);
+		}
+	}
+	hessian_eval_points(x, data, func_obj, 2*HESSIAN_NUM_ITER*num_param, param, offset, f_eval);
+	for(i=0; i < num_param; i++){
+		hessianOnDiagonal(step+i*HESSIAN_NUM_ITER, f_eval+2*HESSIAN_NUM_ITER*i, fx, Hessian, i);
+	}
+	
+	/** phase 2: off-diagonal entries **/
+	q=0;
+	for(j=0; j < num_param; j++){
+		for(i=j+1; i < num_param; i++){
+			for(k=0; k < HESSIAN_NUM_ITER; k++){
+				hessian_add_points(param, offset, 2*(q*HESSIAN_NUM_ITER+k), i, step[i*HESSIAN_NUM_ITER+k], j, step[j*HESSIAN_NUM_ITER+k]);
+			}
+			q++;
+		}
+	}
+	hessian_eval_points(x, data, func_obj, 2*HESSIAN_NUM_ITER*num_pair, param, offset, f_eval);
+	q=0;
+	for(j=0; j < num_param; j++){
+		for(i=j+1; i < num_param; i++){
+			hessianOffDiagonal(step+i*HESSIAN_NUM_ITER, step+j*HESSIAN_NUM_ITER, f_eval+2*HESSIAN_NUM_ITER*q, fx, Hessian, i, j);
+			q++;
+		}
+	}
 	
-	double xWiggle[data_model.pc.num_func_param];
-	memcpy(xWiggle, x, sizeof(xWiggle));
+	free(step);
+	free(param);
+	free(offset);
+	free(f_eval);
+}
+
+/**
+ * @param step offsets of parameter index at each Richardson iteration
+ * @param f_eval f(x + step[k]) and f(x - step[k]) at 2k and 2k+1
+ */
+void hessianOnDiagonal(const double *step, const double *f_eval, double fx, gsl_matrix *Hessian, int index){
+	int numIter = HESSIAN_NUM_ITER;
+	int k, m;
 	double Happrox[numIter];
 	
 	for(k = 0; k < numIter; k++) {
-		xWiggle[index] = x[index] + iOffset;
-		double f1 = func_obj(xWiggle, data);
-		xWiggle[index] = x[index] - iOffset;
-		double f2 = func_obj(xWiggle, data);
+		double iOffset = step[k];
+		double f1 = f_eval[2*k];
+		double f2 = f_eval[2*k+1];
 		Happrox[k] = (f1 - 2.0 * fx + f2) / (iOffset * iOffset);
-		xWiggle[index] = x[index];
-		iOffset /= v;
 	}
 	
 	for(m = 1; m < numIter; m++) {						// Richardson Step
@@ -131,32 +253,21 @@ void hessianOnDiagonal(const double *x,void *data,double (*func_obj)(const doubl
 	gsl_matrix_set(Hessian, index, index, Happrox[0]);
 }
 
-void hessianOffDiagonal(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian, int row_index, int col_index){
-	Data_and_Model data_model=*((Data_and_Model *)data);/*dereference the void pointer*/
-	
-	double stepSize = 1e-4;
-	int numIter = 4;
+/**
+ * Needs the diagonal entries row_index and col_index of Hessian.
+ * @param f_eval f(x + (row_step[k], col_step[k])) and f(x - (row_step[k], col_step[k])) at 2k and 2k+1
+ */
+void hessianOffDiagonal(const double *row_step, const double *col_step, const double *f_eval, double fx, gsl_matrix *Hessian, int row_index, int col_index){
+	int numIter = HESSIAN_NUM_ITER;
 	int k, m;
-	static const double v = 2.0; //Note: NumDeriv comments that this could be a parameter, but is hard-coded in the algorithm
-	double iOffset = (fabs(stepSize * x[row_index])) > stepSize ? (fabs(stepSize * x[row_index])) : stepSize; /* if a > b, then a, else b*/
-	double jOffset = (fabs(stepSize * x[col_index])) > stepSize ? (fabs(stepSize * x[col_index])) : stepSize;
-	
-	double xWiggle[data_model.pc.num_func_param];
-	memcpy(xWiggle, x, sizeof(xWiggle));
 	double Happrox[numIter];
 	
 	for(k = 0; k < numIter; k++) {
-		xWiggle[row_index] = x[row_index] + iOffset;
-		xWiggle[col_index] = x[col_index] + jOffset;
-		double f1 = func_obj(xWiggle, data);
-		xWiggle[row_index] = x[row_index] - iOffset;
-		xWiggle[col_index] = x[col_index] - jOffset;
-		double f2 = func_obj(xWiggle, data);
+		double iOffset = row_step[k];
+		double jOffset = col_step[k];
+		double f1 = f_eval[2*k];
+		double f2 = f_eval[2*k+1];
 		Happrox[k] = (f1 - 2.0 * fx + f2 - gsl_matrix_get(Hessian, row_index, row_index)*iOffset*iOffset - gsl_matrix_get(Hessian, col_index, col_index)*jOffset*jOffset ) / (2.0 * iOffset * jOffset);
-		xWiggle[row_index] = x[row_index];
-		xWiggle[col_index] = x[col_index];
-		iOffset /= v;
-		jOffset /= v;
 	}
 	
 	for(m = 1; m < numIter; m++) {						// Richardson Step
@@ -7,8 +7,12 @@
 #include <string.h>
 #include <math.h>/*sqrt(double),pow*/
 
+#define HESSIAN_NUM_ITER 4 /*number of step sizes in the Richardson extrapolation of hessianRichardson()*/
+
 void forward_diff_grad(double *grad_approx, double ref_fit, const double *x, void * data, double (*func_obj)(const double *, void *));
 
+void central_diff_grad(double *grad_approx, const double *x, void * data, double (*func_obj)(const double *, void *));
+
 void hessian(const double *x,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian);
 
 double neg_log_like_with_grad(unsigned n, const double *x, double *grad, void *my_func_data);
@@ -17,7 +21,7 @@ void hessianR(const double *x,void *data,double (*func_obj)(const double *, void
 
 void hessianRichardson(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian);
 
-void hessianOnDiagonal(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian, int index);
+void hessianOnDiagonal(const double *step, const double *f_eval, double fx, gsl_matrix *Hessian, int index);
 
-void hessianOffDiagonal(const double *x,void *data,double (*func_obj)(const double *, void *), double fx, gsl_matrix *Hessian, int row_index, int col_index);
+void hessianOffDiagonal(const double *row_step, const double *col_step, const double *f_eval, double fx, gsl_matrix *Hessian, int row_index, int col_index);
 
@@ -0,0 +1,665 @@
+/**
+ * This file implements the tangent-linear (sensitivity) recursion of the brekfis, which gives
+ * the derivatives of the log-likelihood with respect to the free parameters in the same pass as the likelihood.
+ * The filter itself is run by brekfis_subject(); the functions here follow each of its steps.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include "sensitivity.h"
+#include "brekfis.h"
+#include "ekf.h"
+#include "tensor.h"
+#include "print_function.h"
+
+/*ParamInit with the sizes used by function_neg_log_like()*/
+static void tangent_init_alloc(ParamInit *pi, const ParamConfig *config){
+	size_t index;
+	pi->eta_0=(gsl_vector **)malloc(config->num_regime*sizeof(gsl_vector *));
+	pi->error_cov_0=(gsl_matrix **)malloc(config->num_regime*sizeof(gsl_matrix *));
+	for(index=0; index < config->num_regime; index++){
+		pi->eta_0[index]=gsl_vector_calloc(config->num_sbj*config->dim_latent_var);
+		pi->error_cov_0[index]=gsl_matrix_calloc(config->dim_latent_var, config->dim_latent_var);
+	}
+	pi->pr_0=(gsl_vector **)malloc(config->num_sbj*sizeof(gsl_vector *));
+	for(index=0; index < config->num_sbj; index++){
+		pi->pr_0[index]=gsl_vector_calloc(config->num_regime);
+	}
+}
+
+static void tangent_init_free(ParamInit *pi, const ParamConfig *config){
+	size_t index;
+	for(index=0; index < config->num_regime; index++){
+		gsl_vector_free(pi->eta_0[index]);
+		gsl_matrix_free(pi->error_cov_0[index]);
+	}
+	for(index=0; index < config->num_sbj; index++){
+		gsl_vector_free(pi->pr_0[index]);
+	}
+	free(pi->eta_0);
+	free(pi->error_cov_0);
+	free(pi->pr_0);
+}
+
+/*the initial condition at the raw parameters x, as set up in function_neg_log_like()*/
+static void tangent_init_eval(ParamInit *pi, double *x, gsl_vector **co_variate, const ParamConfig *config){
+	size_t index;
+	for(index=0; index < config->num_regime; index++){
+		gsl_vector_set_zero(pi->eta_0[index]);
+		gsl_matrix_set_zero(pi->error_cov_0[index]);
+	}
+	for(index=0; index < config->num_sbj; index++){
+		gsl_vector_set_zero(pi->pr_0[index]);
+	}
+	config->func_initial_condition(x, co_variate, pi->pr_0, pi->eta_0, pi->error_cov_0, config->index_sbj);
+	model_constraint_init(config, pi);
+}
+
+/*out=(plus-minus)/(2*step)*/
+static void central_diff_vector(const gsl_vector *plus, const gsl_vector *minus, double step, gsl_vector *out){
+	gsl_vector_memcpy(out, plus);
+	gsl_vector_sub(out, minus);
+	gsl_vector_scale(out, 0.5/step);
+}
+
+static void central_diff_matrix(const gsl_matrix *plus, const gsl_matrix *minus, double step, gsl_matrix *out){
+	gsl_matrix_memcpy(out, plus);
+	gsl_matrix_sub(out, minus);
+	gsl_matrix_scale(out, 0.5/step);
+}
+
+ParamTangent *param_tangent_alloc(const double *params, gsl_vector **co_variate, const ParamConfig *config){
+	size_t num_param=config->num_func_param;
+	size_t i, index;
+	ParamTangent *tangent=(ParamTangent *)malloc(sizeof(ParamTangent));
+	tangent->num_param=num_param;
+	tangent->step=(double *)malloc(num_param*sizeof(double));
+	tangent->func_param_plus=(double **)malloc(num_param*sizeof(double *));
+	tangent->func_param_minus=(double **)malloc(num_param*sizeof(double *));
+	tangent->d_func_param=(double **)malloc(num_param*sizeof(double *));
+	tangent->d_linear=(LinearModel **)malloc(num_param*sizeof(LinearModel *));
+	tangent->d_eta_0=tensor_vector2_alloc(num_param, config->num_regime, config->num_sbj*config->dim_latent_var);
+	tangent->d_error_cov_0=tensor_matrix2_alloc(num_param, config->num_regime, config->dim_latent_var, config->dim_latent_var);
+	tangent->d_pr_0=tensor_vector2_alloc(num_param, config->num_sbj, config->num_regime);
+
+	ParamInit init_plus, init_minus;
+	tangent_init_alloc(&init_plus, config);
+	tangent_init_alloc(&init_minus, config);
+	double *x=(double *)malloc(num_param*sizeof(double));
+
+	for(i=0; i < num_param; i++){
+		tangent->step[i]=SCORE_STEP*(fabs(params[i]) > 1 ? fabs(params[i]) : 1);
+		tangent->func_param_plus[i]=(double *)malloc(num_param*sizeof(double));
+		tangent->func_param_minus[i]=(double *)malloc(num_param*sizeof(double));
+		tangent->d_func_param[i]=(double *)malloc(num_param*sizeof(double));
+
+		/*the initial condition takes the parameters before func_transform*/
+		memcpy(x, params, num_param*sizeof(double));
+		x[i]=params[i]+tangent->step[i];
+		tangent_init_eval(&init_plus, x, co_variate, config);
+		memcpy(tangent->func_param_plus[i], x, num_param*sizeof(double));
+		config->func_transform(tangent->func_param_plus[i]);
+
+		memcpy(x, params, num_param*sizeof(double));
+		x[i]=params[i]-tangent->step[i];
+		tangent_init_eval(&init_minus, x, co_variate, config);
+		memcpy(tangent->func_param_minus[i], x, num_param*sizeof(double));
+		config->func_transform(tangent->func_param_minus[i]);
+
+		/*func_transform only is differenced here; the matrices of linear recipes are linear in the transformed parameters*/
+		for(index=0; index < num_param; index++){
+			tangent->d_func_param[i][index]=(tangent->func_param_plus[i][index]-tangent->func_param_minus[i][index])*0.5/tangent->step[i];
+		}
+		tangent->d_linear[i]=linear_model_dparam_alloc(config, tangent->d_func_param[i]);
+
+		for(index=0; index < config->num_regime; index++){
+			central_diff_vector(init_plus.eta_0[index], init_minus.eta_0[index], tangent->step[i], tangent->d_eta_0[i][index]);
+			central_diff_matrix(init_plus.error_cov_0[index], init_minus.error_cov_0[index], tangent->step[i], tangent->d_error_cov_0[i][index]);
+		}
+		for(index=0; index < config->num_sbj; index++){
+			central_diff_vector(init_plus.pr_0[index], init_minus.pr_0[index], tangent->step[i], tangent->d_pr_0[i][index]);
+		}
+	}
+
+	free(x);
+	tangent_init_free(&init_plus, config);
+	tangent_init_free(&init_minus, config);
+	return tangent;
+}
+
+void param_tangent_free(ParamTangent *tangent, const ParamConfig *config){
+	size_t i;
+	for(i=0; i < tangent->num_param; i++){
+		free(tangent->func_param_plus[i]);
+		free(tangent->func_param_minus[i]);
+		free(tangent->d_func_param[i]);
+		if(tangent->d_linear[i] != NULL){
+			linear_model_free(tangent->d_linear[i]);
+		}
+	}
+	free(tangent->func_param_plus);
+	free(tangent->func_param_minus);
+	free(tangent->d_func_param);
+	free(tangent->d_linear);
+	free(tangent->step);
+	tensor_free(tangent->d_eta_0);
+	tensor_free(tangent->d_error_cov_0);
+	tensor_free(tangent->d_pr_0);
+	free(tangent);
+}
+
+ScoreWorkspace *score_workspace_alloc(const ParamConfig *config, const ParamTangent *tangent, const Param *param){
+	size_t num_param=config->num_func_param;
+	size_t nr=config->num_regime;
+	size_t nx=config->dim_latent_var;
+	size_t ny=config->dim_obs_var;
+	size_t nP=nx*(nx+1)/2;
+	ScoreWorkspace *ws=(ScoreWorkspace *)malloc(sizeof(ScoreWorkspace));
+
+	ws->tangent=tangent;
+	ws->d_eta_j_t=tensor_vector2_alloc(nr, num_param, nx);
+	ws->d_error_cov_j_t=tensor_matrix2_alloc(nr, num_param, nx, nx);
+	ws->d_eta_jk_t_plus_1=tensor_vector3_alloc(nr, nr, num_param, nx);
+	ws->d_error_cov_jk_t_plus_1=tensor_matrix3_alloc(nr, nr, num_param, nx, nx);
+	ws->d_pr_t=tensor_vector_alloc(num_param, nr);
+	ws->d_like_jk=tensor_matrix_alloc(num_param, nr, nr);
+	ws->d_regime_switch_mat=tensor_matrix_alloc(num_param, nr, nr);
+	ws->d_eta_noise_cov=tensor_matrix_alloc(num_param, nx, nx);
+	ws->d_y_noise_cov=tensor_matrix_alloc(num_param, ny, ny);
+	ws->d_neg_log_p=(double *)calloc(num_param, sizeof(double));
+	ws->d_log_like=(double *)calloc(num_param, sizeof(double));
+
+	ws->regime_switch_prev=gsl_matrix_alloc(nr, nr);
+	ws->eta_noise_prev=gsl_matrix_alloc(nx, nx);
+	ws->y_noise_prev=gsl_matrix_alloc(ny, ny);
+	gsl_matrix_memcpy(ws->regime_switch_prev, param->regime_switch_mat);
+	gsl_matrix_memcpy(ws->eta_noise_prev, param->eta_noise_cov);
+	gsl_matrix_memcpy(ws->y_noise_prev, param->y_noise_cov);
+
+	ws->eta_pred=gsl_vector_alloc(nx);
+	ws->error_cov_pred=gsl_matrix_alloc(nx, nx);
+	ws->innov_cov=gsl_matrix_alloc(ny, ny);
+
+	ws->obs_index=(size_t *)malloc(ny*sizeof(size_t));
+	ws->param_plus.func_param=NULL;
+	ws->param_plus.regime_switch_mat=gsl_matrix_alloc(nr, nr);
+	ws->param_plus.eta_noise_cov=gsl_matrix_alloc(nx, nx);
+	ws->param_plus.y_noise_cov=gsl_matrix_alloc(ny, ny);
+	ws->param_minus.func_param=NULL;
+	ws->param_minus.regime_switch_mat=gsl_matrix_alloc(nr, nr);
+	ws->param_minus.eta_noise_cov=gsl_matrix_alloc(nx, nx);
+	ws->param_minus.y_noise_cov=gsl_matrix_alloc(ny, ny);
+	ws->eta_plus=gsl_vector_alloc(nx);
+	ws->eta_minus=gsl_vector_alloc(nx);
+	ws->vec_plus=gsl_vector_alloc(nx);
+	ws->vec_minus=gsl_vector_alloc(nx);
+	ws->mat_plus=gsl_matrix_alloc(nx, nx);
+	ws->mat_minus=gsl_matrix_alloc(nx, nx);
+	ws->d_jacob_dynam=gsl_matrix_alloc(nx, nx);
+	ws->mat_nx=gsl_matrix_alloc(nx, nx);
+	ws->H_plus=gsl_matrix_alloc(ny, nx);
+	ws->H_minus=gsl_matrix_alloc(ny, nx);
+	ws->y_plus=gsl_vector_alloc(ny);
+	ws->y_minus=gsl_vector_alloc(ny);
+	ws->d_H_small=gsl_matrix_alloc(ny, nx);
+	ws->d_innov_v_small=gsl_vector_alloc(ny);
+	ws->d_ph_small=gsl_matrix_alloc(nx, ny);
+	ws->d_innov_cov_small=gsl_matrix_alloc(ny, ny);
+	ws->d_y_noise_cov_small=gsl_matrix_alloc(ny, ny);
+	ws->d_kalman_gain=gsl_matrix_alloc(nx, ny);
+	ws->gain_scratch=gsl_matrix_alloc(nx, ny);
+	ws->vec_ny=gsl_vector_alloc(ny);
+	ws->diff_eta=gsl_vector_alloc(nx);
+	ws->d_diff_eta=gsl_vector_alloc(nx);
+	ws->Pvec_plus=gsl_vector_alloc(nP);
+	ws->Pvec_minus=gsl_vector_alloc(nP);
+	ws->Pnew_plus=gsl_vector_alloc(nP);
+	ws->Pnew_minus=gsl_vector_alloc(nP);
+	ws->dpparams_plus=(double *)malloc((num_param+nx+nP)*sizeof(double));
+	ws->dpparams_minus=(double *)malloc((num_param+nx+nP)*sizeof(double));
+	return ws;
+}
+
+void score_workspace_free(ScoreWorkspace *ws){
+	tensor_free(ws->d_eta_j_t);
+	tensor_free(ws->d_error_cov_j_t);
+	tensor_free(ws->d_eta_jk_t_plus_1);
+	tensor_free(ws->d_error_cov_jk_t_plus_1);
+	tensor_free(ws->d_pr_t);
+	tensor_free(ws->d_like_jk);
+	tensor_free(ws->d_regime_switch_mat);
+	tensor_free(ws->d_eta_noise_cov);
+	tensor_free(ws->d_y_noise_cov);
+	free(ws->d_neg_log_p);
+	free(ws->d_log_like);
+	gsl_matrix_free(ws->regime_switch_prev);
+	gsl_matrix_free(ws->eta_noise_prev);
+	gsl_matrix_free(ws->y_noise_prev);
+	gsl_vector_free(ws->eta_pred);
+	gsl_matrix_free(ws->error_cov_pred);
+	gsl_matrix_free(ws->innov_cov);
+	free(ws->obs_index);
+	gsl_matrix_free(ws->param_plus.regime_switch_mat);
+	gsl_matrix_free(ws->param_plus.eta_noise_cov);
+	gsl_matrix_free(ws->param_plus.y_noise_cov);
+	gsl_matrix_free(ws->param_minus.regime_switch_mat);
+	gsl_matrix_free(ws->param_minus.eta_noise_cov);
+	gsl_matrix_free(ws->param_minus.y_noise_cov);
+	gsl_vector_free(ws->eta_plus);
+	gsl_vector_free(ws->eta_minus);
+	gsl_vector_free(ws->vec_plus);
+	gsl_vector_free(ws->vec_minus);
+	gsl_matrix_free(ws->mat_plus);
+	gsl_matrix_free(ws->mat_minus);
+	gsl_matrix_free(ws->d_jacob_dynam);
+	gsl_matrix_free(ws->mat_nx);
+	gsl_matrix_free(ws->H_plus);
+	gsl_matrix_free(ws->H_minus);
+	gsl_vector_free(ws->y_plus);
+	gsl_vector_free(ws->y_minus);
+	gsl_matrix_free(ws->d_H_small);
+	gsl_vector_free(ws->d_innov_v_small);
+	gsl_matrix_free(ws->d_ph_small);
+	gsl_matrix_free(ws->d_innov_cov_small);
+	gsl_matrix_free(ws->d_y_noise_cov_small);
+	gsl_matrix_free(ws->d_kalman_gain);
+	gsl_matrix_free(ws->gain_scratch);
+	gsl_vector_free(ws->vec_ny);
+	gsl_vector_free(ws->diff_eta);
+	gsl_vector_free(ws->d_diff_eta);
+	gsl_vector_free(ws->Pvec_plus);
+	gsl_vector_free(ws->Pvec_minus);
+	gsl_vector_free(ws->Pnew_plus);
+	gsl_vector_free(ws->Pnew_minus);
+	free(ws->dpparams_plus);
+	free(ws->dpparams_minus);
+	free(ws);
+}
+
+void score_first_time(ScoreWorkspace *ws, size_t sbj){
+	size_t i;
+	gsl_matrix_set_identity(ws->regime_switch_prev);
+	for(i=0; i < ws->tangent->num_param; i++){
+		gsl_matrix_set_zero(ws->d_regime_switch_mat[i]);
+		gsl_vector_memcpy(ws->d_pr_t[i], ws->tangent->d_pr_0[i][sbj]);
+	}
+}
+
+void score_regime_switch(ScoreWorkspace *ws, size_t t, size_t type, const gsl_vector *co_variate, const ParamConfig *config, const gsl_matrix *regime_switch_mat){
+	size_t i;
+	const ParamTangent *tangent=ws->tangent;
+	for(i=0; i < tangent->num_param; i++){
+		gsl_matrix_memcpy(ws->param_plus.regime_switch_mat, ws->regime_switch_prev);
+		config->func_regime_switch(t, type, tangent->func_param_plus[i], co_variate, ws->param_plus.regime_switch_mat);
+		gsl_matrix_memcpy(ws->param_minus.regime_switch_mat, ws->regime_switch_prev);
+		config->func_regime_switch(t, type, tangent->func_param_minus[i], co_variate, ws->param_minus.regime_switch_mat);
+		central_diff_matrix(ws->param_plus.regime_switch_mat, ws->param_minus.regime_switch_mat, tangent->step[i], ws->d_regime_switch_mat[i]);
+	}
+	gsl_matrix_memcpy(ws->regime_switch_prev, regime_switch_mat);
+}
+
+void score_noise_cov(ScoreWorkspace *ws, size_t t, size_t regime, const ParamConfig *config, const Param *param){
+	size_t i;
+	const ParamTangent *tangent=ws->tangent;
+	for(i=0; i < tangent->num_param; i++){
+		gsl_matrix_memcpy(ws->param_plus.eta_noise_cov, ws->eta_noise_prev);
+		gsl_matrix_memcpy(ws->param_plus.y_noise_cov, ws->y_noise_prev);
+		config->func_noise_cov(t, regime, tangent->func_param_plus[i], ws->param_plus.y_noise_cov, ws->param_plus.eta_noise_cov);
+		model_constraint_par(config, &ws->param_plus);
+		gsl_matrix_memcpy(ws->param_minus.eta_noise_cov, ws->eta_noise_prev);
+		gsl_matrix_memcpy(ws->param_minus.y_noise_cov, ws->y_noise_prev);
+		config->func_noise_cov(t, regime, tangent->func_param_minus[i], ws->param_minus.y_noise_cov, ws->param_minus.eta_noise_cov);
+		model_constraint_par(config, &ws->param_minus);
+		central_diff_matrix(ws->param_plus.eta_noise_cov, ws->param_minus.eta_noise_cov, tangent->step[i], ws->d_eta_noise_cov[i]);
+		central_diff_matrix(ws->param_plus.y_noise_cov, ws->param_minus.y_noise_cov, tangent->step[i], ws->d_y_noise_cov[i]);
+	}
+	gsl_matrix_memcpy(ws->eta_noise_prev, param->eta_noise_cov);
+	gsl_matrix_memcpy(ws->y_noise_prev, param->y_noise_cov);
+}
+
+void score_initial_state(ScoreWorkspace *ws, size_t sbj, size_t regime, const ParamConfig *config){
+	size_t i;
+	const ParamTangent *tangent=ws->tangent;
+	for(i=0; i < tangent->num_param; i++){
+		gsl_vector_const_view eta_0=gsl_vector_const_subvector(tangent->d_eta_0[i][regime], config->dim_latent_var*sbj, config->dim_latent_var);
+		gsl_vector_memcpy(ws->d_eta_j_t[regime][i], &eta_0.vector);
+		gsl_matrix_memcpy(ws->d_error_cov_j_t[regime][i], tangent->d_error_cov_0[i][regime]);
+	}
+}
+
+/*packing of P used by the continuous-time covariance update in ext_kalmanfilter()*/
+static void score_pack_cov(const gsl_matrix *P, gsl_vector *Pvec){
+	size_t i, j, nx=P->size1;
+	for(i=0; i<nx; i++){
+		gsl_vector_set(Pvec, i, gsl_matrix_get(P, i, i));
+		for(j=i+1; j<nx; j++){
+			gsl_vector_set(Pvec, i+j+nx-1, gsl_matrix_get(P, i, j));
+		}
+	}
+}
+
+static void score_unpack_cov(const gsl_vector *Pvec, gsl_matrix *P){
+	size_t i, j, nx=P->size1;
+	for(i=0; i<nx; i++){
+		gsl_matrix_set(P, i, i, gsl_vector_get(Pvec, i));
+		for(j=i+1; j<nx; j++){
+			gsl_matrix_set(P, i, j, gsl_vector_get(Pvec, i+j+nx-1));
+			gsl_matrix_set(P, j, i, gsl_vector_get(Pvec, i+j+nx-1));
+		}
+	}
+}
+
+/*dpparams of the continuous-time covariance update: parameters, eta_t and the packed process noise covariance*/
+static void score_dpparams(double *dpparams, const double *func_param, size_t num_param, const gsl_vector *eta_t, const gsl_matrix *eta_noise_cov){
+	size_t i, j, nx=eta_t->size;
+	memcpy(dpparams, func_param, num_param*sizeof(double));
+	for(i=0; i<nx; i++){
+		dpparams[num_param+i]=gsl_vector_get(eta_t, i);
+	}
+	for(i=0; i<nx; i++){
+		dpparams[num_param+nx+i]=gsl_matrix_get(eta_noise_cov, i, i);
+		for(j=i+1; j<nx; j++){
+			dpparams[num_param+nx+i+j+nx-1]=gsl_matrix_get(eta_noise_cov, i, j);
+		}
+	}
+}
+
+/**
+ * The derivatives of the prediction step: d_eta_pred and d_error_cov_pred in the tangent direction i.
+ * Linear discrete-time dynamics A eta + B u + c are differentiated with the derivatives of their matrices,
+ * other dynamic functions are differenced along (e_i, d_eta_t); in discrete time the covariance
+ * F P F' + Q is differentiated directly, in continuous time the covariance ODE is differenced along (e_i, d_eta_t, d_P_t, dQ).
+ */
+static void score_predict(ScoreWorkspace *ws, size_t i, size_t t, size_t regime,
+	const gsl_vector *eta_t, const gsl_matrix *error_cov_t, const gsl_vector *d_eta_t, const gsl_matrix *d_error_cov_t,
+	const gsl_vector *co_variate, const double *y_time, const gsl_matrix *eta_noise_cov,
+	const ParamConfig *config, const EKFWorkspace *ekf, gsl_vector *d_eta_pred, gsl_matrix *d_error_cov_pred){
+	const ParamTangent *tangent=ws->tangent;
+	double step=tangent->step[i];
+	size_t num_param=tangent->num_param;
+	const LinearModel *d_linear=tangent->d_linear[i];
+	bool isLinearDynam=ekf->linear != NULL && ekf->linear->transition != NULL && d_linear != NULL && d_linear->transition != NULL;
+
+	if(isLinearDynam){
+		/* d(A eta + B u + c) = dA eta + A d_eta + dB u + dc */
+		gsl_vector_memcpy(d_eta_pred, d_linear->dynam_intercept[regime]);
+		gsl_blas_dgemv(CblasNoTrans, 1.0, d_linear->transition[regime], eta_t, 1.0, d_eta_pred);
+		gsl_blas_dgemv(CblasNoTrans, 1.0, ekf->linear->transition[regime], d_eta_t, 1.0, d_eta_pred);
+		if(d_linear->dynam_exo != NULL){
+			gsl_blas_dgemv(CblasNoTrans, 1.0, d_linear->dynam_exo[regime], co_variate, 1.0, d_eta_pred);
+		}
+	}else{
+		gsl_vector_memcpy(ws->eta_plus, eta_t);
+		gsl_blas_daxpy(step, d_eta_t, ws->eta_plus);
+		gsl_vector_memcpy(ws->eta_minus, eta_t);
+		gsl_blas_daxpy(-step, d_eta_t, ws->eta_minus);
+		config->func_dynam(y_time[t-1], y_time[t], regime, ws->eta_plus, tangent->func_param_plus[i], num_param, co_variate, config->func_dx_dt, ws->vec_plus);
+		config->func_dynam(y_time[t-1], y_time[t], regime, ws->eta_minus, tangent->func_param_minus[i], num_param, co_variate, config->func_dx_dt, ws->vec_minus);
+		central_diff_vector(ws->vec_plus, ws->vec_minus, step, d_eta_pred);
+	}
+
+	if(config->isContinuousTime){
+		size_t n_dpparams=num_param+eta_t->size+ws->Pvec_plus->size;
+		gsl_matrix_memcpy(ws->mat_plus, error_cov_t);
+		gsl_matrix_memcpy(ws->mat_nx, d_error_cov_t);
+		gsl_matrix_scale(ws->mat_nx, step);
+		gsl_matrix_add(ws->mat_plus, ws->mat_nx);
+		gsl_matrix_memcpy(ws->mat_minus, error_cov_t);
+		gsl_matrix_sub(ws->mat_minus, ws->mat_nx);
+		score_pack_cov(ws->mat_plus, ws->Pvec_plus);
+		score_pack_cov(ws->mat_minus, ws->Pvec_minus);
+
+		gsl_matrix_memcpy(ws->mat_plus, eta_noise_cov);
+		gsl_matrix_memcpy(ws->mat_nx, ws->d_eta_noise_cov[i]);
+		gsl_matrix_scale(ws->mat_nx, step);
+		gsl_matrix_add(ws->mat_plus, ws->mat_nx);
+		gsl_matrix_memcpy(ws->mat_minus, eta_noise_cov);
+		gsl_matrix_sub(ws->mat_minus, ws->mat_nx);
+		score_dpparams(ws->dpparams_plus, tangent->func_param_plus[i], num_param, ws->eta_plus, ws->mat_plus);
+		score_dpparams(ws->dpparams_minus, tangent->func_param_minus[i], num_param, ws->eta_minus, ws->mat_minus);
+
+		config->func_dynam(y_time[t-1], y_time[t], regime, ws->Pvec_plus, ws->dpparams_plus, n_dpparams, co_variate, config->func_dP_dt, ws->Pnew_plus);
+		config->func_dynam(y_time[t-1], y_time[t], regime, ws->Pvec_minus, ws->dpparams_minus, n_dpparams, co_variate, config->func_dP_dt, ws->Pnew_minus);
+		gsl_vector_sub(ws->Pnew_plus, ws->Pnew_minus);
+		gsl_vector_scale(ws->Pnew_plus, 0.5/step);
+		score_unpack_cov(ws->Pnew_plus, d_error_cov_pred);
+	}else{
+		/*F was left in ekf->jacob_dynam and P*F' in ekf->p_jacob_dynam*/
+		if(isLinearDynam){
+			gsl_matrix_memcpy(ws->d_jacob_dynam, d_linear->transition[regime]);
+		}else{
+			gsl_matrix_set_zero(ws->mat_plus);
+			gsl_matrix_set_zero(ws->mat_minus);
+			config->func_jacob_dynam(y_time[t-1], y_time[t], regime, ws->eta_plus, tangent->func_param_plus[i], num_param, co_variate, config->func_dF_dx, ws->mat_plus);
+			config->func_jacob_dynam(y_time[t-1], y_time[t], regime, ws->eta_minus, tangent->func_param_minus[i], num_param, co_variate, config->func_dF_dx, ws->mat_minus);
+			central_diff_matrix(ws->mat_plus, ws->mat_minus, step, ws->d_jacob_dynam);
+		}
+
+		/* dF*P*F' + F*P*dF' */
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, ws->d_jacob_dynam, ekf->p_jacob_dynam, 0.0, ws->mat_nx);
+		gsl_matrix_transpose_memcpy(d_error_cov_pred, ws->mat_nx);
+		gsl_matrix_add(d_error_cov_pred, ws->mat_nx);
+		/* + F*dP*F' */
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, d_error_cov_t, ekf->jacob_dynam, 0.0, ws->mat_nx);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, ekf->jacob_dynam, ws->mat_nx, 1.0, d_error_cov_pred);
+		/* + dQ */
+		gsl_matrix_add(d_error_cov_pred, ws->d_eta_noise_cov[i]);
+	}
+}
+
+void score_ekf(ScoreWorkspace *ws, size_t t, size_t regime_j, size_t regime_k,
+	const gsl_vector *eta_t, const gsl_matrix *error_cov_t, const gsl_vector *y_t_plus_1, const gsl_vector *co_variate, const double *y_time,
+	const gsl_matrix *eta_noise_cov, const double *func_param, bool isFirstTime,
+	const ParamConfig *config, const EKFWorkspace *ekf){
+	const ParamTangent *tangent=ws->tangent;
+	size_t nx=config->dim_latent_var;
+	size_t i, a;
+
+	/* the observed entries, as found by ext_kalmanfilter() */
+	const size_t *obs_index;
+	size_t num_non_miss;
+	if(config->miss_pattern != NULL){
+		size_t pattern=config->miss_pattern->pattern_of_row[t];
+		obs_index=config->miss_pattern->obs_index + config->miss_pattern->obs_offset[pattern];
+		num_non_miss=config->miss_pattern->obs_offset[pattern+1] - config->miss_pattern->obs_offset[pattern];
+	}else{
+		num_non_miss=find_obs_index(y_t_plus_1, ws->obs_index);
+		obs_index=ws->obs_index;
+	}
+
+	/* the values ext_kalmanfilter() left in its workspace for the observed entries */
+	gsl_matrix_view H_small, ph_small, kalman_gain, inv_innov_cov_small;
+	gsl_vector_view innov_v_small, inv_innov_cov_v_small;
+	gsl_matrix_view d_H_small, d_ph_small, d_innov_cov_small, d_y_noise_cov_small, d_kalman_gain, gain_scratch;
+	gsl_vector_view d_innov_v_small, vec_ny;
+	if(num_non_miss > 0){
+		H_small=gsl_matrix_submatrix(ekf->H_small, 0, 0, num_non_miss, nx);
+		ph_small=gsl_matrix_submatrix(ekf->ph_small, 0, 0, nx, num_non_miss);
+		kalman_gain=gsl_matrix_submatrix(ekf->kalman_gain, 0, 0, nx, num_non_miss);
+		inv_innov_cov_small=gsl_matrix_submatrix(ekf->inv_innov_cov_small, 0, 0, num_non_miss, num_non_miss);
+		innov_v_small=gsl_vector_subvector(ekf->innov_v_small, 0, num_non_miss);
+		inv_innov_cov_v_small=gsl_vector_subvector(ekf->inv_innov_cov_v_small, 0, num_non_miss);
+		d_H_small=gsl_matrix_submatrix(ws->d_H_small, 0, 0, num_non_miss, nx);
+		d_ph_small=gsl_matrix_submatrix(ws->d_ph_small, 0, 0, nx, num_non_miss);
+		d_innov_cov_small=gsl_matrix_submatrix(ws->d_innov_cov_small, 0, 0, num_non_miss, num_non_miss);
+		d_y_noise_cov_small=gsl_matrix_submatrix(ws->d_y_noise_cov_small, 0, 0, num_non_miss, num_non_miss);
+		d_kalman_gain=gsl_matrix_submatrix(ws->d_kalman_gain, 0, 0, nx, num_non_miss);
+		gain_scratch=gsl_matrix_submatrix(ws->gain_scratch, 0, 0, nx, num_non_miss);
+		d_innov_v_small=gsl_vector_subvector(ws->d_innov_v_small, 0, num_non_miss);
+		vec_ny=gsl_vector_subvector(ws->vec_ny, 0, num_non_miss);
+	}
+
+	for(i=0; i < tangent->num_param; i++){
+		gsl_vector *d_eta=ws->d_eta_jk_t_plus_1[regime_j][regime_k][i];
+		gsl_matrix *d_error_cov=ws->d_error_cov_jk_t_plus_1[regime_j][regime_k][i];
+		double step=tangent->step[i];
+
+		/** prediction **/
+		if(isFirstTime){
+			gsl_vector_memcpy(d_eta, ws->d_eta_j_t[regime_j][i]);
+			gsl_matrix_memcpy(d_error_cov, ws->d_error_cov_j_t[regime_j][i]);
+		}else{
+			score_predict(ws, i, t, regime_k, eta_t, error_cov_t, ws->d_eta_j_t[regime_j][i], ws->d_error_cov_j_t[regime_j][i],
+				co_variate, y_time, eta_noise_cov, config, ekf, d_eta, d_error_cov);
+		}
+
+		ws->d_neg_log_p[i]=0;
+		if(num_non_miss == 0){
+			continue;
+		}
+
+		/** measurement: d(H eta_pred + D u + d) of a linear recipe, otherwise y_hat and H differenced along (e_i, d_eta_pred) **/
+		const LinearModel *d_linear=tangent->d_linear[i];
+		if(ekf->linear != NULL && ekf->linear->loading != NULL && d_linear != NULL && d_linear->loading != NULL){
+			gsl_matrix_memcpy(ws->H_plus, d_linear->loading[regime_k]);
+			gsl_vector_memcpy(ws->y_plus, d_linear->measure_intercept[regime_k]);
+			gsl_blas_dgemv(CblasNoTrans, 1.0, ws->H_plus, ws->eta_pred, 1.0, ws->y_plus);
+			gsl_blas_dgemv(CblasNoTrans, 1.0, ekf->linear->loading[regime_k], d_eta, 1.0, ws->y_plus);
+			if(d_linear->measure_exo != NULL){
+				gsl_blas_dgemv(CblasNoTrans, 1.0, d_linear->measure_exo[regime_k], co_variate, 1.0, ws->y_plus);
+			}
+		}else{
+			gsl_vector_memcpy(ws->eta_plus, ws->eta_pred);
+			gsl_blas_daxpy(step, d_eta, ws->eta_plus);
+			gsl_vector_memcpy(ws->eta_minus, ws->eta_pred);
+			gsl_blas_daxpy(-step, d_eta, ws->eta_minus);
+			gsl_matrix_set_zero(ws->H_plus);
+			gsl_matrix_set_zero(ws->H_minus);
+			config->func_measure(t, regime_k, tangent->func_param_plus[i], ws->eta_plus, co_variate, ws->H_plus, ws->y_plus);
+			config->func_measure(t, regime_k, tangent->func_param_minus[i], ws->eta_minus, co_variate, ws->H_minus, ws->y_minus);
+			gsl_matrix_sub(ws->H_plus, ws->H_minus);
+			gsl_matrix_scale(ws->H_plus, 0.5/step);
+			gsl_vector_sub(ws->y_plus, ws->y_minus);
+			gsl_vector_scale(ws->y_plus, 0.5/step);
+		}
+		gather_matrix_rows(ws->H_plus, obs_index, &d_H_small.matrix);
+		gather_vector(ws->y_plus, obs_index, &d_innov_v_small.vector);
+		gsl_vector_scale(&d_innov_v_small.vector, -1.0); /* the innovation is y - y_hat */
+		gather_matrix_rows_cols(ws->d_y_noise_cov[i], obs_index, &d_y_noise_cov_small.matrix);
+
+		/* d(P*H') = dP*H' + P*dH' */
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, d_error_cov, &H_small.matrix, 0.0, &d_ph_small.matrix);
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, ws->error_cov_pred, &d_H_small.matrix, 1.0, &d_ph_small.matrix);
+		/* dS = dH*P*H' + H*d(P*H') + dR */
+		gsl_matrix_memcpy(&d_innov_cov_small.matrix, &d_y_noise_cov_small.matrix);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &d_H_small.matrix, &ph_small.matrix, 1.0, &d_innov_cov_small.matrix);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &H_small.matrix, &d_ph_small.matrix, 1.0, &d_innov_cov_small.matrix);
+		/* dK = (d(P*H') - K*dS)*S^{-1} */
+		gsl_matrix_memcpy(&gain_scratch.matrix, &d_ph_small.matrix);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, -1.0, &kalman_gain.matrix, &d_innov_cov_small.matrix, 1.0, &gain_scratch.matrix);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &gain_scratch.matrix, &inv_innov_cov_small.matrix, 0.0, &d_kalman_gain.matrix);
+
+		/* -log p = (n log(2 pi) + log|S| + v'S^{-1}v)/2, so d(-log p) = tr(S^{-1} dS)/2 + dv'S^{-1}v - (S^{-1}v)'dS(S^{-1}v)/2 */
+		double trace=0, quad, lin;
+		for(a=0; a < num_non_miss; a++){
+			gsl_vector_const_view row=gsl_matrix_const_row(&inv_innov_cov_small.matrix, a);
+			gsl_vector_view col=gsl_matrix_column(&d_innov_cov_small.matrix, a);
+			double dot;
+			gsl_blas_ddot(&row.vector, &col.vector, &dot);
+			trace+=dot;
+		}
+		gsl_blas_dgemv(CblasNoTrans, 1.0, &d_innov_cov_small.matrix, &inv_innov_cov_v_small.vector, 0.0, &vec_ny.vector);
+		gsl_blas_ddot(&inv_innov_cov_v_small.vector, &vec_ny.vector, &quad);
+		gsl_blas_ddot(&d_innov_v_small.vector, &inv_innov_cov_v_small.vector, &lin);
+		ws->d_neg_log_p[i]=trace/2.0 + lin - quad/2.0;
+
+		/** update: d_eta += dK*v + K*dv; dP -= dK*(P*H')' + K*d(P*H')' **/
+		gsl_blas_dgemv(CblasNoTrans, 1.0, &d_kalman_gain.matrix, &innov_v_small.vector, 1.0, d_eta);
+		gsl_blas_dgemv(CblasNoTrans, 1.0, &kalman_gain.matrix, &d_innov_v_small.vector, 1.0, d_eta);
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, -1.0, &d_kalman_gain.matrix, &ph_small.matrix, 1.0, d_error_cov);
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, -1.0, &kalman_gain.matrix, &d_ph_small.matrix, 1.0, d_error_cov);
+	}
+}
+
+void score_like(ScoreWorkspace *ws, size_t regime_j, size_t regime_k, double pr_j, double tran_jk, double p, bool is_floored){
+	size_t i;
+	for(i=0; i < ws->tangent->num_param; i++){
+		double d_tran=gsl_vector_get(ws->d_pr_t[i], regime_j)*tran_jk + pr_j*gsl_matrix_get(ws->d_regime_switch_mat[i], regime_j, regime_k);
+		double d_p=is_floored ? 0 : -p*ws->d_neg_log_p[i];
+		gsl_matrix_set(ws->d_like_jk[i], regime_j, regime_k, d_p*pr_j*tran_jk + p*d_tran);
+	}
+}
+
+void score_normalize(ScoreWorkspace *ws, const gsl_matrix *like_jk, double like_sum, double divisor){
+	size_t i, regime_j, regime_k;
+	size_t num_regime=like_jk->size1;
+	for(i=0; i < ws->tangent->num_param; i++){
+		gsl_matrix *d_like=ws->d_like_jk[i];
+		double d_sum=0;
+		for(regime_j=0; regime_j < num_regime; regime_j++){
+			for(regime_k=0; regime_k < num_regime; regime_k++){
+				d_sum+=gsl_matrix_get(d_like, regime_j, regime_k);
+			}
+		}
+		ws->d_log_like[i]+=d_sum/like_sum/divisor;
+
+		/* like_jk holds like/like_sum, so d(like/like_sum) = (d_like - like_jk*d_sum)/like_sum */
+		for(regime_k=0; regime_k < num_regime; regime_k++){
+			double d_pr=0;
+			for(regime_j=0; regime_j < num_regime; regime_j++){
+				double d=(gsl_matrix_get(d_like, regime_j, regime_k) - gsl_matrix_get(like_jk, regime_j, regime_k)*d_sum)/like_sum;
+				gsl_matrix_set(d_like, regime_j, regime_k, d);
+				d_pr+=d;
+			}
+			gsl_vector_set(ws->d_pr_t[i], regime_k, d_pr);
+		}
+	}
+}
+
+void score_scale_pr(ScoreWorkspace *ws, double pr_sum){
+	size_t i;
+	for(i=0; i < ws->tangent->num_param; i++){
+		gsl_vector_scale(ws->d_pr_t[i], 1.0/pr_sum);
+	}
+}
+
+void score_collapse(ScoreWorkspace *ws, const ParamConfig *config,
+	gsl_vector **eta_k_t, gsl_matrix **error_cov_k_t,
+	gsl_vector ***eta_jk_t_plus_1, gsl_matrix ***error_cov_jk_t_plus_1,
+	const gsl_matrix *like_jk, const gsl_vector *pr_t){
+	size_t i, regime_j, regime_k;
+	for(regime_k=0; regime_k < config->num_regime; regime_k++){
+		double pr_k=gsl_vector_get(pr_t, regime_k);
+		for(i=0; i < ws->tangent->num_param; i++){
+			gsl_vector *d_eta=ws->d_eta_j_t[regime_k][i];
+			gsl_matrix *d_error_cov=ws->d_error_cov_j_t[regime_k][i];
+			double d_pr_k=gsl_vector_get(ws->d_pr_t[i], regime_k);
+
+			/* eta_k = sum_j w_jk eta_jk / pr_k */
+			gsl_vector_memcpy(d_eta, eta_k_t[regime_k]);
+			gsl_vector_scale(d_eta, -d_pr_k);
+			for(regime_j=0; regime_j < config->num_regime; regime_j++){
+				gsl_blas_daxpy(gsl_matrix_get(ws->d_like_jk[i], regime_j, regime_k), eta_jk_t_plus_1[regime_j][regime_k], d_eta);
+				gsl_blas_daxpy(gsl_matrix_get(like_jk, regime_j, regime_k), ws->d_eta_jk_t_plus_1[regime_j][regime_k][i], d_eta);
+			}
+			gsl_vector_scale(d_eta, 1.0/pr_k);
+
+			/* P_k = sum_j w_jk (P_jk + (eta_k-eta_jk)(eta_k-eta_jk)') / pr_k */
+			gsl_matrix_memcpy(d_error_cov, error_cov_k_t[regime_k]);
+			gsl_matrix_scale(d_error_cov, -d_pr_k);
+			for(regime_j=0; regime_j < config->num_regime; regime_j++){
+				double w=gsl_matrix_get(like_jk, regime_j, regime_k);
+				double d_w=gsl_matrix_get(ws->d_like_jk[i], regime_j, regime_k);
+				gsl_vector_memcpy(ws->diff_eta, eta_k_t[regime_k]);
+				gsl_vector_sub(ws->diff_eta, eta_jk_t_plus_1[regime_j][regime_k]);
+				gsl_vector_memcpy(ws->d_diff_eta, d_eta);
+				gsl_vector_sub(ws->d_diff_eta, ws->d_eta_jk_t_plus_1[regime_j][regime_k][i]);
+
+				gsl_matrix_memcpy(ws->mat_nx, error_cov_jk_t_plus_1[regime_j][regime_k]);
+				gsl_blas_dger(1.0, ws->diff_eta, ws->diff_eta, ws->mat_nx);
+				gsl_matrix_scale(ws->mat_nx, d_w);
+				gsl_matrix_add(d_error_cov, ws->mat_nx);
+
+				gsl_matrix_memcpy(ws->mat_nx, ws->d_error_cov_jk_t_plus_1[regime_j][regime_k][i]);
+				gsl_blas_dger(1.0, ws->d_diff_eta, ws->diff_eta, ws->mat_nx);
+				gsl_blas_dger(1.0, ws->diff_eta, ws->d_diff_eta, ws->mat_nx);
+				gsl_matrix_scale(ws->mat_nx, w);
+				gsl_matrix_add(d_error_cov, ws->mat_nx);
+			}
+			gsl_matrix_scale(d_error_cov, 1.0/pr_k);
+		}
+	}
+}
@@ -0,0 +1,167 @@
+#ifndef SENSITIVITY_H_INCLUDED
+#define SENSITIVITY_H_INCLUDED
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include "data_structure.h"
+#include "ekf.h"
+#include "linearmodel.h"
+
+/**
+ * Tangent-linear (sensitivity) version of the brekfis, used for the analytic score.
+ * Derivatives of eta, P, the innovation, its covariance, the regime probabilities and the
+ * Kim collapse with respect to each free parameter are carried along with the filter.
+ * The matrices of linear recipes come with derivative functions, see linear_model_dparam_alloc(),
+ * so the linear discrete-time dynamics and the linear measurement are differentiated exactly.
+ * The other model callbacks only provide values, so their own derivatives come from central differences
+ * of the callback alone, taken along the tangent direction (parameter, state).
+ */
+
+#define SCORE_STEP 1e-5 /*relative step of the callback differences*/
+
+/**
+ * The parameter side of the tangents, shared by all subjects
+ */
+typedef struct ParamTangent{
+	size_t num_param;
+	double *step; /** step of parameter i **/
+	double **func_param_plus; /** transformed parameters at x + step[i] e_i **/
+	double **func_param_minus; /** transformed parameters at x - step[i] e_i **/
+	double **d_func_param; /** d_func_param[i]: derivative of the transformed parameters along x_i **/
+	LinearModel **d_linear; /** d_linear[i]: derivatives of the matrices of the linear recipes along x_i, or NULL **/
+	gsl_vector ***d_eta_0; /** d_eta_0[i][regime]: derivative of init->eta_0[regime] **/
+	gsl_matrix ***d_error_cov_0; /** d_error_cov_0[i][regime]: derivative of the constrained init->error_cov_0[regime] **/
+	gsl_vector ***d_pr_0; /** d_pr_0[i][sbj]: derivative of init->pr_0[sbj] **/
+} ParamTangent;
+
+/**
+ * Tangents of the filter state of one subject, and the scratch space of their recursion.
+ * Owned by one thread, like the BrekfisWorkspace it goes with.
+ */
+typedef struct ScoreWorkspace{
+	const ParamTangent *tangent;
+	gsl_vector ***d_eta_j_t; /** [regime][param] **/
+	gsl_matrix ***d_error_cov_j_t;
+	gsl_vector ****d_eta_jk_t_plus_1; /** [regime_j][regime_k][param] **/
+	gsl_matrix ****d_error_cov_jk_t_plus_1;
+	gsl_vector **d_pr_t; /** [param] **/
+	gsl_matrix **d_like_jk;
+	gsl_matrix **d_regime_switch_mat;
+	gsl_matrix **d_eta_noise_cov;
+	gsl_matrix **d_y_noise_cov;
+	double *d_neg_log_p; /** derivatives of the last neg_log_p from ext_kalmanfilter() **/
+	double *d_log_like; /** derivatives of the log-likelihood of the current subject **/
+	/** callback outputs before the last call: the callbacks may leave entries unset **/
+	gsl_matrix *regime_switch_prev;
+	gsl_matrix *eta_noise_prev;
+	gsl_matrix *y_noise_prev;
+	/** EKF values kept for the tangent step **/
+	gsl_vector *eta_pred;
+	gsl_matrix *error_cov_pred;
+	gsl_matrix *innov_cov;
+	/** scratch **/
+	size_t *obs_index;
+	Param param_plus;
+	Param param_minus;
+	gsl_vector *eta_plus;
+	gsl_vector *eta_minus;
+	gsl_vector *vec_plus;
+	gsl_vector *vec_minus;
+	gsl_matrix *mat_plus;
+	gsl_matrix *mat_minus;
+	gsl_matrix *d_jacob_dynam;
+	gsl_matrix *mat_nx;
+	gsl_matrix *H_plus;
+	gsl_matrix *H_minus;
+	gsl_vector *y_plus;
+	gsl_vector *y_minus;
+	gsl_matrix *d_H_small;
+	gsl_vector *d_innov_v_small;
+	gsl_matrix *d_ph_small;
+	gsl_matrix *d_innov_cov_small;
+	gsl_matrix *d_y_noise_cov_small;
+	gsl_matrix *d_kalman_gain;
+	gsl_matrix *gain_scratch;
+	gsl_vector *vec_ny;
+	gsl_vector *diff_eta;
+	gsl_vector *d_diff_eta;
+	gsl_vector *Pvec_plus;
+	gsl_vector *Pvec_minus;
+	gsl_vector *Pnew_plus;
+	gsl_vector *Pnew_minus;
+	double *dpparams_plus;
+	double *dpparams_minus;
+} ScoreWorkspace;
+
+/**
+ * @param params the free parameters, before func_transform
+ * @param co_variate the covariates, passed to func_initial_condition
+ */
+ParamTangent *param_tangent_alloc(const double *params, gsl_vector **co_variate, const ParamConfig *config);
+
+void param_tangent_free(ParamTangent *tangent, const ParamConfig *config);
+
+/**
+ * @param param the parameters of the filter; its noise and regime switch matrices are the state the callbacks start from
+ */
+ScoreWorkspace *score_workspace_alloc(const ParamConfig *config, const ParamTangent *tangent, const Param *param);
+
+void score_workspace_free(ScoreWorkspace *ws);
+
+/**
+ * The regime switch matrix is the identity and the regime probabilities are init->pr_0[sbj] at the first time point of a subject
+ */
+void score_first_time(ScoreWorkspace *ws, size_t sbj);
+
+/**
+ * Derivatives of regime_switch_mat, just computed by func_regime_switch(t, type, ...)
+ */
+void score_regime_switch(ScoreWorkspace *ws, size_t t, size_t type, const gsl_vector *co_variate, const ParamConfig *config, const gsl_matrix *regime_switch_mat);
+
+/**
+ * Derivatives of the noise covariance matrices of param, just computed by func_noise_cov and model_constraint_par()
+ */
+void score_noise_cov(ScoreWorkspace *ws, size_t t, size_t regime, const ParamConfig *config, const Param *param);
+
+/**
+ * Derivatives of the initial eta and P of regime for subject sbj
+ */
+void score_initial_state(ScoreWorkspace *ws, size_t sbj, size_t regime, const ParamConfig *config);
+
+/**
+ * Tangent of one ext_kalmanfilter() step from regime_j to regime_k.
+ * Must follow that step, called with isForReturn and ws->eta_pred, ws->error_cov_pred and ws->innov_cov,
+ * since it reads the values the step left in ekf.
+ */
+void score_ekf(ScoreWorkspace *ws, size_t t, size_t regime_j, size_t regime_k,
+	const gsl_vector *eta_t, const gsl_matrix *error_cov_t, const gsl_vector *y_t_plus_1, const gsl_vector *co_variate, const double *y_time,
+	const gsl_matrix *eta_noise_cov, const double *func_param, bool isFirstTime,
+	const ParamConfig *config, const EKFWorkspace *ekf);
+
+/**
+ * Derivatives of like_jk[regime_j][regime_k] = p*pr_j*tran_jk
+ * @param p the likelihood of the last ext_kalmanfilter() step
+ * @param is_floored whether p was replaced by its lower bound
+ */
+void score_like(ScoreWorkspace *ws, size_t regime_j, size_t regime_k, double pr_j, double tran_jk, double p, bool is_floored);
+
+/**
+ * Accumulate the derivative of log(like_sum)/divisor, normalize the derivatives of like_jk and sum them into those of pr_t
+ * @param like_jk like_jk after normalization
+ */
+void score_normalize(ScoreWorkspace *ws, const gsl_matrix *like_jk, double like_sum, double divisor);
+
+/**
+ * pr_t was shifted and divided by pr_sum
+ */
+void score_scale_pr(ScoreWorkspace *ws, double pr_sum);
+
+/**
+ * Derivatives of the collapsed eta_k_t and error_cov_k_t
+ */
+void score_collapse(ScoreWorkspace *ws, const ParamConfig *config,
+	gsl_vector **eta_k_t, gsl_matrix **error_cov_k_t,
+	gsl_vector ***eta_jk_t_plus_1, gsl_matrix ***error_cov_jk_t_plus_1,
+	const gsl_matrix *like_jk, const gsl_vector *pr_t);
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * This file contains the single-allocation containers for the filter and smoother outputs.
+ * Layout of one tensor: [pointer levels][gsl headers][element data].
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <R.h>
+#include "tensor.h"
+
+#define TENSOR_MAX_LEVEL 3
+
+/*round up so that the next section starts on a double boundary*/
+static size_t tensor_align(size_t bytes){
+	size_t a=sizeof(double);
+	return (bytes+a-1)/a*a;
+}
+
+/**
+ * @param num_level number of pointer levels, 1 to TENSOR_MAX_LEVEL
+ * @param dims the extent of each level
+ * @param is_matrix whether the leaves are gsl_matrix (size1 x size2) or gsl_vector (size1)
+ */
+static void *tensor_alloc(size_t num_level, const size_t *dims, bool is_matrix, size_t size1, size_t size2){
+	size_t level, i, count[TENSOR_MAX_LEVEL], num_ptr=0;
+	size_t num_leaf=1;
+	for(level=0; level<num_level; level++){
+		num_leaf*=dims[level];
+		count[level]=num_leaf;
+		num_ptr+=num_leaf;
+	}
+	size_t leaf_size=is_matrix? size1*size2 : size1;
+	size_t header_size=is_matrix? sizeof(gsl_matrix) : sizeof(gsl_vector);
+	size_t ptr_bytes=tensor_align(num_ptr*sizeof(void *));
+	size_t header_bytes=tensor_align(num_leaf*header_size);
+
+	char *base=(char *)calloc(1, ptr_bytes+header_bytes+num_leaf*leaf_size*sizeof(double));
+	if(base==NULL)
+		error("Unable to allocate %lu bytes for the filter output.\n", (unsigned long)(ptr_bytes+header_bytes+num_leaf*leaf_size*sizeof(double)));
+
+	/*each pointer level points into the next one; the last level points at the headers*/
+	void **ptr=(void **)base;
+	char *header=base+ptr_bytes;
+	double *data=(double *)(header+header_bytes);
+	for(level=0; level<num_level; level++){
+		void **next=ptr+count[level];
+		for(i=0; i<count[level]; i++){
+			if(level+1<num_level)
+				ptr[i]=(void *)(next+i*dims[level+1]);
+			else
+				ptr[i]=(void *)(header+i*header_size);
+		}
+		ptr=next;
+	}
+
+	for(i=0; i<num_leaf; i++){
+		if(is_matrix){
+			gsl_matrix *m=(gsl_matrix *)(header+i*header_size);
+			m->size1=size1;
+			m->size2=size2;
+			m->tda=size2;
+			m->data=data+i*leaf_size;
+			m->block=NULL;
+			m->owner=0;
+		}else{
+			gsl_vector *v=(gsl_vector *)(header+i*header_size);
+			v->size=size1;
+			v->stride=1;
+			v->data=data+i*leaf_size;
+			v->block=NULL;
+			v->owner=0;
+		}
+	}
+	return (void *)base;
+}
+
+gsl_vector **tensor_vector_alloc(size_t n0, size_t size){
+	size_t dims[1]={n0};
+	return (gsl_vector **)tensor_alloc(1, dims, false, size, 1);
+}
+
+gsl_vector ***tensor_vector2_alloc(size_t n0, size_t n1, size_t size){
+	size_t dims[2]={n0, n1};
+	return (gsl_vector ***)tensor_alloc(2, dims, false, size, 1);
+}
+
+gsl_vector ****tensor_vector3_alloc(size_t n0, size_t n1, size_t n2, size_t size){
+	size_t dims[3]={n0, n1, n2};
+	return (gsl_vector ****)tensor_alloc(3, dims, false, size, 1);
+}
+
+gsl_matrix **tensor_matrix_alloc(size_t n0, size_t size1, size_t size2){
+	size_t dims[1]={n0};
+	return (gsl_matrix **)tensor_alloc(1, dims, true, size1, size2);
+}
+
+gsl_matrix ***tensor_matrix2_alloc(size_t n0, size_t n1, size_t size1, size_t size2){
+	size_t dims[2]={n0, n1};
+	return (gsl_matrix ***)tensor_alloc(2, dims, true, size1, size2);
+}
+
+gsl_matrix ****tensor_matrix3_alloc(size_t n0, size_t n1, size_t n2, size_t size1, size_t size2){
+	size_t dims[3]={n0, n1, n2};
+	return (gsl_matrix ****)tensor_alloc(3, dims, true, size1, size2);
+}
+
+void tensor_free(void *tensor){
+	free(tensor);
+}
@@ -0,0 +1,55 @@
+#ifndef TENSOR_H_INCLUDED
+#define TENSOR_H_INCLUDED
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+
+/**
+ * Arrays of equally sized gsl vectors and matrices, indexed like the usual pointer trees
+ * (e.g., x[t][j][k]), but carved out of a single zero-initialized allocation:
+ * the pointer levels, the gsl headers (views with owner=0) and the element data.
+ * The elements must not be passed to gsl_vector_free() or gsl_matrix_free();
+ * the whole tensor is released with one call to tensor_free().
+ */
+
+/**
+ * @param n0 number of vectors
+ * @param size length of each vector
+ * @return x with x[i] for i<n0
+ */
+gsl_vector **tensor_vector_alloc(size_t n0, size_t size);
+
+/**
+ * @return x with x[i][j] for i<n0, j<n1
+ */
+gsl_vector ***tensor_vector2_alloc(size_t n0, size_t n1, size_t size);
+
+/**
+ * @return x with x[i][j][k] for i<n0, j<n1, k<n2
+ */
+gsl_vector ****tensor_vector3_alloc(size_t n0, size_t n1, size_t n2, size_t size);
+
+/**
+ * @param n0 number of matrices
+ * @param size1 number of rows of each matrix
+ * @param size2 number of columns of each matrix
+ * @return x with x[i] for i<n0
+ */
+gsl_matrix **tensor_matrix_alloc(size_t n0, size_t size1, size_t size2);
+
+/**
+ * @return x with x[i][j] for i<n0, j<n1
+ */
+gsl_matrix ***tensor_matrix2_alloc(size_t n0, size_t n1, size_t size1, size_t size2);
+
+/**
+ * @return x with x[i][j][k] for i<n0, j<n1, k<n2
+ */
+gsl_matrix ****tensor_matrix3_alloc(size_t n0, size_t n1, size_t n2, size_t size1, size_t size2);
+
+/**
+ * Release a tensor returned by any of the allocators above. NULL is ignored.
+ */
+void tensor_free(void *tensor);
+
+#endif
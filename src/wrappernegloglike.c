@@ -10,7 +10,10 @@
 #include "wrappernegloglike.h"
 
 
-double function_neg_log_like(const double *params, void *data){
+/**
+ * The negative log-likelihood at params, and its gradient when grad is not NULL
+ */
+static double neg_log_like_eval(const double *params, double *grad, void *data){
 	double neg_log_like;
 	size_t index;
 	
@@ -81,7 +84,13 @@ double function_neg_log_like(const double *params, void *data){
 	data_model.pc.func_transform(par.func_param);
 	model_constraint_init(&data_model.pc, &pi);
 	
-	neg_log_like = brekfis(data_model.y, data_model.co_variate, data_model.pc.total_obs, data_model.y_time, &data_model.pc, &pi, &par);
+	if(grad == NULL){
+		neg_log_like = brekfis(data_model.y, data_model.co_variate, data_model.pc.total_obs, data_model.y_time, &data_model.pc, &pi, &par);
+	}else{
+		ParamTangent *tangent = param_tangent_alloc(params, data_model.co_variate, &data_model.pc);
+		neg_log_like = brekfis_score(data_model.y, data_model.co_variate, data_model.pc.total_obs, data_model.y_time, &data_model.pc, &pi, &par, tangent, grad);
+		param_tangent_free(tangent, &data_model.pc);
+	}
 	// Carry verbose argument from mainR.c into this function and only print the likelihood
 	//  here if requested.
 	if(data_model.pc.verbose_flag){
@@ -113,5 +122,17 @@ double function_neg_log_like(const double *params, void *data){
 	return neg_log_like;
 }
 
+double function_neg_log_like(const double *params, void *data){
+	return neg_log_like_eval(params, NULL, data);
+}
+
+/**
+ * The negative log-likelihood and its analytic gradient, from one pass of the tangent-linear filter
+ * @param grad receives the gradient with respect to the free parameters
+ */
+double function_neg_log_like_score(const double *params, double *grad, void *data){
+	return neg_log_like_eval(params, grad, data);
+}
+
 
 
@@ -16,4 +16,5 @@
 #include <time.h>
 #include "print_function.h"
 double function_neg_log_like(const double *params, void *data);
+double function_neg_log_like_score(const double *params, double *grad, void *data);
 #endif